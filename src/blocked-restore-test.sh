@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+##############################################################################
+# tests that an interrupted session of the blocked rules x words mode
+# (WordlistBlockedRules) resumes where it was rather than starting over.  The
+# hashes are raw-sha1 ones of best64 candidates from all over a wordlist that
+# is much larger than --mem-file-size.  The session is interrupted every DELAY
+# seconds and restored until it completes, then all of them must have been
+# cracked.
+#
+# usage:
+#    ./blocked-restore-test.sh           (interrupts every 0.5 s)
+#    ./blocked-restore-test.sh  delay    (interrupts every delay s)
+##############################################################################
+
+DELAY=${1:-0.5}
+JOHN="../run/john --nolog --config=./blk-rest.conf --pot=./blk-rest.pot --format=raw-sha1"
+RUNS=0
+
+rm -f blk-rest.conf blk-rest.lst blk-rest.in blk-rest.pot blk-rest.rec
+
+sed 's/^WordlistBlockedRules.*/WordlistBlockedRules = Y/' ../run/john.conf \
+  > blk-rest.conf
+perl -e 'srand(1); for (1..300000) { print join("", map { chr(97 + rand(26)) } 1..(4 + rand(6))), "\n" }' \
+  > blk-rest.lst
+../run/john --nolog --wordlist=blk-rest.lst --rules=best64 --stdout 2> /dev/null |
+  awk 'NR % 77773 == 11' |
+  perl -MDigest::SHA=sha1_hex -ne 'chomp; print "u$.:", sha1_hex($_), "\n"' \
+  > blk-rest.in
+TOTAL=`wc -l < blk-rest.in`
+
+$JOHN --session=blk-rest --wordlist=blk-rest.lst --rules=best64 --mem-file-size=100000 blk-rest.in > /dev/null 2>&1 &
+sleep $DELAY
+kill -INT $! 2> /dev/null
+wait
+while [ -f blk-rest.rec ] && [ $RUNS -lt 400 ]
+do
+  ../run/john --restore=blk-rest > /dev/null 2>&1 &
+  sleep $DELAY
+  kill -INT $! 2> /dev/null
+  wait
+  RUNS=$(($RUNS+1))
+done
+
+CRACKED=`$JOHN --show blk-rest.in 2> /dev/null | grep -c '^u'`
+if [ -f blk-rest.rec ] || [ "x$CRACKED" != "x$TOTAL" ]
+then
+  echo "FAILURE!!! $CRACKED of $TOTAL cracked after $RUNS restores"
+  RET=1
+else
+  echo "Success    $CRACKED of $TOTAL cracked after $RUNS restores"
+  RET=0
+fi
+rm -f blk-rest.conf blk-rest.lst blk-rest.in blk-rest.pot blk-rest.rec
+exit $RET
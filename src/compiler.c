@@ -23,6 +23,17 @@
 
 #undef PRINT_INSNS
 
+/*
+ * Native code translation of the threaded code, see c_jit() below.  This
+ * needs the computed goto interpreter, the SysV calling convention and a
+ * way to get executable memory.
+ */
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(PRINT_INSNS) && \
+    !defined(_WIN32) && !defined(__CYGWIN__) && HAVE_MMAP
+#define C_JIT
+#include <sys/mman.h>
+#endif
+
 char *c_errors[] = {
 	NULL,	/* No error */
 	"Unknown identifier",
@@ -66,9 +77,24 @@ static union c_insn *c_pc;
 static c_int *c_data_start = NULL;
 static c_int *c_data_ptr;
 
+#if !defined(__GNUC__) || defined(PRINT_INSNS)
 static union c_insn c_stack[C_STACK_SIZE];
+#endif
 static union c_insn *c_sp;
 
+static struct c_ident *c_externs;
+
+/*
+ * Copies of the program made with c_clone().
+ */
+struct c_clone {
+	struct c_clone *next;
+	union c_insn *code;
+	c_int *data;
+};
+
+static struct c_clone *c_clones = NULL;
+
 static union c_insn *c_loop_start;
 static struct c_fixup *c_break_fixups = NULL;
 
@@ -359,7 +385,28 @@ static void c_free_fixup(struct c_fixup *list, union c_insn *pc)
 	}
 }
 
+#ifdef C_JIT
+static void (*c_op_native)(void);
+static void c_jit_free(void);
+#endif
+
+static void c_clone_free(void)
+{
+	while (c_clones) {
+		struct c_clone *clone = c_clones;
+
+		c_clones = clone->next;
+		MEM_FREE(clone->code);
+		MEM_FREE(clone->data);
+		MEM_FREE(clone);
+	}
+}
+
 void c_cleanup() {
+#ifdef C_JIT
+	c_jit_free();
+#endif
+	c_clone_free();
 	MEM_FREE(c_code_start);
 	MEM_FREE(c_data_start);
 	c_free_ident(c_funcs, NULL);
@@ -841,7 +888,12 @@ int c_compile(int (*ext_getchar)(void), void (*ext_rewind)(void),
 
 	c_ext_getchar = ext_getchar;
 	c_ext_rewind = ext_rewind;
+	c_externs = externs;
 
+#ifdef C_JIT
+	c_jit_free();
+#endif
+	c_clone_free();
 	MEM_FREE(c_code_start);
 	MEM_FREE(c_data_start);
 	c_free_ident(c_funcs, NULL);
@@ -879,6 +931,104 @@ void *c_lookup(char *name)
 	return NULL;
 }
 
+/*
+ * Returns the kinds of operands following an instruction: immediate values,
+ * variable addresses or branch targets.
+ */
+static char *c_operands(void (*op)(void))
+{
+	if (op == c_op_push_imm) return "i";
+	if (op == c_op_push_mem) return "m";
+	if (op == c_op_push_imm_imm) return "ii";
+	if (op == c_op_push_imm_mem) return "im";
+	if (op == c_op_push_mem_imm) return "mi";
+	if (op == c_op_push_mem_mem) return "mm";
+	if (op == c_op_push_mem_mem_mem) return "mmm";
+	if (op == c_op_push_mem_mem_mem_imm) return "mmmi";
+	if (op == c_op_push_mem_mem_mem_mem) return "mmmm";
+	if (op == c_op_bz || op == c_op_ba) return "p";
+	return "";
+}
+
+int c_refers(void *addr)
+{
+	union c_insn *pc = c_code_start;
+
+	while (pc < c_code_ptr) {
+		char *kind = c_operands((pc++)->op);
+
+		for (; *kind; kind++, pc++)
+		if (*kind == 'm' && pc->mem == addr)
+			return 1;
+	}
+
+	return 0;
+}
+
+void *c_clone(struct c_ident *externs)
+{
+#if defined(__GNUC__) && !defined(PRINT_INSNS)
+	size_t code_size = (char *)c_code_ptr - (char *)c_code_start;
+	size_t data_size = (char *)c_data_ptr - (char *)c_data_start;
+	struct c_clone *clone;
+	union c_insn *pc;
+
+	clone = mem_alloc(sizeof(*clone));
+	clone->code = mem_alloc(code_size);
+	clone->data = mem_alloc(data_size);
+	memcpy(clone->code, c_code_start, code_size);
+	memcpy(clone->data, c_data_start, data_size);
+
+/* Point the copy at its own data and externs, and at itself */
+	pc = clone->code;
+	while (pc < clone->code + (c_code_ptr - c_code_start)) {
+		char *kind = c_operands((pc++)->op);
+
+		for (; *kind; kind++, pc++)
+		if (*kind == 'p') {
+			pc->pc = clone->code + (pc->pc - c_code_start);
+		} else if (*kind == 'm') {
+			struct c_ident *var;
+
+			if (pc->mem >= c_data_start && pc->mem < c_data_ptr) {
+				pc->mem = clone->data + (pc->mem - c_data_start);
+				continue;
+			}
+
+			for (var = c_externs; var; var = var->next)
+			if (var->addr == pc->mem)
+				break;
+			if (!var ||
+			    !(var = c_find_ident(externs, NULL, var->name))) {
+				MEM_FREE(clone->code);
+				MEM_FREE(clone->data);
+				MEM_FREE(clone);
+				return NULL;
+			}
+			pc->mem = var->addr;
+		}
+	}
+
+	clone->next = c_clones;
+	c_clones = clone;
+
+	return clone;
+#else
+/* c_execute_fast() isn't reentrant here */
+	return NULL;
+#endif
+}
+
+void *c_clone_lookup(void *clone, char *name)
+{
+	union c_insn *addr = c_lookup(name);
+
+	if (!addr)
+		return NULL;
+
+	return ((struct c_clone *)clone)->code + (addr - c_code_start);
+}
+
 #if !defined(__GNUC__) || defined(PRINT_INSNS)
 
 void c_execute_fast(void *addr)
@@ -920,13 +1070,15 @@ void c_execute_fast(void *addr)
 {
 	union c_insn *pc = addr;
 /*
- * We cache the top of stack value in imm.  We initially set sp to &c_stack[2]
+ * We cache the top of stack value in imm.  We initially set sp to &stack[2]
  * so that there's room for op_push_* to spill imm to stack even when there
  * wasn't actually a previous top of stack value to cache (since we're at the
  * top level).  It is simpler and quicker to let them do it than to treat this
- * as a special case in the code.
+ * as a special case in the code.  The stack is our own so that copies of the
+ * program can run on several threads at once.
  */
-	union c_insn *sp = &c_stack[2];
+	union c_insn stack[C_STACK_SIZE];
+	union c_insn *sp = &stack[2];
 	c_int imm = 0;
 
 	static void *ops[] = {
@@ -996,6 +1148,9 @@ void c_execute_fast(void *addr)
 
 		c_op_assign = &&op_assign;
 		c_op_assign_pop = &&op_assign_pop;
+#ifdef C_JIT
+		c_op_native = &&op_native;
+#endif
 
 		do {
 			c_ops[op].op = ops[op];
@@ -1009,6 +1164,12 @@ void c_execute_fast(void *addr)
 op_return:
 	return;
 
+#ifdef C_JIT
+op_native:
+	pc->op();
+	return;
+#endif
+
 op_bz:
 	sp -= 2;
 #if __GNUC__ >= 3
@@ -1667,3 +1828,899 @@ static struct c_op c_ops[] = {
 	{0}
 #endif
 };
+
+#ifdef C_JIT
+
+/*
+ * x86-64 translation of the threaded code of a single function.
+ *
+ * The operand stack is tracked at translation time.  Pushed constants and
+ * variables are only loaded when an operator needs them, the top of stack
+ * value lives in eax like in c_execute_fast() and anything else that has to
+ * be kept goes to a frame on the native stack, with the address of an array
+ * element next to its value.  Variables that are never indexed as arrays are
+ * held in callee saved registers for the duration of the call, the ones used
+ * most first.  This assumes array indices stay within bounds.
+ *
+ * Anything unexpected leaves the function to the interpreter.
+ */
+
+#define C_JIT_DEPTH			(C_STACK_SIZE / 2)
+#define C_JIT_VARS			0x100
+
+#define C_JIT_EAX			0
+#define C_JIT_ECX			1
+#define C_JIT_EDX			2
+#define C_JIT_ESI			6
+
+/* rbx, rbp, r12 to r15 */
+static const unsigned char c_jit_regs[] = {3, 5, 12, 13, 14, 15};
+#define C_JIT_REGS			sizeof(c_jit_regs)
+
+/* Where an operand's value is */
+#define C_JIT_V_EAX			0
+#define C_JIT_V_SLOT			1
+#define C_JIT_V_IMM			2
+#define C_JIT_V_VAR			3
+
+/* Where an operand's address is, if it's an lvalue */
+#define C_JIT_M_NONE			0
+#define C_JIT_M_ADDR			1
+#define C_JIT_M_SLOT			2
+
+/* Operator classes */
+#define C_JIT_INDEX			0
+#define C_JIT_ASSIGN			1
+#define C_JIT_ASSIGN_OP			2
+#define C_JIT_BINARY			3
+#define C_JIT_CMP			4
+#define C_JIT_AND_B			5
+#define C_JIT_NOT_B			6
+#define C_JIT_NOT			7
+#define C_JIT_NEG			8
+#define C_JIT_INC_L			9
+#define C_JIT_INC_R			10
+
+/* Arithmetic, the first ones are x86 ALU opcode extensions */
+#define C_JIT_ADD			0
+#define C_JIT_OR			1
+#define C_JIT_AND			4
+#define C_JIT_SUB			5
+#define C_JIT_XOR			6
+#define C_JIT_CMPL			7
+#define C_JIT_MUL			8
+#define C_JIT_DIV			9
+#define C_JIT_MOD			10
+#define C_JIT_SHL			11
+#define C_JIT_SHR			12
+
+/* Same order as c_ops[] */
+static const struct {
+	unsigned char class, arg;
+} c_jit_ops[] = {
+	{C_JIT_INDEX, 0},
+	{C_JIT_ASSIGN, 0},
+	{C_JIT_ASSIGN_OP, C_JIT_ADD},
+	{C_JIT_ASSIGN_OP, C_JIT_SUB},
+	{C_JIT_ASSIGN_OP, C_JIT_MUL},
+	{C_JIT_ASSIGN_OP, C_JIT_DIV},
+	{C_JIT_ASSIGN_OP, C_JIT_MOD},
+	{C_JIT_ASSIGN_OP, C_JIT_OR},
+	{C_JIT_ASSIGN_OP, C_JIT_XOR},
+	{C_JIT_ASSIGN_OP, C_JIT_AND},
+	{C_JIT_ASSIGN_OP, C_JIT_SHL},
+	{C_JIT_ASSIGN_OP, C_JIT_SHR},
+	{C_JIT_BINARY, C_JIT_OR},
+	{C_JIT_AND_B, 0},
+	{C_JIT_NOT_B, 0},
+	{C_JIT_CMP, 0x94},		/* sete */
+	{C_JIT_BINARY, C_JIT_SUB},
+	{C_JIT_CMP, 0x9F},		/* setg */
+	{C_JIT_CMP, 0x9C},		/* setl */
+	{C_JIT_CMP, 0x9D},		/* setge */
+	{C_JIT_CMP, 0x9E},		/* setle */
+	{C_JIT_BINARY, C_JIT_OR},
+	{C_JIT_BINARY, C_JIT_XOR},
+	{C_JIT_BINARY, C_JIT_AND},
+	{C_JIT_BINARY, C_JIT_SHL},
+	{C_JIT_BINARY, C_JIT_SHR},
+	{C_JIT_BINARY, C_JIT_ADD},
+	{C_JIT_BINARY, C_JIT_SUB},
+	{C_JIT_BINARY, C_JIT_MUL},
+	{C_JIT_BINARY, C_JIT_DIV},
+	{C_JIT_BINARY, C_JIT_MOD},
+	{C_JIT_NOT, 0},
+	{C_JIT_NEG, 0},
+	{C_JIT_INC_L, 0},
+	{C_JIT_INC_L, 1},
+	{C_JIT_INC_R, 0},
+	{C_JIT_INC_R, 1}
+};
+
+struct c_jit_entry {
+	int value;
+	c_int imm;
+	c_int *var;
+	int lvalue;
+	c_int *addr;
+};
+
+struct c_jit_var {
+	c_int *addr;
+	unsigned int uses;
+	int indexed;
+	int reg;
+};
+
+struct c_jit_fixup {
+	size_t at;
+	int target;
+};
+
+struct c_jit_code {
+	struct c_jit_code *next;
+	size_t size;
+	union c_insn thunk[2];
+};
+
+static struct c_jit_code *c_jit_list = NULL;
+
+static unsigned char *c_jit_buf;
+static size_t c_jit_size, c_jit_alloc;
+static int c_jit_error;
+
+static struct c_jit_entry c_jit_stack[C_JIT_DEPTH];
+static int c_jit_sp, c_jit_max, c_jit_eax;
+
+static struct c_jit_var c_jit_vars[C_JIT_VARS];
+static int c_jit_nvars, c_jit_full, c_jit_pass;
+
+static void c_jit_byte(unsigned int byte)
+{
+	if (c_jit_size >= c_jit_alloc) {
+		size_t alloc = c_jit_alloc ? c_jit_alloc * 2 : 0x1000;
+		unsigned char *buf = realloc(c_jit_buf, alloc);
+
+		if (!buf) {
+			c_jit_error = 1;
+			return;
+		}
+		c_jit_buf = buf;
+		c_jit_alloc = alloc;
+	}
+
+	c_jit_buf[c_jit_size++] = byte;
+}
+
+static void c_jit_int(c_int value)
+{
+	unsigned int x = value;
+
+	c_jit_byte(x);
+	c_jit_byte(x >> 8);
+	c_jit_byte(x >> 16);
+	c_jit_byte(x >> 24);
+}
+
+static void c_jit_ptr(void *ptr)
+{
+	unsigned long long x = (size_t)ptr;
+
+	c_jit_int((c_int)x);
+	c_jit_int((c_int)(x >> 32));
+}
+
+static void c_jit_rex(int w, int reg, int rm)
+{
+	int rex = 0x40 | (w << 3) | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+
+	if (rex != 0x40)
+		c_jit_byte(rex);
+}
+
+/* op reg, rm */
+static void c_jit_rr(int op, int reg, int rm)
+{
+	c_jit_rex(0, reg, rm);
+	c_jit_byte(op);
+	c_jit_byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* op reg, [rsp + disp] */
+static void c_jit_rsp(int w, int op, int reg, int disp)
+{
+	c_jit_rex(w, reg, 0);
+	c_jit_byte(op);
+	c_jit_byte(0x84 | ((reg & 7) << 3));
+	c_jit_byte(0x24);
+	c_jit_int(disp);
+}
+
+/* op reg, [rsi] */
+static void c_jit_rsi(int op, int reg)
+{
+	c_jit_rex(0, reg, 0);
+	c_jit_byte(op);
+	c_jit_byte(((reg & 7) << 3) | 6);
+}
+
+/* mov rsi, addr */
+static void c_jit_addr(void *addr)
+{
+	c_jit_byte(0x48);
+	c_jit_byte(0xBE);
+	c_jit_ptr(addr);
+}
+
+static void c_jit_bytes(const char *bytes, int count)
+{
+	while (count--)
+		c_jit_byte((unsigned char)*bytes++);
+}
+
+static struct c_jit_var *c_jit_var(c_int *addr)
+{
+	int i;
+
+	for (i = 0; i < c_jit_nvars; i++)
+	if (c_jit_vars[i].addr == addr)
+		return &c_jit_vars[i];
+
+	if (c_jit_pass || c_jit_nvars >= C_JIT_VARS) {
+		if (!c_jit_pass)
+			c_jit_full = 1;
+		return NULL;
+	}
+
+	c_jit_vars[i].addr = addr;
+	c_jit_vars[i].uses = 0;
+	c_jit_vars[i].indexed = 0;
+	c_jit_vars[i].reg = -1;
+	c_jit_nvars++;
+
+	return &c_jit_vars[i];
+}
+
+static int c_jit_reg(c_int *addr)
+{
+	struct c_jit_var *var = c_jit_var(addr);
+
+	return var ? var->reg : -1;
+}
+
+static void c_jit_indexed(c_int *addr)
+{
+	struct c_jit_var *var = c_jit_var(addr);
+
+	if (var)
+		var->indexed = 1;
+}
+
+static void c_jit_load(int reg, int entry)
+{
+	struct c_jit_entry *e = &c_jit_stack[entry];
+	int src;
+
+	switch (e->value) {
+	case C_JIT_V_EAX:
+		if (reg != C_JIT_EAX)
+			c_jit_rr(0x89, C_JIT_EAX, reg);
+		break;
+
+	case C_JIT_V_SLOT:
+		c_jit_rsp(0, 0x8B, reg, entry << 4);
+		break;
+
+	case C_JIT_V_IMM:
+		c_jit_rex(0, 0, reg);
+		c_jit_byte(0xB8 + (reg & 7));
+		c_jit_int(e->imm);
+		break;
+
+	case C_JIT_V_VAR:
+		if ((src = c_jit_reg(e->var)) >= 0) {
+			if (src != reg)
+				c_jit_rr(0x89, src, reg);
+		} else if (reg == C_JIT_EAX) {
+			c_jit_byte(0xA1);
+			c_jit_ptr(e->var);
+		} else {
+			c_jit_addr(e->var);
+			c_jit_rsi(0x8B, reg);
+		}
+	}
+}
+
+/* Moves an operand's value to its frame slot, clobbers edx and rsi */
+static void c_jit_spill(int entry)
+{
+	struct c_jit_entry *e = &c_jit_stack[entry];
+
+	switch (e->value) {
+	case C_JIT_V_EAX:
+		c_jit_rsp(0, 0x89, C_JIT_EAX, entry << 4);
+		c_jit_eax = -1;
+		break;
+
+	case C_JIT_V_VAR:
+		c_jit_load(C_JIT_EDX, entry);
+		c_jit_rsp(0, 0x89, C_JIT_EDX, entry << 4);
+		break;
+
+	default:
+		return;
+	}
+
+	e->value = C_JIT_V_SLOT;
+}
+
+/* Frees eax unless it holds one of the operands */
+static void c_jit_need_eax(int a, int b)
+{
+	if (c_jit_eax >= 0 && c_jit_eax != a && c_jit_eax != b)
+		c_jit_spill(c_jit_eax);
+}
+
+/* Spills operands below entry that a store to its lvalue would change */
+static void c_jit_clobber(int entry)
+{
+	struct c_jit_entry *target = &c_jit_stack[entry];
+	int i;
+
+	for (i = 0; i < entry; i++) {
+		struct c_jit_entry *e = &c_jit_stack[i];
+
+		if (e->value != C_JIT_V_VAR)
+			continue;
+		if (target->lvalue == C_JIT_M_SLOT ?
+		    c_jit_reg(e->var) < 0 : e->var == target->addr)
+			c_jit_spill(i);
+	}
+}
+
+/* Loads the current value of an lvalue to eax */
+static void c_jit_fetch(int entry)
+{
+	struct c_jit_entry *e = &c_jit_stack[entry];
+	int reg;
+
+	if (e->lvalue == C_JIT_M_SLOT) {
+		c_jit_rsp(1, 0x8B, C_JIT_ESI, (entry << 4) + 8);
+		c_jit_rsi(0x8B, C_JIT_EAX);
+	} else if ((reg = c_jit_reg(e->addr)) >= 0) {
+		c_jit_rr(0x89, reg, C_JIT_EAX);
+	} else {
+		c_jit_byte(0xA1);
+		c_jit_ptr(e->addr);
+	}
+}
+
+static void c_jit_store(int reg, int entry)
+{
+	struct c_jit_entry *e = &c_jit_stack[entry];
+	int dst;
+
+	if (e->lvalue == C_JIT_M_SLOT) {
+		c_jit_rsp(1, 0x8B, C_JIT_ESI, (entry << 4) + 8);
+		c_jit_rsi(0x89, reg);
+	} else if ((dst = c_jit_reg(e->addr)) >= 0) {
+		if (dst != reg)
+			c_jit_rr(0x89, reg, dst);
+	} else if (reg == C_JIT_EAX) {
+		c_jit_byte(0xA3);
+		c_jit_ptr(e->addr);
+	} else {
+		c_jit_addr(e->addr);
+		c_jit_rsi(0x89, reg);
+	}
+}
+
+/* eax = eax op ecx, or eax op imm */
+static void c_jit_alu(int op, int use_imm, c_int imm)
+{
+	switch (op) {
+	case C_JIT_MUL:
+		if (use_imm) {
+			c_jit_bytes("\x69\xC0", 2);
+			c_jit_int(imm);
+		} else
+			c_jit_bytes("\x0F\xAF\xC1", 3);
+		break;
+
+	case C_JIT_DIV:
+		c_jit_bytes("\x99\xF7\xF9", 3);
+		break;
+
+	case C_JIT_MOD:
+		c_jit_bytes("\x99\xF7\xF9\x89\xD0", 5);
+		break;
+
+	case C_JIT_SHL:
+	case C_JIT_SHR:
+		c_jit_byte(use_imm ? 0xC1 : 0xD3);
+		c_jit_byte(op == C_JIT_SHL ? 0xE0 : 0xF8);
+		if (use_imm)
+			c_jit_byte(imm);
+		break;
+
+	default:
+		if (use_imm) {
+			c_jit_byte((op << 3) | 5);
+			c_jit_int(imm);
+		} else {
+			c_jit_byte((op << 3) | 1);
+			c_jit_byte(0xC8);
+		}
+	}
+}
+
+static struct c_jit_entry *c_jit_push(void)
+{
+	if (c_jit_sp >= C_JIT_DEPTH) {
+		c_jit_error = 1;
+		return NULL;
+	}
+
+	if (++c_jit_sp > c_jit_max)
+		c_jit_max = c_jit_sp;
+
+	return &c_jit_stack[c_jit_sp - 1];
+}
+
+static void c_jit_push_imm(c_int imm)
+{
+	struct c_jit_entry *e = c_jit_push();
+
+	if (!e)
+		return;
+	e->value = C_JIT_V_IMM;
+	e->imm = imm;
+	e->lvalue = C_JIT_M_NONE;
+}
+
+static void c_jit_push_mem(c_int *mem)
+{
+	struct c_jit_entry *e = c_jit_push();
+	struct c_jit_var *var;
+
+	if (!e)
+		return;
+	e->value = C_JIT_V_VAR;
+	e->var = e->addr = mem;
+	e->lvalue = C_JIT_M_ADDR;
+
+	if (!c_jit_pass && (var = c_jit_var(mem)))
+		var->uses++;
+}
+
+static void c_jit_op(int class, int arg)
+{
+	int t = c_jit_sp - 1, s = c_jit_sp - 2;
+	struct c_jit_entry *e;
+	int reg;
+
+	if (class >= C_JIT_NOT_B) {
+		if (t < 0) {
+			c_jit_error = 1;
+			return;
+		}
+		s = t;
+	} else if (s < 0) {
+		c_jit_error = 1;
+		return;
+	}
+	e = &c_jit_stack[s];
+
+	switch (class) {
+	case C_JIT_INDEX:
+		if (e->lvalue == C_JIT_M_NONE)
+			break;
+		if (e->lvalue == C_JIT_M_ADDR) {
+			c_jit_indexed(e->addr);
+			if (c_jit_stack[t].value == C_JIT_V_IMM) {
+				e->var = e->addr += c_jit_stack[t].imm;
+				e->value = C_JIT_V_VAR;
+				c_jit_indexed(e->addr);
+				if (c_jit_eax >= s)
+					c_jit_eax = -1;
+				c_jit_sp--;
+				return;
+			}
+		}
+		c_jit_need_eax(s, t);
+		c_jit_load(C_JIT_ECX, t);
+		c_jit_bytes("\x48\x63\xC9", 3);
+		if (e->lvalue == C_JIT_M_ADDR)
+			c_jit_addr(e->addr);
+		else
+			c_jit_rsp(1, 0x8B, C_JIT_ESI, (s << 4) + 8);
+		c_jit_bytes("\x48\x8D\x34\x8E", 4);
+		c_jit_rsp(1, 0x89, C_JIT_ESI, (s << 4) + 8);
+		c_jit_rsi(0x8B, C_JIT_EAX);
+		e->lvalue = C_JIT_M_SLOT;
+		break;
+
+	case C_JIT_ASSIGN:
+		if (e->lvalue == C_JIT_M_NONE)
+			break;
+		c_jit_clobber(s);
+		if (e->lvalue == C_JIT_M_ADDR &&
+		    (reg = c_jit_reg(e->addr)) >= 0) {
+			c_jit_load(reg, t);
+			e->value = C_JIT_V_VAR;
+			e->var = e->addr;
+			if (c_jit_eax >= s)
+				c_jit_eax = -1;
+			c_jit_sp--;
+			return;
+		}
+		c_jit_need_eax(s, t);
+		c_jit_load(C_JIT_EAX, t);
+		c_jit_store(C_JIT_EAX, s);
+		break;
+
+	case C_JIT_ASSIGN_OP:
+		if (e->lvalue == C_JIT_M_NONE)
+			break;
+		c_jit_clobber(s);
+		c_jit_need_eax(s, t);
+		c_jit_load(C_JIT_ECX, t);
+		c_jit_fetch(s);
+		c_jit_alu(arg, 0, 0);
+		c_jit_store(C_JIT_EAX, s);
+		break;
+
+	case C_JIT_BINARY:
+	case C_JIT_CMP:
+	case C_JIT_AND_B:
+		c_jit_need_eax(s, t);
+		reg = (class == C_JIT_CMP) ? C_JIT_CMPL : arg;
+		if (class != C_JIT_AND_B && reg != C_JIT_DIV &&
+		    reg != C_JIT_MOD &&
+		    c_jit_stack[t].value == C_JIT_V_IMM) {
+			c_jit_load(C_JIT_EAX, s);
+			c_jit_alu(reg, 1, c_jit_stack[t].imm);
+		} else {
+			c_jit_load(C_JIT_ECX, t);
+			c_jit_load(C_JIT_EAX, s);
+			if (class == C_JIT_AND_B)
+				c_jit_bytes("\x85\xC0\x0F\x95\xC0"
+				    "\x85\xC9\x0F\x95\xC1\x20\xC8", 12);
+			else
+				c_jit_alu(reg, 0, 0);
+		}
+/* setcc al */
+		if (class == C_JIT_CMP) {
+			c_jit_byte(0x0F);
+			c_jit_byte(arg);
+			c_jit_byte(0xC0);
+		}
+/* movzx eax, al */
+		if (class != C_JIT_BINARY)
+			c_jit_bytes("\x0F\xB6\xC0", 3);
+		break;
+
+	case C_JIT_NOT_B:
+	case C_JIT_NOT:
+	case C_JIT_NEG:
+		c_jit_need_eax(t, t);
+		c_jit_load(C_JIT_EAX, t);
+		if (class == C_JIT_NOT_B)
+			c_jit_bytes("\x85\xC0\x0F\x94\xC0\x0F\xB6\xC0", 8);
+		else
+			c_jit_bytes(class == C_JIT_NOT ?
+			    "\xF7\xD0" : "\xF7\xD8", 2);
+		break;
+
+	case C_JIT_INC_L:
+	case C_JIT_INC_R:
+		if (e->lvalue == C_JIT_M_NONE)
+			break;
+		c_jit_clobber(t);
+		c_jit_need_eax(t, t);
+		c_jit_load(C_JIT_EAX, t);
+		if (class == C_JIT_INC_L) {
+			c_jit_bytes(arg ? "\xFF\xC8" : "\xFF\xC0", 2);
+			c_jit_store(C_JIT_EAX, t);
+		} else {
+			c_jit_bytes(arg ? "\x8D\x50\xFF" : "\x8D\x50\x01", 3);
+			c_jit_store(C_JIT_EDX, t);
+		}
+		break;
+	}
+
+	if (e->lvalue == C_JIT_M_NONE && (class == C_JIT_INDEX ||
+	    class == C_JIT_ASSIGN || class == C_JIT_ASSIGN_OP ||
+	    class >= C_JIT_INC_L)) {
+		c_jit_error = 1;
+		return;
+	}
+
+	e->value = C_JIT_V_EAX;
+	c_jit_eax = s;
+	c_jit_sp = s + 1;
+}
+
+static int c_jit_translate(union c_insn *start, union c_insn *end)
+{
+	int count = end - start;
+	long *pos;
+	struct c_jit_fixup *fixups;
+	int nfixups = 0;
+	union c_insn *pc = start;
+	size_t frame, epilogue;
+	int i, nregs = 0;
+
+	pos = mem_alloc(sizeof(*pos) * count);
+	fixups = mem_alloc(sizeof(*fixups) * count);
+	for (i = 0; i < count; i++)
+		pos[i] = -1;
+
+	c_jit_size = 0;
+	c_jit_error = 0;
+	c_jit_sp = c_jit_max = 0;
+	c_jit_eax = -1;
+
+	for (i = 0; i < c_jit_nvars; i++)
+	if (c_jit_vars[i].reg >= 0) {
+		c_jit_rex(0, 0, c_jit_vars[i].reg);
+		c_jit_byte(0x50 + (c_jit_vars[i].reg & 7));
+		nregs++;
+	}
+
+/* sub rsp, frame */
+	c_jit_bytes("\x48\x81\xEC", 3);
+	frame = c_jit_size;
+	c_jit_int(0);
+
+	for (i = 0; i < c_jit_nvars; i++)
+	if (c_jit_vars[i].reg >= 0) {
+		c_jit_addr(c_jit_vars[i].addr);
+		c_jit_rsi(0x8B, c_jit_vars[i].reg);
+	}
+
+	while (pc < end && !c_jit_error) {
+		void (*op)(void) = (pc++)->op;
+
+		if (!c_jit_sp)
+			pos[pc - 1 - start] = c_jit_size;
+
+		if (op == c_op_push_imm) {
+			c_jit_push_imm((pc++)->imm);
+		} else if (op == c_op_push_mem) {
+			c_jit_push_mem((pc++)->mem);
+		} else if (op == c_op_push_imm_imm) {
+			c_jit_push_imm((pc++)->imm);
+			c_jit_push_imm((pc++)->imm);
+		} else if (op == c_op_push_imm_mem) {
+			c_jit_push_imm((pc++)->imm);
+			c_jit_push_mem((pc++)->mem);
+		} else if (op == c_op_push_mem_imm) {
+			c_jit_push_mem((pc++)->mem);
+			c_jit_push_imm((pc++)->imm);
+		} else if (op == c_op_push_mem_mem ||
+		    op == c_op_push_mem_mem_mem ||
+		    op == c_op_push_mem_mem_mem_imm ||
+		    op == c_op_push_mem_mem_mem_mem) {
+			c_jit_push_mem((pc++)->mem);
+			c_jit_push_mem((pc++)->mem);
+			if (op != c_op_push_mem_mem)
+				c_jit_push_mem((pc++)->mem);
+			if (op == c_op_push_mem_mem_mem_imm)
+				c_jit_push_imm((pc++)->imm);
+			else if (op == c_op_push_mem_mem_mem_mem)
+				c_jit_push_mem((pc++)->mem);
+		} else if (op == c_op_pop) {
+			if (--c_jit_sp < 0)
+				c_jit_error = 1;
+			if (c_jit_eax >= c_jit_sp)
+				c_jit_eax = -1;
+		} else if (op == c_op_assign || op == c_op_assign_pop) {
+			c_jit_op(C_JIT_ASSIGN, 0);
+			if (op == c_op_assign_pop) {
+				c_jit_sp--;
+				c_jit_eax = -1;
+			}
+		} else if (op == c_op_bz || op == c_op_ba ||
+		    op == c_op_return) {
+			if (op == c_op_bz) {
+				struct c_jit_entry *e = &c_jit_stack[0];
+
+				if (c_jit_sp != 1) {
+					c_jit_error = 1;
+					break;
+				}
+				c_jit_sp = 0;
+				if (e->value == C_JIT_V_IMM) {
+					if (e->imm) {
+						pc++;
+						continue;
+					}
+/* jmp */
+					c_jit_byte(0xE9);
+				} else {
+/* test eax, eax; jz */
+					c_jit_load(C_JIT_EAX, 0);
+					c_jit_bytes("\x85\xC0\x0F\x84", 4);
+				}
+				c_jit_eax = -1;
+			} else if (c_jit_sp) {
+				c_jit_error = 1;
+				break;
+			} else
+				c_jit_byte(0xE9);
+			fixups[nfixups].at = c_jit_size;
+			fixups[nfixups++].target =
+			    (op == c_op_return) ? -1 : pc->pc - start;
+			if (op != c_op_return)
+				pc++;
+			c_jit_int(0);
+		} else {
+			for (i = 0; c_ops[i].prec; i++)
+			if (c_ops[i].op == op)
+				break;
+			if (!c_ops[i].prec) {
+				c_jit_error = 1;
+				break;
+			}
+			c_jit_op(c_jit_ops[i].class, c_jit_ops[i].arg);
+		}
+	}
+
+	if (c_jit_sp)
+		c_jit_error = 1;
+
+	epilogue = c_jit_size;
+	for (i = 0; i < c_jit_nvars; i++)
+	if (c_jit_vars[i].reg >= 0) {
+		c_jit_addr(c_jit_vars[i].addr);
+		c_jit_rsi(0x89, c_jit_vars[i].reg);
+	}
+
+/* add rsp, frame */
+	c_jit_bytes("\x48\x81\xC4", 3);
+	c_jit_int(c_jit_max << 4);
+
+	for (i = c_jit_nvars - 1; i >= 0; i--)
+	if (c_jit_vars[i].reg >= 0) {
+		c_jit_rex(0, 0, c_jit_vars[i].reg);
+		c_jit_byte(0x58 + (c_jit_vars[i].reg & 7));
+	}
+
+/* ret */
+	c_jit_byte(0xC3);
+
+	if (!c_jit_error) {
+		c_int size = c_jit_max << 4;
+
+		memcpy(&c_jit_buf[frame], &size, sizeof(size));
+	}
+
+	for (i = 0; i < nfixups && !c_jit_error; i++) {
+		long target;
+		c_int rel;
+
+		if (fixups[i].target < 0)
+			target = epilogue;
+		else if (fixups[i].target >= count ||
+		    (target = pos[fixups[i].target]) < 0) {
+			c_jit_error = 1;
+			break;
+		}
+		rel = target - (long)(fixups[i].at + 4);
+		memcpy(&c_jit_buf[fixups[i].at], &rel, sizeof(rel));
+	}
+
+	MEM_FREE(fixups);
+	MEM_FREE(pos);
+
+	return c_jit_error;
+}
+
+/* Keeps the most used variables that are never indexed in registers */
+static void c_jit_alloc_regs(void)
+{
+	int reg;
+
+	if (c_jit_full)
+		return;
+
+	for (reg = 0; reg < C_JIT_REGS; reg++) {
+		struct c_jit_var *best = NULL;
+		int i;
+
+		for (i = 0; i < c_jit_nvars; i++) {
+			struct c_jit_var *var = &c_jit_vars[i];
+
+			if (var->reg < 0 && !var->indexed && var->uses > 1 &&
+			    (!best || var->uses > best->uses))
+				best = var;
+		}
+
+		if (!best)
+			break;
+		best->reg = c_jit_regs[reg];
+	}
+}
+
+void *c_jit(void *addr)
+{
+	union c_insn *start = addr, *base = c_code_start, *end;
+	struct c_clone *clone;
+	struct c_ident *f;
+	struct c_jit_code *code;
+	size_t size;
+
+	if (!addr || !c_ops_initialized)
+		return addr;
+
+	for (clone = c_clones; clone; clone = clone->next)
+	if (start >= clone->code &&
+	    start < clone->code + (c_code_ptr - c_code_start))
+		base = clone->code;
+
+	end = base + (c_code_ptr - c_code_start);
+	for (f = c_funcs; f; f = f->next) {
+		union c_insn *next =
+		    base + ((union c_insn *)f->addr - c_code_start);
+
+		if (next > start && next < end)
+			end = next;
+	}
+
+	c_jit_buf = NULL;
+	c_jit_alloc = 0;
+	c_jit_nvars = c_jit_full = 0;
+
+	for (c_jit_pass = 0; c_jit_pass < 2; c_jit_pass++) {
+		if (c_jit_translate(start, end))
+			break;
+		if (!c_jit_pass)
+			c_jit_alloc_regs();
+	}
+
+	code = MAP_FAILED;
+	size = sizeof(*code) + c_jit_size;
+	if (!c_jit_error)
+		code = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANON, -1, 0);
+
+	if (code != MAP_FAILED) {
+		code->next = c_jit_list;
+		code->size = size;
+		code->thunk[0].op = c_op_native;
+		code->thunk[1].op = (void (*)(void))(code + 1);
+		memcpy(code + 1, c_jit_buf, c_jit_size);
+
+		if (mprotect(code, size, PROT_READ | PROT_EXEC)) {
+			munmap(code, size);
+			code = MAP_FAILED;
+		} else {
+			c_jit_list = code;
+			addr = code->thunk;
+		}
+	}
+
+	free(c_jit_buf);
+
+	return addr;
+}
+
+static void c_jit_free(void)
+{
+	while (c_jit_list) {
+		struct c_jit_code *code = c_jit_list;
+
+		c_jit_list = code->next;
+		munmap(code, code->size);
+	}
+}
+
+#else
+
+void *c_jit(void *addr)
+{
+	return addr;
+}
+
+#endif
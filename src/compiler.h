@@ -85,6 +85,32 @@ extern void *c_lookup(char *name);
 		c_execute_fast(addr)
 extern void c_execute_fast(void *addr);
 
+/*
+ * Translates a function to native code where supported.  Returns the address
+ * to pass to c_execute*() instead of the one from c_lookup(), which is just
+ * returned if the function can't be translated.  The code is freed along
+ * with the program.
+ */
+extern void *c_jit(void *addr);
+
+/*
+ * Returns whether the program uses the variable at addr.
+ */
+extern int c_refers(void *addr);
+
+/*
+ * Makes a copy of the program with its own data, which uses the externs of
+ * the same names from the list instead of the original ones.  Copies may be
+ * run on different threads at once.  Returns NULL if that's not supported.
+ * The copies are freed along with the program.
+ */
+extern void *c_clone(struct c_ident *externs);
+
+/*
+ * Returns the function's address in a copy, or NULL if not found.
+ */
+extern void *c_clone_lookup(void *clone, char *name);
+
 extern void c_cleanup();
 
 #endif
@@ -6,6 +6,7 @@
  */
 
 #define NEED_OS_TIMER
+#define NEED_OS_FORK
 #include "os.h"
 
 #include <string.h>
@@ -20,6 +21,12 @@
 #if (!AC_BUILT || HAVE_SYS_TIMES_H)
 #include <sys/times.h>
 #endif
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#if OS_FORK && defined(HAVE_MMAP)
+#include <sys/mman.h>
+#endif
 #include <errno.h>
 #if (!AC_BUILT || HAVE_UNISTD_H) && !_MSC_VER
 #include <unistd.h>
@@ -39,6 +46,7 @@
 #include "misc.h"
 #include "math.h"
 #include "memory.h"
+#include "config.h"
 #include "signals.h"
 #include "idle.h"
 #include "formats.h"
@@ -77,6 +85,18 @@
 static clock_t salt_time = 0;
 #endif
 
+/*
+ * The key batch pipeline needs POSIX threads.  Legacy builds don't know
+ * whether we have them, so they simply go without it.
+ */
+#if HAVE_PTHREAD
+#define CRK_PIPELINE 1
+#endif
+
+#if OS_FORK && defined(HAVE_MMAP) && defined(__GNUC__)
+#define CRK_SHARE 1
+#endif
+
 static struct db_main *crk_db;
 static struct fmt_params crk_params;
 static struct fmt_methods crk_methods;
@@ -95,6 +115,89 @@ static int64 *crk_timestamps;
 static char crk_stdout_key[PLAINTEXT_BUFFER_SIZE];
 int64_t crk_pot_pos;
 
+/*
+ * Keys packed back to back for the format's set_keys(), when it has one.
+ * There's PLAINTEXT_BUFFER_SIZE of slack past the last key's start, which
+ * set_keys() and set_key() are allowed to over-read.
+ */
+static char *crk_batch;
+static int *crk_batch_lengths;
+static int crk_batch_index, crk_batch_pos, crk_batch_max;
+
+/*
+ * Changed byte ranges of the keys given to crk_process_key_delta(), merged
+ * over the batch being filled and over the previous one.  A key set at some
+ * index can only differ from the one set there a batch ago within the union
+ * of the two, which is what the format's set_key_delta() gets.  A from of -1
+ * means anywhere, and is also what any other way of setting keys leaves.
+ */
+static int crk_delta;
+static int crk_delta_from, crk_delta_to;
+static int crk_delta_prev_from, crk_delta_prev_to;
+
+#if CRK_PIPELINE
+/*
+ * Double-buffered key batches.  The cracking mode fills one batch (on the
+ * main thread) while a helper thread runs set_key(), crypt_all() and the
+ * comparisons for the other one.  The helper never processes events nor
+ * calls fix_state(): whenever anything needs the main thread's attention,
+ * the pipeline is drained and the main thread completes the current batch
+ * itself, so the crash recovery file is only ever updated for fully
+ * processed keys.
+ */
+struct crk_pipe_guess {
+	struct crk_pipe_guess *next;
+	int index;
+	int64 cands;
+	char *login, *uid, *ciphertext, *rep_plain, *store_plain;
+};
+
+static int crk_pipe;
+static char *crk_pipe_keys[2];
+static int *crk_pipe_lengths[2];
+static int crk_pipe_count[2];
+static int crk_pipe_fill, crk_pipe_index, crk_pipe_pos, crk_pipe_max;
+static int crk_pipe_busy, crk_pipe_result, crk_pipe_quit;
+static int crk_pipe_unfixed, crk_pipe_deferred;
+static struct crk_pipe_guess *crk_pipe_guesses, **crk_pipe_guesses_tail;
+static pthread_t crk_pipe_thread;
+static pthread_mutex_t crk_pipe_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t crk_pipe_cond = PTHREAD_COND_INITIALIZER;
+
+static void *crk_pipe_main(void *arg);
+#endif
+
+#if CRK_SHARE
+/*
+ * Hashes cracked by "--fork" siblings.  Before forking, each loaded hash is
+ * given an ID (its position in salt order) and a shared anonymous mapping is
+ * set up with a bitmap of the IDs removed by any of the processes, and a log
+ * of those IDs in the order they were first removed.  Each process marks the
+ * hashes it removes and, whenever the log has grown, removes the hashes the
+ * others have logged.  This needs no pot file parsing and also sees guesses
+ * not yet flushed to john.pot.
+ */
+
+struct crk_share_salt {
+	struct db_salt *salt;
+	unsigned int first, count;
+};
+
+struct crk_share_pw {
+	struct db_salt *salt;
+	struct db_password *pw;
+};
+
+static volatile unsigned int *crk_share, *crk_share_bits, *crk_share_ids;
+/* Private (and never written to after fork()), sorted by address */
+static struct crk_share_salt *crk_share_salts;
+static struct crk_share_pw *crk_share_pws;
+static unsigned int crk_share_salt_count;
+/* IDs removed from our own database, and how far we've read the log */
+static unsigned int *crk_share_seen;
+static unsigned int crk_share_last;
+#endif
+
 static void crk_dummy_set_salt(void *salt)
 {
 }
@@ -103,6 +206,32 @@ static void crk_dummy_fix_state(void)
 {
 }
 
+/*
+ * set_keys() for formats that don't have their own.
+ */
+static void crk_default_set_keys(char *keys, int *lengths, int count)
+{
+	int index;
+
+	for (index = 0; index < count; index++) {
+		crk_methods.set_key(keys, index);
+		keys += lengths[index] + 1;
+	}
+}
+
+/*
+ * Appends a key to a packed batch, returning its length.
+ */
+static int crk_pack_key(char *dst, char *key)
+{
+	int len = strnlen(key, PLAINTEXT_BUFFER_SIZE - 1);
+
+	memcpy(dst, key, len);
+	dst[len] = 0;
+
+	return len;
+}
+
 static void crk_init_salt(void)
 {
 	if (!crk_db->salts->next) {
@@ -212,8 +341,161 @@ void crk_init(struct db_main *db, void (*fix_state)(void),
 	crk_help();
 
 	idle_init(db->format);
+
+	crk_batch_max = crk_params.max_keys_per_crypt;
+	if (options.force_maxkeys && options.force_maxkeys < crk_batch_max)
+		crk_batch_max = options.force_maxkeys;
+	crk_batch_index = crk_batch_pos = 0;
+
+#if CRK_PIPELINE
+	crk_pipe = db->loaded && !guesses &&
+		cfg_get_bool(SECTION_OPTIONS, NULL, "CrackerPipeline", 0);
+	if (crk_pipe) {
+		int batch;
+
+		crk_pipe_max = crk_batch_max;
+		for (batch = 0; batch < 2; batch++) {
+			crk_pipe_keys[batch] = mem_calloc(crk_pipe_max + 1,
+			                                  PLAINTEXT_BUFFER_SIZE);
+			crk_pipe_lengths[batch] =
+				mem_alloc(crk_pipe_max * sizeof(int));
+		}
+		crk_pipe_fill = crk_pipe_index = crk_pipe_pos = 0;
+		crk_pipe_busy = crk_pipe_result = crk_pipe_quit = 0;
+		crk_pipe_unfixed = 0;
+		crk_pipe_guesses = NULL;
+		crk_pipe_guesses_tail = &crk_pipe_guesses;
+		if (pthread_create(&crk_pipe_thread, NULL, crk_pipe_main, NULL))
+			pexit("pthread_create");
+		log_event("- Cracker pipeline enabled, %d keys per batch",
+		          crk_pipe_max);
+	}
+#endif
+
+	crk_delta = crk_methods.set_key_delta && db->loaded && !guesses;
+#if CRK_PIPELINE
+	if (crk_pipe)
+		crk_delta = 0;
+#endif
+	crk_delta_from = crk_delta_prev_from = -1;
+
+/* Only pack the keys ourselves if the format can take them all at once */
+	if (!crk_methods.set_keys)
+		crk_methods.set_keys = crk_default_set_keys;
+	else
+#if CRK_PIPELINE
+	if (!crk_pipe)
+#endif
+	if (db->loaded && !guesses) {
+		crk_batch = mem_calloc(crk_batch_max + 1, PLAINTEXT_BUFFER_SIZE);
+		crk_batch_lengths = mem_alloc(crk_batch_max * sizeof(int));
+	}
 }
 
+#if CRK_SHARE
+static int crk_share_cmp_salt(const void *a, const void *b)
+{
+	const struct db_salt *x = ((const struct crk_share_salt *)a)->salt;
+	const struct db_salt *y = ((const struct crk_share_salt *)b)->salt;
+
+	return x < y ? -1 : x > y;
+}
+
+static int crk_share_cmp_pw(const void *a, const void *b)
+{
+	const struct db_password *x = ((const struct crk_share_pw *)a)->pw;
+	const struct db_password *y = ((const struct crk_share_pw *)b)->pw;
+
+	return x < y ? -1 : x > y;
+}
+
+void crk_share_init(struct db_main *db)
+{
+	struct db_salt *salt;
+	struct db_password *pw;
+	unsigned int count, words, id, i;
+	size_t size;
+	void *map;
+
+	if (!db->loaded || !db->password_count ||
+	    (db->format->params.flags & FMT_NOT_EXACT) ||
+	    options.regen_lost_salts ||
+	    !cfg_get_bool(SECTION_OPTIONS, NULL, "ForkShareCracks", 1))
+		return;
+
+	count = db->password_count;
+	words = (count + 31) / 32;
+	size = (1 + (size_t)words + count) * sizeof(unsigned int);
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	           MAP_SHARED | MAP_ANON, -1, 0);
+	if (map == MAP_FAILED) {
+		log_event("! mmap: %s", strerror(errno));
+		return;
+	}
+
+/* The log's length, the bitmap and the log */
+	crk_share = map;
+	crk_share_bits = crk_share + 1;
+	crk_share_ids = crk_share_bits + words;
+	memset(map, 0, (1 + words) * sizeof(unsigned int));
+	memset((void *)crk_share_ids, 0xff, count * sizeof(unsigned int));
+
+	crk_share_seen = mem_calloc(words, sizeof(unsigned int));
+	crk_share_last = 0;
+	crk_share_salts = mem_alloc(db->salt_count * sizeof(*crk_share_salts));
+	crk_share_pws = mem_alloc(count * sizeof(*crk_share_pws));
+
+	id = i = 0;
+	for (salt = db->salts; salt && i < db->salt_count; salt = salt->next) {
+		crk_share_salts[i].salt = salt;
+		crk_share_salts[i].first = id;
+		for (pw = salt->list; pw && id < count; pw = pw->next) {
+			crk_share_pws[id].salt = salt;
+			crk_share_pws[id++].pw = pw;
+		}
+		crk_share_salts[i].count = id - crk_share_salts[i].first;
+		qsort(&crk_share_pws[crk_share_salts[i].first],
+		      crk_share_salts[i].count, sizeof(*crk_share_pws),
+		      crk_share_cmp_pw);
+		i++;
+	}
+	crk_share_salt_count = i;
+	qsort(crk_share_salts, crk_share_salt_count, sizeof(*crk_share_salts),
+	      crk_share_cmp_salt);
+}
+
+static void crk_share_mark(struct db_salt *salt, struct db_password *pw)
+{
+	struct crk_share_salt key, *s;
+	struct crk_share_pw pkey, *p;
+	unsigned int id, mask;
+	volatile unsigned int *word;
+
+	key.salt = salt;
+	if (!(s = bsearch(&key, crk_share_salts, crk_share_salt_count,
+	                  sizeof(*crk_share_salts), crk_share_cmp_salt)))
+		return;
+	pkey.pw = pw;
+	if (!(p = bsearch(&pkey, &crk_share_pws[s->first], s->count,
+	                  sizeof(*crk_share_pws), crk_share_cmp_pw)))
+		return;
+
+	id = p - crk_share_pws;
+	mask = 1U << (id % 32);
+	crk_share_seen[id / 32] |= mask;
+
+/* Only whoever sets the bit logs the ID */
+	word = &crk_share_bits[id / 32];
+	if (!(__sync_fetch_and_or(word, mask) & mask))
+		crk_share_ids[__sync_fetch_and_add(crk_share, 1)] = id;
+}
+
+#else
+void crk_share_init(struct db_main *db)
+{
+}
+#endif
+
 /*
  * crk_remove_salt() is called by crk_remove_hash() when it happens to remove
  * the last password hash for a salt.
@@ -257,6 +539,11 @@ static void crk_remove_hash(struct db_salt *salt, struct db_password *pw)
 	struct db_password **start, **current;
 	int hash, count;
 
+#if CRK_SHARE
+	if (crk_share)
+		crk_share_mark(salt, pw);
+#endif
+
 	crk_db->password_count--;
 
 	if (!--salt->count) {
@@ -322,6 +609,70 @@ static void crk_remove_hash(struct db_salt *salt, struct db_password *pw)
 		pw->binary = NULL;
 }
 
+#if CRK_PIPELINE
+/*
+ * The logger is not thread-safe, so cracks found by the pipeline thread are
+ * queued here and reported by the main thread once that batch is done.
+ */
+static void crk_pipe_defer_guess(char *login, char *uid, char *ciphertext,
+	char *rep_plain, char *store_plain, int index)
+{
+	struct crk_pipe_guess *guess;
+	size_t login_len = strlen(login) + 1;
+	size_t uid_len = strlen(uid) + 1;
+	size_t ct_len = ciphertext ? strlen(ciphertext) + 1 : 0;
+	size_t rep_len = strlen(rep_plain) + 1;
+	size_t store_len = strlen(store_plain) + 1;
+	char *p;
+
+	guess = mem_alloc(sizeof(*guess) + login_len + uid_len + ct_len +
+	                  rep_len + store_len);
+	p = (char*)(guess + 1);
+	guess->login = memcpy(p, login, login_len);
+	p += login_len;
+	guess->uid = memcpy(p, uid, uid_len);
+	p += uid_len;
+	if (ciphertext) {
+		guess->ciphertext = memcpy(p, ciphertext, ct_len);
+		p += ct_len;
+	} else
+		guess->ciphertext = NULL;
+	guess->rep_plain = memcpy(p, rep_plain, rep_len);
+	p += rep_len;
+	guess->store_plain = memcpy(p, store_plain, store_len);
+	guess->index = index;
+	guess->cands = status.cands;
+	guess->next = NULL;
+
+	*crk_pipe_guesses_tail = guess;
+	crk_pipe_guesses_tail = &guess->next;
+}
+
+/*
+ * Called by the main thread only, while the pipeline thread is idle.
+ */
+static void crk_pipe_report_guesses(void)
+{
+	struct crk_pipe_guess *guess;
+
+	while ((guess = crk_pipe_guesses)) {
+		int64 delta = status.cands;
+
+		/* Keep "StatusShowCandidates" figures exact */
+		neg64(&guess->cands);
+		add64to64(&delta, &guess->cands);
+		log_guess(guess->login, guess->uid, guess->ciphertext,
+		          guess->rep_plain, guess->store_plain,
+		          crk_db->options->field_sep_char,
+		          guess->index - (int)delta.lo);
+
+		crk_pipe_guesses = guess->next;
+		MEM_FREE(guess);
+	}
+	crk_pipe_guesses_tail = &crk_pipe_guesses;
+}
+#endif
+
 /* Negative index is not counted/reported (got it from pot sync) */
 static int crk_process_guess(struct db_salt *salt, struct db_password *pw,
 	int index)
@@ -404,6 +755,14 @@ static int crk_process_guess(struct db_salt *salt, struct db_password *pw,
 			ct = ldr_pot_source(
 				crk_methods.source(pw->source, pw->binary),
 				buffer);
+#if CRK_PIPELINE
+		if (crk_pipe_deferred)
+			crk_pipe_defer_guess(
+				crk_db->options->flags & DB_LOGIN ? replogin : "?",
+				crk_db->options->flags & DB_LOGIN ? repuid : "",
+				(char*)ct, repkey, key, index);
+		else
+#endif
 		log_guess(crk_db->options->flags & DB_LOGIN ? replogin : "?",
 		          crk_db->options->flags & DB_LOGIN ? repuid : "",
 		          (char*)ct,
@@ -558,6 +917,9 @@ int crk_reload_pot(void)
 	if (crk_params.flags & FMT_NOT_EXACT)
 		return 0;
 
+/* Our own guesses may still be on their way to the pot file */
+	log_guess_sync();
+
 	if (!(pot_file = fopen(path_expand(options.activepot), "rb")))
 		pexit("fopen: %s", path_expand(options.activepot));
 
@@ -727,26 +1089,18 @@ static int crk_process_event(void)
 	return event_abort;
 }
 
-static int crk_password_loop(struct db_salt *salt)
+/*
+ * Hashes the buffered keys for one salt and processes any guesses.  This is
+ * the part of crk_password_loop() that the pipeline thread may run.
+ */
+static int crk_crypt_salt(struct db_salt *salt)
 {
-	void ext_hybrid_fix_state(void);
 	int count;
 	unsigned int match, index;
 #if CRK_PREFETCH
 	unsigned int target;
 #endif
 
-#if !OS_TIMER
-	sig_timer_emu_tick();
-#endif
-
-	idle_yield();
-
-	if (event_pending && crk_process_event())
-		return -1;
-
-	ext_hybrid_fix_state();
-
 	count = crk_key_index;
 	match = crk_methods.crypt_all(&count, salt);
 	crk_last_key = count;
@@ -884,6 +1238,86 @@ static int crk_password_loop(struct db_salt *salt)
 	return 0;
 }
 
+static int crk_password_loop(struct db_salt *salt)
+{
+#if !OS_TIMER
+	sig_timer_emu_tick();
+#endif
+
+	idle_yield();
+
+	if (event_pending && crk_process_event())
+		return -1;
+
+	ext_hybrid_fix_state();
+
+	return crk_crypt_salt(salt);
+}
+
+static void crk_count_cands(void)
+{
+#if !HAVE_OPENCL
+	/* Assumes we'll never overrun 32-bit in one crypt */
+	add32to64(&status.cands, crk_key_index *
+	          mask_int_cand.num_int_cand);
+#else
+	/* Safe for > 4G crypts per call */
+	int64 totcand;
+	mul32by32(&totcand, crk_key_index, mask_int_cand.num_int_cand);
+	add64to64(&status.cands, &totcand);
+#endif
+}
+
+/*
+ * Called when all buffered keys have been processed for all salts.
+ */
+static int crk_batch_done(void)
+{
+	crk_last_salt = NULL;
+	if (options.flags & FLG_MASK_STACKED)
+		mask_fix_state();
+	else
+	crk_fix_state();
+
+	if (ext_abort)
+		event_abort = 1;
+
+	if (ext_status && !event_abort) {
+		ext_status = 0;
+		event_status = 0;
+		status_print();
+	}
+
+	return ext_abort;
+}
+
+#if CRK_SHARE
+/*
+ * Removes the hashes logged by other processes since last time.  A log entry
+ * may still read as ~0 if the process that logged it hasn't stored the ID
+ * yet, in which case we'll get to it next time.
+ */
+static int crk_share_sync(void)
+{
+	unsigned int count = *crk_share;
+
+	while (crk_share_last < count) {
+		unsigned int id = crk_share_ids[crk_share_last];
+
+		if (id == ~0U)
+			break;
+		crk_share_last++;
+		if (crk_share_seen[id / 32] & (1U << (id % 32)))
+			continue;
+		if (crk_process_guess(crk_share_pws[id].salt,
+		                      crk_share_pws[id].pw, -1))
+			return 1;
+	}
+
+	return 0;
+}
+#endif
+
 static int crk_salt_loop(void)
 {
 	int done;
@@ -892,6 +1326,11 @@ static int crk_salt_loop(void)
 	if (event_reload && crk_reload_pot())
 		return 1;
 
+#if CRK_SHARE
+	if (crk_share && *crk_share != crk_share_last && crk_share_sync())
+		return 1;
+#endif
+
 	salt = crk_db->salts;
 
 	/* on first run, right after restore, this can be non-zero */
@@ -919,44 +1358,225 @@ static int crk_salt_loop(void)
 	if (!salt || salt->count < 2)
 		status.resume_salt_md5 = 0;
 
-	if (done >= 0) {
-#if !HAVE_OPENCL
-		/* Assumes we'll never overrun 32-bit in one crypt */
-		add32to64(&status.cands, crk_key_index *
-		          mask_int_cand.num_int_cand);
-#else
-		/* Safe for > 4G crypts per call */
-		int64 totcand;
-		mul32by32(&totcand, crk_key_index, mask_int_cand.num_int_cand);
-		add64to64(&status.cands, &totcand);
-#endif
-	}
+	if (done >= 0)
+		crk_count_cands();
 
 	if (salt)
 		return 1;
 
 	crk_key_index = 0;
-	crk_last_salt = NULL;
-	if (options.flags & FLG_MASK_STACKED)
-		mask_fix_state();
-	else
-	crk_fix_state();
 
-	if (ext_abort)
-		event_abort = 1;
+	return crk_batch_done();
+}
 
-	if (ext_status && !event_abort) {
-		ext_status = 0;
-		event_status = 0;
-		status_print();
+#if CRK_PIPELINE
+static void crk_pipe_set_keys(int batch, int count)
+{
+	crk_methods.clear_keys();
+	crk_methods.set_keys(crk_pipe_keys[batch], crk_pipe_lengths[batch],
+	                     count);
+	crk_key_index = count;
+}
+
+/*
+ * Counterpart of crk_salt_loop() for pipelined batches.  Pot sync, salt
+ * resume, events and fix_state() are all left to the caller.  A batch is
+ * always completed (unless everything gets cracked), so that the state we
+ * fix afterwards is exact.
+ */
+static int crk_pipe_salt_loop(int batch, int count)
+{
+	struct db_salt *salt;
+
+	crk_pipe_set_keys(batch, count);
+
+	salt = crk_db->salts;
+	do {
+		crk_methods.set_salt(salt->salt);
+		if (crk_crypt_salt(salt))
+			break;
+	} while ((salt = salt->next));
+
+	crk_count_cands();
+	crk_key_index = 0;
+
+	return salt != NULL;
+}
+
+static void *crk_pipe_main(void *arg)
+{
+	pthread_mutex_lock(&crk_pipe_mutex);
+	while (1) {
+		int batch, result;
+
+		while (!crk_pipe_busy && !crk_pipe_quit)
+			pthread_cond_wait(&crk_pipe_cond, &crk_pipe_mutex);
+		if (!crk_pipe_busy)
+			break;
+		batch = crk_pipe_fill ^ 1;
+		pthread_mutex_unlock(&crk_pipe_mutex);
+
+		crk_pipe_deferred = 1;
+		result = crk_pipe_salt_loop(batch, crk_pipe_count[batch]);
+		crk_pipe_deferred = 0;
+
+		pthread_mutex_lock(&crk_pipe_mutex);
+		crk_pipe_result = result;
+		crk_pipe_busy = 0;
+		pthread_cond_broadcast(&crk_pipe_cond);
 	}
+	pthread_mutex_unlock(&crk_pipe_mutex);
 
-	return ext_abort;
+	return NULL;
+}
+
+/*
+ * Waits for the batch in flight (if any), then reports its guesses.
+ */
+static int crk_pipe_wait(void)
+{
+	pthread_mutex_lock(&crk_pipe_mutex);
+	while (crk_pipe_busy)
+		pthread_cond_wait(&crk_pipe_cond, &crk_pipe_mutex);
+	pthread_mutex_unlock(&crk_pipe_mutex);
+
+	if (crk_pipe_guesses)
+		crk_pipe_report_guesses();
+
+	return crk_pipe_result;
+}
+
+static int crk_pipe_submit(void)
+{
+#if !OS_TIMER
+	sig_timer_emu_tick();
+#endif
+
+	idle_yield();
+
+	if (crk_pipe_wait())
+		return 1;
+
+#if CRK_SHARE
+	if (crk_share && *crk_share != crk_share_last && crk_share_sync())
+		return 1;
+#endif
+
+/* Resuming at a salt other than the first is rare, do it the normal way */
+	if (status.resume_salt) {
+		crk_pipe_set_keys(crk_pipe_fill, crk_pipe_index);
+		crk_pipe_index = crk_pipe_pos = crk_pipe_unfixed = 0;
+		return crk_salt_loop();
+	}
+
+/*
+ * Anything that needs a consistent state (events including an abort, pot
+ * sync, an external mode wanting to abort or print status) makes us finish
+ * this batch ourselves.  The pipeline is then drained, so we can fix the
+ * state before handling it.
+ */
+	if (event_pending || event_reload || ext_abort || ext_status) {
+		int done = crk_pipe_salt_loop(crk_pipe_fill, crk_pipe_index);
+
+		crk_pipe_index = crk_pipe_pos = crk_pipe_unfixed = 0;
+		if (done)
+			return 1;
+
+		ext_hybrid_fix_state();
+		if (crk_batch_done())
+			return 1;
+
+		if (event_reload && crk_reload_pot())
+			return 1;
+
+		if (event_pending && crk_process_event())
+			return 1;
+
+		return 0;
+	}
+
+	pthread_mutex_lock(&crk_pipe_mutex);
+	crk_pipe_count[crk_pipe_fill] = crk_pipe_index;
+	crk_pipe_fill ^= 1;
+	crk_pipe_busy = crk_pipe_unfixed = 1;
+	pthread_cond_signal(&crk_pipe_cond);
+	pthread_mutex_unlock(&crk_pipe_mutex);
+
+	crk_pipe_index = crk_pipe_pos = 0;
+
+	return 0;
+}
+
+/*
+ * Drains and stops the pipeline.  Any keys left in the batch being filled
+ * are handed over to crk_done() for processing the usual way.
+ */
+static void crk_pipe_done(void)
+{
+	int result = crk_pipe_wait();
+
+	pthread_mutex_lock(&crk_pipe_mutex);
+	crk_pipe_quit = 1;
+	pthread_cond_broadcast(&crk_pipe_cond);
+	pthread_mutex_unlock(&crk_pipe_mutex);
+	pthread_join(crk_pipe_thread, NULL);
+	crk_pipe = 0;
+
+	if (!result && !event_abort && crk_db->salts) {
+		if (crk_pipe_index)
+			crk_pipe_set_keys(crk_pipe_fill, crk_pipe_index);
+		else if (crk_pipe_unfixed) {
+			ext_hybrid_fix_state();
+			crk_batch_done();
+		}
+	}
+
+	MEM_FREE(crk_pipe_lengths[1]);
+	MEM_FREE(crk_pipe_lengths[0]);
+	MEM_FREE(crk_pipe_keys[1]);
+	MEM_FREE(crk_pipe_keys[0]);
+}
+#endif
+
+/*
+ * Hands the packed keys over to the format.
+ */
+static void crk_batch_flush(void)
+{
+	crk_methods.clear_keys();
+	crk_methods.set_keys(crk_batch, crk_batch_lengths, crk_batch_index);
+	crk_key_index = crk_batch_index;
+	crk_batch_index = crk_batch_pos = 0;
 }
 
 int crk_process_key(char *key)
 {
 	if (crk_db->loaded) {
+#if CRK_PIPELINE
+		if (crk_pipe) {
+			int len = crk_pack_key(crk_pipe_keys[crk_pipe_fill] +
+			                       crk_pipe_pos, key);
+
+			crk_pipe_lengths[crk_pipe_fill][crk_pipe_index] = len;
+			crk_pipe_pos += len + 1;
+			if (++crk_pipe_index >= crk_pipe_max)
+				return crk_pipe_submit();
+			return 0;
+		}
+#endif
+		crk_delta_from = -1;
+
+		if (crk_batch && !crk_key_index) {
+			int len = crk_pack_key(crk_batch + crk_batch_pos, key);
+
+			crk_batch_lengths[crk_batch_index] = len;
+			crk_batch_pos += len + 1;
+			if (++crk_batch_index < crk_batch_max)
+				return 0;
+			crk_batch_flush();
+			return crk_salt_loop();
+		}
+
 		if (crk_key_index == 0)
 			crk_methods.clear_keys();
 
@@ -1000,6 +1620,43 @@ int crk_process_key(char *key)
 	return ext_abort;
 }
 
+int crk_process_key_delta(char *key, int from, int to)
+{
+	int index;
+
+	if (!crk_delta || crk_batch_index || mask_int_cand.num_int_cand > 1)
+		return crk_process_key(key);
+
+	if (!(index = crk_key_index)) {
+		crk_delta_prev_from = crk_delta_from;
+		crk_delta_prev_to = crk_delta_to;
+		crk_delta_from = from;
+		crk_delta_to = to;
+	} else if (crk_delta_from >= 0) {
+		if (from < crk_delta_from)
+			crk_delta_from = from;
+		if (to > crk_delta_to)
+			crk_delta_to = to;
+	}
+
+	from = crk_delta_from;
+	to = crk_delta_to;
+	if (crk_delta_prev_from < from)
+		from = crk_delta_prev_from;
+	if (crk_delta_prev_to > to)
+		to = crk_delta_prev_to;
+
+	if (from < 0)
+		crk_methods.set_key(key, index);
+	else
+		crk_methods.set_key_delta(key, index, from, to);
+
+	if (++crk_key_index >= crk_batch_max)
+		return crk_salt_loop();
+
+	return 0;
+}
+
 /* This function is used by single.c only */
 int crk_process_salt(struct db_salt *salt)
 {
@@ -1021,6 +1678,7 @@ int crk_process_salt(struct db_salt *salt)
 	index = 0;
 
 	crk_methods.clear_keys();
+	crk_delta_from = -1;
 
 	while (count--) {
 		strnzcpy(key, ptr, crk_params.plaintext_length + 1);
@@ -1088,8 +1746,19 @@ char *crk_get_key2(void)
 void crk_done(void)
 {
 	if (crk_db->loaded) {
+#if CRK_PIPELINE
+		if (crk_pipe)
+			crk_pipe_done();
+#endif
+		if (crk_batch) {
+			if (crk_batch_index)
+				crk_batch_flush();
+			MEM_FREE(crk_batch_lengths);
+			MEM_FREE(crk_batch);
+		}
 		if (crk_key_index && crk_db->salts && !event_abort)
 			crk_salt_loop();
+		log_guess_sync();
 	}
 	c_cleanup();
 }
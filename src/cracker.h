@@ -33,6 +33,14 @@ extern void crk_init(struct db_main *db, void (*fix_state)(void),
  */
 extern int crk_process_key(char *key);
 
+/*
+ * Same as crk_process_key(), for a mode that knows the key only differs from
+ * the previous one it passed here in bytes from to to - 1 (with the same
+ * length).  A from of -1 means it may differ anywhere.  Formats that can patch
+ * their key buffers in place then get just the changed bytes.
+ */
+extern int crk_process_key_delta(char *key, int from, int to);
+
 /*
  * Resets the guessed keys buffer and processes all the buffered keys for
  * this salt. The return value is the same as for crk_process_key().
@@ -56,6 +64,12 @@ extern void crk_done(void);
  */
 extern int crk_reload_pot(void);
 
+/*
+ * Sets up sharing of cracked hashes between "--fork" processes.  Must be
+ * called before fork(), with the database fully loaded.
+ */
+extern void crk_share_init(struct db_main *db);
+
 /*
  * Exported for stacked modes
  */
@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+##############################################################################
+# tests that an interrupted session of an external mode running a copy per
+# OpenMP thread (ExternalParallel) resumes without losing candidates.  The
+# hashes are salted (so that each run takes a while) md5crypt ones of words
+# from all threads' shares of DumbForce's keyspace.  The session is interrupted
+# every DELAY seconds and restored until it completes, then all of them must
+# have been cracked.
+#
+# usage:
+#    ./ext-restore-test.sh           (4 threads, interrupts every 2 s)
+#    ./ext-restore-test.sh  # delay  (# threads, interrupts every delay s)
+##############################################################################
+
+THREADS=${1:-4}
+DELAY=${2:-2}
+JOHN="../run/john --nolog --pot=./ext-rest.pot --format=md5crypt"
+RUNS=0
+
+export OMP_NUM_THREADS=$THREADS
+rm -f ext-rest.in ext-rest.pot ext-rest.rec
+
+../run/john --nolog --external=DumbForce --max-length=2 --stdout 2> /dev/null |
+  awk 'NR % 997 == 7' |
+  perl -ne 'chomp; print "u$.:", crypt($_, "\$1\$er$.\$"), "\n"' \
+  > ext-rest.in
+TOTAL=`wc -l < ext-rest.in`
+
+$JOHN --session=ext-rest --external=DumbForce --max-length=2 ext-rest.in > /dev/null 2>&1 &
+sleep $DELAY
+kill -INT $! 2> /dev/null
+wait
+while [ -f ext-rest.rec ] && [ $RUNS -lt 100 ]
+do
+  ../run/john --restore=ext-rest > /dev/null 2>&1 &
+  sleep $DELAY
+  kill -INT $! 2> /dev/null
+  wait
+  RUNS=$(($RUNS+1))
+done
+
+CRACKED=`$JOHN --show ext-rest.in 2> /dev/null | grep -c '^u'`
+if [ -f ext-rest.rec ] || [ "x$CRACKED" != "x$TOTAL" ]
+then
+  echo "FAILURE!!! $CRACKED of $TOTAL cracked after $RUNS restores"
+  RET=1
+else
+  echo "Success    $CRACKED of $TOTAL cracked after $RUNS restores"
+  RET=0
+fi
+rm -f ext-rest.in ext-rest.pot ext-rest.rec
+exit $RET
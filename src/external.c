@@ -12,9 +12,14 @@
 
 #include <stdio.h>
 #include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
+#include "arch.h"
 #include "misc.h"
 #include "params.h"
+#include "memory.h"
 #include "os.h" /* Needed for signals.h */
 #include "signals.h"
 #include "compiler.h"
@@ -68,9 +73,22 @@ c_int ext_abort, ext_status; /* cracker needs to know about these */
 static c_int ext_cipher_limit, ext_minlen, ext_maxlen;
 static c_int ext_hybrid_resume, ext_hybrid_total;
 static c_int ext_time, ext_utf32, ext_target_utf8;
+static c_int ext_thread_id, ext_thread_count;
 
-static struct c_ident ext_ident_status = {
+static struct c_ident ext_ident_thread_id = {
 	NULL,
+	"thread_id",
+	&ext_thread_id
+};
+
+static struct c_ident ext_ident_thread_count = {
+	&ext_ident_thread_id,
+	"thread_count",
+	&ext_thread_count
+};
+
+static struct c_ident ext_ident_status = {
+	&ext_ident_thread_count,
 	"status",
 	&ext_status
 };
@@ -140,6 +158,46 @@ static void *f_next = NULL;
 void *f_new = NULL;
 void *f_filter = NULL;
 
+/*
+ * A copy of the program, each with its own variables.  The first one is the
+ * original, using the variables above.
+ */
+struct ext_instance {
+	c_int *word;
+	void *f_generate, *f_filter;
+	char *int_word, *rec_word;
+/* Last word passed to the cracker in the current batch, if any */
+	char *last;
+	void *clone;
+	struct c_ident *globals;
+};
+
+/* Enough for all of the variables above */
+#define EXT_MAX_GLOBALS			0x10
+
+/* What a copy other than the first one points the above to */
+struct ext_copy {
+	c_int word[PLAINTEXT_BUFFER_SIZE];
+	char int_word[PLAINTEXT_BUFFER_SIZE];
+	char rec_word[PLAINTEXT_BUFFER_SIZE];
+	struct c_ident globals[EXT_MAX_GLOBALS];
+	c_int vars[EXT_MAX_GLOBALS];
+};
+
+int ext_threads = 1;
+static struct ext_instance ext_main = {
+	ext_word, NULL, NULL, int_word, rec_word, NULL, NULL, &ext_globals
+};
+static struct ext_instance *ext_inst = &ext_main;
+
+/* Whether do_external_crack() runs generate() on all copies */
+static int ext_par;
+
+#ifdef _OPENMP
+/* Words each copy generates per round in do_external_crack() */
+#define EXT_BATCH_PER_THREAD		0x400
+#endif
+
 static struct cfg_list *ext_source;
 static struct cfg_line *ext_line;
 static int ext_pos;
@@ -196,8 +254,125 @@ int ext_has_function(char *mode, char *function)
 	return (c_lookup(function) != NULL);
 }
 
+/*
+ * Returns the address of a copy's variable corresponding to one of ours.
+ */
+static c_int *ext_var(struct ext_instance *x, c_int *var)
+{
+	struct c_ident *orig = &ext_globals, *copy = x->globals;
+
+	while (orig->addr != var) {
+		orig = orig->next;
+		copy = copy->next;
+	}
+
+	return copy->addr;
+}
+
+/*
+ * Sets up another copy of the program, with our variables' current values
+ * except for thread_id.  Returns zero if the program can't be copied.
+ */
+static int ext_clone(struct ext_instance *x, int thread)
+{
+	struct ext_copy *copy;
+	struct c_ident *var;
+	int i;
+
+	copy = mem_calloc(1, sizeof(*copy));
+	for (var = &ext_globals, i = 0; var; var = var->next, i++) {
+		copy->globals[i].next = var->next ? &copy->globals[i + 1] : NULL;
+		copy->globals[i].name = var->name;
+		if (var->addr == ext_word) {
+			copy->globals[i].addr = copy->word;
+			continue;
+		}
+		copy->globals[i].addr = &copy->vars[i];
+		copy->vars[i] = *(c_int *)var->addr;
+	}
+
+	x->word = copy->word;
+	x->int_word = copy->int_word;
+	x->rec_word = copy->rec_word;
+	x->last = NULL;
+	x->globals = copy->globals;
+	*ext_var(x, &ext_thread_id) = thread;
+
+	if (!(x->clone = c_clone(copy->globals))) {
+		MEM_FREE(copy);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Folds the copies' abort and status requests into ours.
+ */
+static void ext_fold_flags(void)
+{
+	int t;
+
+	for (t = 1; t < ext_threads; t++) {
+		c_int *status = ext_var(&ext_inst[t], &ext_status);
+
+		if (*ext_var(&ext_inst[t], &ext_abort))
+			ext_abort = 1;
+		if (*status) {
+			*status = 0;
+			ext_status = 1;
+		}
+	}
+}
+
+/*
+ * Runs a copy of the program for each thread if the mode says it's fine
+ * with that, by referring to thread_id or thread_count.
+ */
+static void ext_init_threads(void)
+{
+#ifdef _OPENMP
+	int t;
+#endif
+
+	ext_thread_id = 0;
+	ext_thread_count = 1;
+#ifdef _OPENMP
+	if (omp_get_max_threads() < 2 || c_lookup("new") ||
+	    (!c_refers(&ext_thread_id) && !c_refers(&ext_thread_count)) ||
+	    !cfg_get_bool(SECTION_OPTIONS, NULL, "ExternalParallel", 1))
+		return;
+/* The node split and stacked modes need the words in order */
+	if ((ext_flags & EXT_REQ_GENERATE) &&
+	    (options.node_count || (options.flags & FLG_MASK_STACKED)))
+		return;
+#if HAVE_REXGEN
+	if ((ext_flags & EXT_REQ_GENERATE) && regex)
+		return;
+#endif
+
+	ext_thread_count = omp_get_max_threads();
+	ext_inst = mem_calloc(ext_thread_count, sizeof(*ext_inst));
+	ext_inst[0] = ext_main;
+	for (t = 1; t < ext_thread_count; t++)
+		if (!ext_clone(&ext_inst[t], t))
+			break;
+
+	if (t == 1) {
+		MEM_FREE(ext_inst);
+		ext_inst = &ext_main;
+	}
+	ext_thread_count = ext_threads = t;
+	while (--t > 0)
+		*ext_var(&ext_inst[t], &ext_thread_count) = ext_threads;
+	ext_par = ext_threads > 1 && (ext_flags & EXT_REQ_GENERATE);
+#endif
+}
+
 void ext_init(char *mode, struct db_main *db)
 {
+	int t;
+
 	if (db && db->format) {
 		/* This is second time we are called, just update max length */
 		ext_cipher_limit = maxlen =
@@ -206,6 +381,9 @@ void ext_init(char *mode, struct db_main *db)
 			ext_cipher_limit /= mask_num_qw;
 			maxlen /= mask_num_qw;
 		}
+		for (t = 1; t < ext_threads; t++)
+			*ext_var(&ext_inst[t], &ext_cipher_limit) =
+				ext_cipher_limit;
 		return;
 	} else
 		ext_cipher_limit = maxlen = options.length;
@@ -246,13 +424,38 @@ void ext_init(char *mode, struct db_main *db)
 		error();
 	}
 
+	ext_init_threads();
+
 	ext_word[0] = 0;
 	c_execute(c_lookup("init"));
+	for (t = 1; t < ext_threads; t++) {
+		ext_inst[t].word[0] = 0;
+		c_execute(c_clone_lookup(ext_inst[t].clone, "init"));
+	}
 
 	f_generate = c_lookup("generate");
 	f_filter = c_lookup("filter");
 	f_new = c_lookup("new");
 	f_next = c_lookup("next");
+	for (t = 1; t < ext_threads; t++) {
+		ext_inst[t].f_generate =
+			c_clone_lookup(ext_inst[t].clone, "generate");
+		ext_inst[t].f_filter =
+			c_clone_lookup(ext_inst[t].clone, "filter");
+	}
+
+	if (cfg_get_bool(SECTION_OPTIONS, NULL, "ExternalNativeCode", 1)) {
+		f_generate = c_jit(f_generate);
+		f_filter = c_jit(f_filter);
+		f_new = c_jit(f_new);
+		f_next = c_jit(f_next);
+		for (t = 1; t < ext_threads; t++) {
+			ext_inst[t].f_generate = c_jit(ext_inst[t].f_generate);
+			ext_inst[t].f_filter = c_jit(ext_inst[t].f_filter);
+		}
+	}
+	ext_inst[0].f_generate = f_generate;
+	ext_inst[0].f_filter = f_filter;
 
 	if (f_new && !f_next) {
 		if (john_main_process)
@@ -299,17 +502,18 @@ void ext_init(char *mode, struct db_main *db)
 	ext_mode = mode;
 }
 
-int ext_filter_body(char *in, char *out)
+static MAYBE_INLINE int ext_filter_word(struct ext_instance *x,
+	char *in, char *out)
 {
 	unsigned char *internal;
 	c_int *external;
 
 	if (ext_utf32) {
-		enc_to_utf32((UTF32*)ext_word, PLAINTEXT_BUFFER_SIZE,
+		enc_to_utf32((UTF32*)x->word, PLAINTEXT_BUFFER_SIZE,
 		             (UTF8*)in, strlen(in));
 	} else {
 		internal = (unsigned char *)in;
-		external = ext_word;
+		external = x->word;
 		external[0] = internal[0];
 		external[1] = internal[1];
 		external[2] = internal[2];
@@ -329,15 +533,15 @@ int ext_filter_body(char *in, char *out)
 		} while (1);
 	}
 
-	c_execute_fast(f_filter);
+	c_execute_fast(x->f_filter);
 
-	if (!ext_word[0] && in[0]) return 0;
+	if (!x->word[0] && in[0]) return 0;
 
 	if (ext_utf32) {
-		utf32_to_enc((UTF8*)int_word, maxlen, (UTF32*)ext_word);
+		utf32_to_enc((UTF8*)out, maxlen, (UTF32*)x->word);
 	} else {
 		internal = (unsigned char *)out;
-		external = ext_word;
+		external = x->word;
 		internal[0] = external[0];
 		internal[1] = external[1];
 		internal[2] = external[2];
@@ -361,17 +565,68 @@ int ext_filter_body(char *in, char *out)
 	return 1;
 }
 
-static void save_state(FILE *file)
+int ext_filter_body(char *in, char *out)
 {
-	unsigned char *ptr;
+	return ext_filter_word(&ext_inst[0], in, out);
+}
+
+char **ext_filter_keys(char *keys, size_t stride, int count)
+{
+	static char *buf, **res;
+	static int size;
+	int threads = ext_threads, per = (count + threads - 1) / threads, t;
+
+	if (count > size) {
+		MEM_FREE(buf);
+		MEM_FREE(res);
+		buf = mem_alloc((size_t)count * PLAINTEXT_BUFFER_SIZE);
+		res = mem_alloc(count * sizeof(*res));
+		size = count;
+	}
+
+#pragma omp parallel for default(none) private(t) \
+	shared(threads, count, per, keys, stride, buf, res, ext_inst)
+	for (t = 0; t < threads; t++) {
+		int k = t * per, last = k + per;
+
+		if (last > count)
+			last = count;
+		for (; k < last; k++) {
+			char *out = &buf[(size_t)k * PLAINTEXT_BUFFER_SIZE];
+
+			res[k] = ext_filter_word(&ext_inst[t],
+			    &keys[k * stride], out) ? out : NULL;
+		}
+	}
+	ext_fold_flags();
+
+	return res;
+}
+
+static void save_word(FILE *file, char *word)
+{
+	unsigned char *ptr = (unsigned char *)word;
 
-	fprintf(file, "%u\n", rec_seq);
-	ptr = (unsigned char *)rec_word;
 	do {
 		fprintf(file, "%d\n", (int)*ptr);
 	} while (*ptr++);
 }
 
+static void save_state(FILE *file)
+{
+	int t;
+
+	fprintf(file, "%u\n", rec_seq);
+	save_word(file, rec_word);
+	if (!ext_par)
+		return;
+
+/* Copies of the program need their own words back */
+	fprintf(file, "%d\n", ext_threads);
+	for (t = 1; t < ext_threads; t++)
+		save_word(file, ext_inst[t].rec_word);
+}
+
 static void save_state_hybrid(FILE *file)
 {
 	unsigned char *ptr;
@@ -383,18 +638,15 @@ static void save_state_hybrid(FILE *file)
 	fprintf(file, "\n");
 }
 
-static int restore_state(FILE *file)
+static int restore_word(FILE *file, struct ext_instance *x)
 {
 	int c;
 	unsigned char *internal;
 	c_int *external;
 	int count;
 
-	if (rec_version >= 4 && fscanf(file, "%u\n", &seq) != 1)
-		return 1;
-
-	internal = (unsigned char *)int_word;
-	external = ext_word;
+	internal = (unsigned char *)x->int_word;
+	external = x->word;
 	count = 0;
 	do {
 		if (fscanf(file, "%d\n", &c) != 1) return 1;
@@ -402,9 +654,40 @@ static int restore_state(FILE *file)
 	} while ((*internal++ = *external++ = c));
 
 	if (ext_utf32)
-		enc_to_utf32((UTF32*)ext_word, PLAINTEXT_BUFFER_SIZE,
-		             (UTF8*)int_word, strlen(int_word));
+		enc_to_utf32((UTF32*)x->word, PLAINTEXT_BUFFER_SIZE,
+		             (UTF8*)x->int_word, strlen(x->int_word));
+
+	return 0;
+}
+
+static int restore_state(FILE *file)
+{
+	int t, threads;
+
+	if (rec_version >= 4 && fscanf(file, "%u\n", &seq) != 1)
+		return 1;
+
+	if (restore_word(file, &ext_inst[0]))
+		return 1;
+
+	if (ext_par) {
+		if (fscanf(file, "%d\n", &threads) != 1)
+			return 1;
+		if (threads != ext_threads) {
+			if (john_main_process)
+				fprintf(stderr, "Session was saved with %d "
+				    "external mode threads, now %d\n",
+				    threads, ext_threads);
+			return 1;
+		}
+		for (t = 1; t < ext_threads; t++)
+			if (restore_word(file, &ext_inst[t]))
+				return 1;
+	}
+
 	c_execute(c_lookup("restore"));
+	for (t = 1; t < ext_threads && ext_par; t++)
+		c_execute(c_clone_lookup(ext_inst[t].clone, "restore"));
 
 	return 0;
 }
@@ -449,6 +732,21 @@ int ext_restore_state_hybrid(const char *sig, FILE *file)
 
 static void fix_state(void)
 {
+/*
+ * The cracker takes hybrid snapshots in plain external mode as well, but
+ * those only cover the first copy of the program.
+ */
+	if (ext_par) {
+		int t;
+
+		for (t = 0; t < ext_threads; t++) {
+			struct ext_instance *x = &ext_inst[t];
+
+			strcpy(x->rec_word, x->last ? x->last : x->int_word);
+		}
+		hybrid_rec_word[0] = 0;
+		return;
+	}
 	if (hybrid_rec_word[0]) {
 		strcpy(rec_word, hybrid_rec_word);
 		rec_seq = hybrid_rec_seq;
@@ -469,19 +767,106 @@ void ext_hybrid_fix_state(void)
 	strcpy(hybrid_actual_completed_base_word, int_hybrid_base_word);
 }
 
+#ifdef _OPENMP
+static MAYBE_INLINE void ext_word_to_key(c_int *word, char *key)
+{
+	if (ext_utf32) {
+		utf32_to_enc((UTF8*)key, maxlen, (UTF32*)word);
+	} else {
+		unsigned char *internal = (unsigned char *)key;
+
+		while ((*internal++ = *word++))
+			;
+		key[maxlen] = 0;
+	}
+}
+
+/*
+ * Has each copy of the program generate (and filter) a batch of words on its
+ * own thread, then passes them to the cracker taking one from each copy in
+ * turn.
+ */
+static void ext_crack_parallel(void)
+{
+	int threads = ext_threads, live = threads, stop = 0, t, k;
+	size_t size = (size_t)EXT_BATCH_PER_THREAD * PLAINTEXT_BUFFER_SIZE;
+	char *buf = mem_alloc(threads * size);
+	int *count = mem_alloc(threads * sizeof(*count));
+	char *done = mem_calloc(threads, 1);
+
+	log_event("- Generating external mode words on %d threads", threads);
+
+	while (live && !stop) {
+#pragma omp parallel for default(none) private(t) \
+	shared(threads, ext_inst, buf, size, count, done)
+		for (t = 0; t < threads; t++) {
+			struct ext_instance *x = &ext_inst[t];
+			char *out = &buf[t * size];
+			int n = 0;
+
+			while (!done[t] && n < EXT_BATCH_PER_THREAD) {
+				c_execute_fast(x->f_generate);
+				if (!x->word[0]) {
+					done[t] = 1;
+					break;
+				}
+
+				if (x->f_filter) {
+					c_execute_fast(x->f_filter);
+					if (!x->word[0])
+						continue;
+				}
+
+				ext_word_to_key(x->word,
+				    &out[n++ * PLAINTEXT_BUFFER_SIZE]);
+			}
+			count[t] = n;
+		}
+		ext_fold_flags();
+
+/* Take turns, so that all copies get ahead even if we're interrupted */
+		for (k = 0; k < EXT_BATCH_PER_THREAD && !stop; k++)
+		for (t = 0; t < threads; t++) {
+			struct ext_instance *x = &ext_inst[t];
+
+			if (k >= count[t])
+				continue;
+			x->last = &buf[t * size + k * PLAINTEXT_BUFFER_SIZE];
+			if ((stop = crk_process_key(x->last)))
+				break;
+		}
+
+		for (live = t = 0; t < threads; t++) {
+			struct ext_instance *x = &ext_inst[t];
+
+			if (x->last)
+				strcpy(x->int_word, x->last);
+			x->last = NULL;
+			live += !done[t];
+		}
+	}
+
+	MEM_FREE(done);
+	MEM_FREE(count);
+	MEM_FREE(buf);
+}
+#endif
+
 void do_external_crack(struct db_main *db)
 {
 	unsigned char *internal;
 	c_int *external;
-	int my_words, their_words;
+	int my_words, their_words, t;
 
 	log_event("Proceeding with external mode: %.100s", ext_mode);
 
-	internal = (unsigned char *)int_word;
-	external = ext_word;
-	while (*external)
-		*internal++ = *external++;
-	*internal = 0;
+	for (t = 0; t < ext_threads; t++) {
+		internal = (unsigned char *)ext_inst[t].int_word;
+		external = ext_inst[t].word;
+		while (*external)
+			*internal++ = *external++;
+		*internal = 0;
+	}
 
 	seq = 0;
 
@@ -492,6 +877,13 @@ void do_external_crack(struct db_main *db)
 
 	crk_init(db, fix_state, NULL);
 
+#ifdef _OPENMP
+	if (ext_par) {
+		ext_crack_parallel();
+		goto done;
+	}
+#endif
+
 	my_words = options.node_max - options.node_min + 1;
 	their_words = options.node_min - 1;
 
@@ -570,6 +962,9 @@ void do_external_crack(struct db_main *db)
 		if (crk_process_key(int_word)) break;
 	} while (1);
 
+#ifdef _OPENMP
+done:
+#endif
 	if (!event_abort)
 		progress = 100; /* For reporting DONE after a no-ETA run */
 
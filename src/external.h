@@ -31,6 +31,12 @@ extern unsigned int ext_flags;
 
 extern c_int ext_abort, ext_status;
 
+/*
+ * Number of copies of the external mode program, each with its own variables.
+ * More than one only when the mode refers to thread_id or thread_count.
+ */
+extern int ext_threads;
+
 /*
  * Defined for use in the ext_filter() macro, below.
  */
@@ -64,6 +70,13 @@ extern void ext_init(char *mode, struct db_main *db);
  */
 extern int ext_filter_body(char *in, char *out);
 
+/*
+ * Runs count keys stride bytes apart through the external filter, using all
+ * copies of the program in parallel.  Returns the filtered keys, with NULLs
+ * for rejected ones, valid until the next call.
+ */
+extern char **ext_filter_keys(char *keys, size_t stride, int count);
+
 /*
  * Runs the external mode cracker.
  */
@@ -74,6 +87,11 @@ extern void do_external_crack(struct db_main *db);
  */
 extern int do_external_hybrid_crack(struct db_main *db, const char *base_word);
 
+/*
+ * Snapshots the hybrid mode's position, for its fix_state() to pick up.
+ */
+extern void ext_hybrid_fix_state(void);
+
 /*
  * This is required by recovery to be able to recover external's state
  */
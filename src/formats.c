@@ -822,6 +822,80 @@ static char *fmt_self_test_body(struct fmt_main *format,
 					return s_size;
 				}
 			}
+
+			/* 4. A batch set_keys() must agree with set_key(),
+			   including cleaning up after the longer keys above */
+			if (format->methods.set_keys) {
+				char *keys, *p;
+				int *lengths;
+
+				keys = p = mem_alloc((max + 1) *
+				                     PLAINTEXT_BUFFER_SIZE);
+				lengths = mem_alloc(max * sizeof(int));
+				for (i = 0; i < max; i++) {
+					char *key = format->params.tests[i %
+					                     ntests].plaintext;
+
+					lengths[i] = strlen(key);
+					memcpy(p, key, lengths[i] + 1);
+					p += lengths[i] + 1;
+				}
+				memset(p, 0, PLAINTEXT_BUFFER_SIZE);
+				format->methods.clear_keys();
+				format->methods.set_keys(keys, lengths, max);
+				MEM_FREE(lengths);
+				MEM_FREE(keys);
+
+				for (i = 0; i < max; i++) {
+					char *getkey = format->methods.get_key(i);
+					char *setkey = format->params.tests[i %
+					                        ntests].plaintext;
+
+					if (!getkey || strncmp(getkey, setkey, ml)) {
+						sprintf(s_size, "set_keys() in index %d",
+						        i);
+						return s_size;
+					}
+				}
+
+				ret = is_key_right(format, 0, binary, ciphertext,
+				                   plaintext, 0, dbsalt);
+				if (ret)
+					return ret;
+			}
+
+			/* 5. set_key_delta() must patch the given range in
+			   place, and only that */
+			if (format->methods.set_key_delta) {
+				char key[PLAINTEXT_BUFFER_SIZE];
+
+				format->methods.clear_keys();
+				for (i = 0; i < max; i++) {
+					char *setkey = format->params.tests[i %
+					                        ntests].plaintext;
+					int len = strlen(setkey), j;
+
+					fmt_set_key(setkey, i);
+					strnzcpy(key, setkey, sizeof(key));
+					for (j = len / 2; j < len; j++)
+						key[j] = (key[j] == 'x') ? 'y' : 'x';
+					format->methods.set_key_delta(key, i,
+					                              len / 2, len);
+					if (strncmp(format->methods.get_key(i),
+					            key, ml)) {
+						sprintf(s_size, "set_key_delta() in "
+						        "index %d", i);
+						return s_size;
+					}
+					format->methods.set_key_delta(setkey, i,
+					                              len / 2, len);
+				}
+
+				ret = is_key_right(format, 0, binary, ciphertext,
+				                   plaintext, 0, dbsalt);
+				if (ret)
+					return ret;
+			}
 		}
 #endif
 
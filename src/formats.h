@@ -307,6 +307,22 @@ struct fmt_methods {
 
 /* Compares an ASCII ciphertext against a particular crypt_all() output */
 	int (*cmp_exact)(char *source, int index);
+
+/* Sets count plaintexts at once, at indices 0 to count - 1, after a call to
+ * clear_keys().  The keys are packed back to back in the keys buffer, each one
+ * NUL-terminated, with their lengths (not counting the NUL) in lengths[].  As
+ * with set_key(), the buffer may be over-read by up to PLAINTEXT_BUFFER_SIZE
+ * past the start of the last key.  This is optional (may be NULL, which is
+ * what formats not listing it get), in which case set_key() is used. */
+	void (*set_keys)(char *keys, int *lengths, int count);
+
+/* Patches the key at the given index, which must have been set with set_key()
+ * or set_key_delta() before.  The caller guarantees that the new key has the
+ * same length as the old one and only differs from it in bytes from to to - 1,
+ * so only those need to be copied (eg. into interleaved SIMD buffers).  The
+ * cracker does not call clear_keys() between batches of such keys.  This is
+ * optional (may be NULL), in which case set_key() is used. */
+	void (*set_key_delta)(char *key, int index, int from, int to);
 };
 
 /*
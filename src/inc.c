@@ -8,6 +8,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "arch.h"
 #include "misc.h"
@@ -76,6 +79,35 @@ static int regex_case;
 static char *regex;
 #endif
 
+#ifdef _OPENMP
+/*
+ * With IncrementalParallelKeys, a (length, fixed, count) block is split into
+ * its slower positions, walked serially, and enough of its faster positions
+ * to make a batch for all OpenMP threads.  Each thread produces the keys for
+ * one contiguous range of the faster positions' combinations, so for a fixed
+ * prefix of them, and the keys are then fed to the cracker in order.
+ * inc_par_index is the combination last passed to the cracker, for
+ * fix_state().
+ */
+#define INC_BATCH_PER_THREAD	0x1000
+static int inc_par_keys, inc_par_active;
+static int inc_par_count, inc_par_pos[CHARSET_LENGTH];
+static int inc_par_radix[CHARSET_LENGTH];
+static unsigned long long inc_par_size, inc_par_index;
+static char *inc_par_buf;
+static int *inc_par_from;
+
+static void inc_par_set_numbers(unsigned long long index)
+{
+	int i;
+
+	for (i = 0; i < inc_par_count; i++) {
+		numbers[inc_par_pos[i]] = index % inc_par_radix[i];
+		index /= inc_par_radix[i];
+	}
+}
+#endif
+
 static void save_state(FILE *file)
 {
 	unsigned int pos;
@@ -111,6 +143,10 @@ static int restore_state(FILE *file)
 
 static void fix_state(void)
 {
+#ifdef _OPENMP
+	if (inc_par_active)
+		inc_par_set_numbers(inc_par_index);
+#endif
 	if (hybrid_rec_entry || hybrid_rec_length) {
 		rec_entry = hybrid_rec_entry;
 		rec_length = hybrid_rec_length;
@@ -358,6 +394,175 @@ static void inc_new_count(unsigned int length, int count, char *charset,
 		inc_format_error(charset);
 }
 
+#ifdef _OPENMP
+/*
+ * Picks the positions to split a block on, fastest first.  Returns zero if
+ * the block is too small to be worth it.
+ */
+static int inc_par_setup(int length, int fixed)
+{
+	int *counts_length = counts[length];
+	unsigned long long batch = INC_BATCH_PER_THREAD * omp_get_max_threads();
+	int pos;
+
+	inc_par_count = 0;
+	inc_par_size = 1;
+	for (pos = length; pos >= 0 && inc_par_size < batch; pos--) {
+		if (pos == fixed)
+			continue;
+		inc_par_pos[inc_par_count] = pos;
+		inc_par_radix[inc_par_count++] = counts_length[pos] + 1;
+		inc_par_size *= counts_length[pos] + 1;
+	}
+
+	return inc_par_size >= INC_BATCH_PER_THREAD;
+}
+
+/* Same as what inc_key_loop() does, from position pos on */
+static MAYBE_INLINE void inc_par_build_key(char *key, unsigned char *nums,
+	int pos, int length, char *char1, char2_table char2, chars_table *chars)
+{
+	for (; pos <= length; pos++)
+	if (pos == 0)
+		key[0] = char1[nums[0]];
+	else
+	if (pos == 1)
+		key[1] = (*char2)[ARCH_INDEX(key[0]) - CHARSET_MIN][nums[1]];
+	else
+		key[pos] = (*chars[pos - 2])
+		    [ARCH_INDEX(key[pos - 2]) - CHARSET_MIN]
+		    [ARCH_INDEX(key[pos - 1]) - CHARSET_MIN]
+		    [nums[pos]];
+}
+
+static int inc_key_loop_parallel(int length, int fixed,
+	char *char1, char2_table char2, chars_table *chars)
+{
+	char key_e[PLAINTEXT_BUFFER_SIZE];
+	int *counts_length = counts[length];
+	int threads = omp_get_max_threads();
+	int batch = INC_BATCH_PER_THREAD * threads;
+	int n = inc_par_count, stride = length + 2, first_key = 1;
+	char **filtered;
+	unsigned long long index = 0;
+	int i, pos;
+
+	if (!inc_par_buf) {
+		inc_par_buf = mem_alloc((size_t)batch * (CHARSET_LENGTH + 2));
+		inc_par_from = mem_alloc(batch * sizeof(int));
+	}
+
+	for (i = n - 1; i >= 0; i--)
+		index = index * inc_par_radix[i] + numbers[inc_par_pos[i]];
+
+	inc_par_active = 1;
+	while (1) {
+		while (index < inc_par_size) {
+			int count = inc_par_size - index < batch ?
+				inc_par_size - index : batch;
+			int per = (count + threads - 1) / threads, t;
+
+#pragma omp parallel for default(none) private(t) \
+	shared(threads, count, per, index, stride, length, n, inc_par_pos, \
+	       inc_par_radix, numbers, char1, char2, chars, inc_par_buf, \
+	       inc_par_from)
+			for (t = 0; t < threads; t++) {
+				char key[CHARSET_LENGTH + 2];
+				unsigned char nums[CHARSET_LENGTH];
+				unsigned long long k = index + (unsigned long long)t * per;
+				int first = t * per, last = first + per, c, from;
+
+				if (last > count)
+					last = count;
+				if (first >= last)
+					continue;
+
+/* The key before ours differs from the slowest position that carried over */
+				memcpy(nums, numbers, sizeof(nums));
+				from = -1;
+				for (c = 0; c < n; c++) {
+					nums[inc_par_pos[c]] = k % inc_par_radix[c];
+					k /= inc_par_radix[c];
+					if (from < 0 && nums[inc_par_pos[c]])
+						from = inc_par_pos[c];
+				}
+				inc_par_build_key(key, nums, 0, length,
+				                  char1, char2, chars);
+				key[length + 1] = 0;
+
+				for (; first < last; first++) {
+					memcpy(&inc_par_buf[first * stride], key,
+					       length + 2);
+					inc_par_from[first] = from;
+
+					for (c = 0; c < n; c++) {
+						if (++nums[inc_par_pos[c]] <
+						    inc_par_radix[c])
+							break;
+						nums[inc_par_pos[c]] = 0;
+					}
+					if (c < n) {
+						from = inc_par_pos[c];
+						inc_par_build_key(key, nums, from,
+						    length, char1, char2, chars);
+					}
+				}
+			}
+
+			filtered = NULL;
+			if (f_filter && ext_threads > 1)
+				filtered = ext_filter_keys(inc_par_buf, stride,
+				                           count);
+
+			for (i = 0; i < count; i++) {
+				char *key = &inc_par_buf[i * stride];
+				int done;
+
+				inc_par_index = index + i;
+				if (filtered) {
+					if (!filtered[i])
+						continue;
+					done = crk_process_key(filtered[i]);
+				} else
+				if (f_filter) {
+					if (!ext_filter_body(key, key_e))
+						continue;
+					done = crk_process_key(key_e);
+				} else {
+					done = crk_process_key_delta(key,
+					    first_key ? -1 : inc_par_from[i],
+					    length + 1);
+					first_key = 0;
+				}
+				if (done) {
+					inc_par_set_numbers(inc_par_index);
+					inc_par_active = 0;
+					return 1;
+				}
+			}
+			index += count;
+		}
+
+/* Next combination of the slower positions, if any */
+		pos = inc_par_pos[n - 1];
+		while (pos-- > 0) {
+			if (pos == fixed)
+				continue;
+			if (++numbers[pos] <= counts_length[pos])
+				break;
+			numbers[pos] = 0;
+		}
+		if (pos < 0)
+			break;
+		index = 0;
+	}
+	inc_par_set_numbers(0);
+	inc_par_active = 0;
+
+	return 0;
+}
+#endif
+
 static int inc_key_loop(struct db_main *db, int length, int fixed, int count,
 	char *char1, char2_table char2, chars_table *chars)
 {
@@ -368,17 +573,28 @@ static int inc_key_loop(struct db_main *db, int length, int fixed, int count,
 	int *counts_length;
 	int counts_cache;
 	int numbers_cache;
-	int pos;
+	int pos, from;
 
 	key_i[length + 1] = 0;
 	numbers[fixed] = count;
 
+#ifdef _OPENMP
+	if (inc_par_keys &&
+#if HAVE_REXGEN
+	    !regex &&
+#endif
+	    !f_new && !options.mask && inc_par_setup(length, fixed))
+		return inc_key_loop_parallel(length, fixed,
+		                             char1, char2, chars);
+#endif
+
 	chars_cache = NULL;
 
 	counts_length = counts[length];
 	counts_cache = counts_length[length];
 
 	pos = 0;
+	from = -1;
 update_ending:
 	if (pos < 2) {
 		if (pos == 0)
@@ -422,28 +638,39 @@ update_last:
 		if (do_mask_crack(key))
 			return 1;
 	} else
-	if (!f_filter || ext_filter_body(key_i, key = key_e))
-		if (crk_process_key(key))
-			return 1;
+	if (f_filter) {
+		if (ext_filter_body(key_i, key = key_e))
+			if (crk_process_key(key))
+				return 1;
+	} else
+	if (crk_process_key_delta(key, from, length + 1))
+		return 1;
 
 	pos = length;
 	if (fixed < length) {
 		if (++numbers_cache <= counts_cache) {
-			if (length >= 2)
+			if (length >= 2) {
+				from = length;
 				goto update_last;
+			}
 			numbers[length] = numbers_cache;
+			from = pos;
 			goto update_ending;
 		}
 		numbers[pos--] = 0;
 		while (pos > fixed) {
-			if (++numbers[pos] <= counts_length[pos])
+			if (++numbers[pos] <= counts_length[pos]) {
+				from = pos;
 				goto update_ending;
+			}
 			numbers[pos--] = 0;
 		}
 	}
 	while (pos-- > 0) {
-		if (++numbers[pos] <= counts_length[pos])
+		if (++numbers[pos] <= counts_length[pos]) {
+			from = pos;
 			goto update_ending;
+		}
 		numbers[pos] = 0;
 	}
 
@@ -765,6 +992,15 @@ void do_incremental_crack(struct db_main *db, char *mode)
 
 	memcpy(numbers, rec_numbers, sizeof(numbers));
 
+#ifdef _OPENMP
+	inc_par_keys = omp_get_max_threads() > 1 &&
+		cfg_get_bool(SECTION_OPTIONS, NULL,
+		             "IncrementalParallelKeys", 1);
+	if (inc_par_keys)
+		log_event("- Generating incremental keys on %d threads",
+		          omp_get_max_threads());
+#endif
+
 	crk_init(db, fix_state, NULL);
 
 	last_count = last_length = -1;
@@ -875,6 +1111,10 @@ void do_incremental_crack(struct db_main *db, char *mode)
 	crk_done();
 	rec_done(event_abort);
 
+#ifdef _OPENMP
+	MEM_FREE(inc_par_from);
+	MEM_FREE(inc_par_buf);
+#endif
 	for (pos = 0; pos < max_length - 2; pos++)
 		MEM_FREE(chars[pos]);
 	MEM_FREE(char2);
@@ -89,6 +89,7 @@ static int john_omp_threads_new;
 #include "logger.h"
 #include "status.h"
 #include "recovery.h"
+#include "cracker.h"
 #include "options.h"
 #include "config.h"
 #include "bench.h"
@@ -615,6 +616,8 @@ static void john_fork(void)
 	pids = mem_alloc_tiny((options.fork - 1) * sizeof(*pids),
 	    sizeof(*pids));
 
+	crk_share_init(&database);
+
 	for (i = 1; i < options.fork; i++) {
 		switch ((pid = fork())) {
 		case -1:
@@ -14,16 +14,29 @@
 // needs to be above sys/stat.h for mingw, if -std=c99 used.
 #include "jumbo.h"
 #include <sys/stat.h>
+#define NEED_OS_FORK
+#define NEED_OS_FLOCK
 #include "os.h"
 #if (!AC_BUILT || HAVE_UNISTD_H) && !_MSC_VER
 #include <unistd.h>
 #endif
+#if OS_FORK
+#include <sys/wait.h>
+#endif
+#if OS_FLOCK || FCNTL_LOCKS
+#include <sys/file.h>
+#include <fcntl.h>
+#endif
 #ifdef _MSC_VER
 #define S_ISDIR(a) ((a) & _S_IFDIR)
 #endif
 #include <errno.h>
+#include <stddef.h>
 #include <string.h>
 #include <ctype.h>
+#if defined(HAVE_MMAP)
+#include <sys/mman.h>
+#endif
 
 #include "arch.h"
 #include "misc.h"
@@ -171,16 +184,128 @@ int ldr_isa_pot_source(const char *ciphertext) {
 	return (strstr(ciphertext, "$SOURCE_HASH$") != NULL);
 }
 
+#if OS_FORK
+/*
+ * Records passed from loader child processes to the parent, see
+ * ldr_load_pw_file_par().  Each is followed by the binary ciphertext for
+ * LDR_REC_HASH, then by size bytes of NUL-terminated strings.
+ */
+#define LDR_REC_HASH			1
+#define LDR_REC_WARN_ENC		2
+#define LDR_REC_WARN_ALT		3
+
+struct ldr_rec {
+	int type, index, count, nouser;
+	unsigned int size;
+};
+
+/* Where a loader child process writes its records, or NULL if not one */
+static FILE *ldr_rec_out;
+
+static void ldr_put_rec(int type, int index, int count, int nouser,
+	void *binary, int binary_size, char *s1, char *s2, char *s3)
+{
+	struct ldr_rec rec;
+	size_t len1 = strlen(s1) + 1, len2 = strlen(s2) + 1;
+	size_t len3 = strlen(s3) + 1;
+
+	rec.type = type;
+	rec.index = index;
+	rec.count = count;
+	rec.nouser = nouser;
+	rec.size = len1 + len2 + len3;
+
+	fwrite(&rec, sizeof(rec), 1, ldr_rec_out);
+	if (binary_size)
+		fwrite(binary, binary_size, 1, ldr_rec_out);
+	fwrite(s1, len1, 1, ldr_rec_out);
+	fwrite(s2, len2, 1, ldr_rec_out);
+	fwrite(s3, len3, 1, ldr_rec_out);
+}
+#endif
+
+static const char *ldr_enc_warning[] = {
+	NULL, "Warning: invalid UTF-8 seen reading %s\n",
+	"Warning: UTF-8 seen reading %s\n"
+};
+
+static void ldr_warn_enc(char *name, int enc)
+{
+#if OS_FORK
+	if (ldr_rec_out) {
+		ldr_put_rec(LDR_REC_WARN_ENC, enc, 0, 0, NULL, 0, "", "", "");
+		return;
+	}
+#endif
+	fprintf(stderr, ldr_enc_warning[enc], name);
+}
+
+static int ldr_want_warn_enc(void)
+{
+	return john_main_process && (options.target_enc != ASCII) &&
+		cfg_get_bool(SECTION_OPTIONS, NULL, "WarnEncoding", 0);
+}
+
+/*
+ * Checks a line for encoding problems.  Returns the ldr_enc_warning[] index
+ * for any problem seen, or 0 if none.
+ */
+static int ldr_check_enc(char *line, char *line_buf, int flags)
+{
+	char *u8check;
+
+	if (!(flags & RF_ALLOW_MISSING) ||
+	    !(u8check = strchr(line, options.loader.field_sep_char)))
+		u8check = line;
+
+	if (((flags & RF_ALLOW_MISSING) && options.store_utf8) ||
+	    ((flags & RF_ALLOW_DIR) && options.input_enc == UTF_8)) {
+		if (!valid_utf8((UTF8*)u8check))
+			return 1;
+	} else if (options.input_enc != UTF_8 &&
+	           (line != line_buf || valid_utf8((UTF8*)u8check) > 1))
+		return 2;
+
+	return 0;
+}
+
+/*
+ * Reads lines up to EOF, or until the line starting at offset end or later
+ * if end is non-negative.
+ */
+static void read_lines(struct db_main *db, FILE *file, char *name,
+	int flags, void (*process_line)(struct db_main *db, char *line),
+	int64_t end, int *warn_enc)
+{
+	char line_buf[LINE_BUFFER_SIZE], *line, *ex_size_line;
+	int enc;
+
+	while ((end < 0 || jtr_ftell64(file) < end) &&
+	       (ex_size_line = fgetll(line_buf, sizeof(line_buf), file))) {
+		line = skip_bom(ex_size_line);
+
+		if (*warn_enc && (enc = ldr_check_enc(line, line_buf, flags))) {
+			*warn_enc = 0;
+			ldr_warn_enc(name, enc);
+		}
+		process_line(db, line);
+		if (ex_size_line != line_buf)
+			MEM_FREE(ex_size_line);
+#if OS_FORK
+		if (!ldr_rec_out)
+#endif
+		check_abort(0);
+	}
+}
+
 static void read_file(struct db_main *db, char *name, int flags,
 	void (*process_line)(struct db_main *db, char *line))
 {
 	struct stat file_stat;
 	FILE *file;
-	char line_buf[LINE_BUFFER_SIZE], *line, *ex_size_line;
 	int warn_enc;
 
-	warn_enc = john_main_process && (options.target_enc != ASCII) &&
-		cfg_get_bool(SECTION_OPTIONS, NULL, "WarnEncoding", 0);
+	warn_enc = ldr_want_warn_enc();
 
 	if (flags & RF_ALLOW_DIR) {
 		if (stat(name, &file_stat)) {
@@ -197,39 +322,8 @@ static void read_file(struct db_main *db, char *name, int flags,
 	}
 
 	dyna_salt_init(db->format);
-	while ((ex_size_line = fgetll(line_buf, sizeof(line_buf), file))) {
-		line = skip_bom(ex_size_line);
+	read_lines(db, file, name, flags, process_line, -1, &warn_enc);
 
-		if (warn_enc) {
-			char *u8check;
-
-			if (!(flags & RF_ALLOW_MISSING) ||
-			    !(u8check =
-			      strchr(line, options.loader.field_sep_char)))
-				u8check = line;
-
-			if (((flags & RF_ALLOW_MISSING) &&
-			     options.store_utf8) ||
-			    ((flags & RF_ALLOW_DIR) &&
-			     options.input_enc == UTF_8)) {
-				if (!valid_utf8((UTF8*)u8check)) {
-					warn_enc = 0;
-					fprintf(stderr, "Warning: invalid UTF-8"
-					        " seen reading %s\n", name);
-				}
-			} else if (options.input_enc != UTF_8 &&
-			           (line != line_buf ||
-			            valid_utf8((UTF8*)u8check) > 1)) {
-				warn_enc = 0;
-				fprintf(stderr, "Warning: UTF-8 seen reading "
-				        "%s\n", name);
-			}
-		}
-		process_line(db, line);
-		if (ex_size_line != line_buf)
-			MEM_FREE(ex_size_line);
-		check_abort(0);
-	}
 	if (name == options.activepot)
 		crk_pot_pos = jtr_ftell64(file);
 
@@ -320,6 +414,19 @@ static void ldr_init_password_hash(struct db_main *db)
 	memset(db->password_hash, 0, size);
 }
 
+static int skip_dupe_checking = 0;
+
+static void ldr_init_dupe_check(struct db_main *db)
+{
+	ldr_init_password_hash(db);
+	if (cfg_get_bool(SECTION_OPTIONS, NULL, "NoLoaderDupeCheck", 0)) {
+		skip_dupe_checking = 1;
+		if (john_main_process)
+			fprintf(stderr, "No dupe-checking performed "
+			        "when loading hashes.\n");
+	}
+}
+
 static char *ldr_get_field(char **ptr, char field_sep_char)
 {
 	static char *last;
@@ -434,12 +541,200 @@ static void ldr_set_encoding(struct fmt_main *format)
 	initUnicode(UNICODE_UNICODE);
 }
 
+static void ldr_warn_alt(struct fmt_main *format, struct fmt_main *alt)
+{
+	alt->params.flags |= FMT_WARNED;
+	if (john_main_process)
+	fprintf(stderr,
+	    "Warning: only loading hashes of type "
+	    "\"%s\", but also saw type \"%s\"\n"
+	    "Use the \"--format=%s\" option to force "
+	    "loading hashes of that type instead\n",
+	    format->params.label,
+	    alt->params.label,
+	    alt->params.label);
+}
+
+/*
+ * Format auto-detection index.  A format whose test vectors all start with the
+ * same "$tag$" is assumed to reject ciphertexts with any other tag, so when
+ * detecting the format of a tagged ciphertext only the formats with that tag
+ * or no tag at all need to have their valid() called.  Candidate lists are
+ * built on first use of each tag, keeping the fmt_list order.  Formats with
+ * their own prepare() are always included, and are checked for the tag of
+ * what that returned instead.
+ */
+#define LDR_TAG_LEN_MAX			32
+#define LDR_TAG_HASH_SIZE		0x100
+#define LDR_TAG_CACHE_MAX		0x400
+
+struct ldr_fmt_cand {
+/* NULL terminates a list */
+	struct fmt_main *format;
+/* Tag to check prepared ciphertexts for, or NULL if no check is needed */
+	char *tag;
+};
+
+struct ldr_tag_entry {
+	struct ldr_tag_entry *next;
+	char *tag;
+	struct ldr_fmt_cand *list;
+};
+
+static struct fmt_main *ldr_fmt_head;
+static struct ldr_fmt_cand *ldr_fmt_all;
+static char **ldr_fmt_tags;
+static struct ldr_tag_entry *ldr_tag_hash[LDR_TAG_HASH_SIZE];
+static int ldr_tag_count;
+
+/* Returns the length of the "$tag$" at the start of a ciphertext, or 0 */
+static int ldr_tag_len(const char *ciphertext)
+{
+	int len;
+
+	if (!ciphertext || *ciphertext != '$')
+		return 0;
+
+	for (len = 1; len <= LDR_TAG_LEN_MAX + 1; len++) {
+		if (!ciphertext[len])
+			return 0;
+		if (ciphertext[len] == '$')
+			return len > 1 ? len + 1 : 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns non-zero if a format with the given tag may accept the ciphertext.
+ * Thin formats linked to dynamic also accept their "$dynamic_N$" form.
+ */
+static int ldr_tag_match(struct fmt_main *format, const char *tag,
+	const char *ciphertext)
+{
+	int len = ldr_tag_len(ciphertext);
+
+	return !tag || !len ||
+		(len == (int)strlen(tag) &&
+		 !strncasecmp(ciphertext, tag, len)) ||
+		(!(format->params.flags & FMT_DYNAMIC) &&
+		 !strncmp(ciphertext, "$dynamic_", 9));
+}
+
+static char *ldr_format_tag(struct fmt_main *format)
+{
+	struct fmt_tests *test;
+	char *tag = NULL;
+	int len = 0;
+
+	if (!(test = format->params.tests) || !test->ciphertext)
+		return NULL;
+
+	for (; test->ciphertext; test++) {
+		if (!tag) {
+			if (!(len = ldr_tag_len(tag = test->ciphertext)))
+				return NULL;
+		} else
+		if (ldr_tag_len(test->ciphertext) != len ||
+		    strncasecmp(test->ciphertext, tag, len))
+			return NULL;
+	}
+
+	tag = str_alloc_copy(tag);
+	tag[len] = 0;
+	return tag;
+}
+
+static void ldr_init_fmt_index(void)
+{
+	struct fmt_main *format;
+	int count, i;
+
+	for (count = 0, format = fmt_list; format; format = format->next)
+		count++;
+
+	memset(ldr_tag_hash, 0, sizeof(ldr_tag_hash));
+	ldr_tag_count = 0;
+	ldr_fmt_head = fmt_list;
+	ldr_fmt_all = mem_alloc_tiny((count + 1) * sizeof(*ldr_fmt_all),
+	                             MEM_ALIGN_WORD);
+	ldr_fmt_tags = mem_alloc_tiny((count + 1) * sizeof(*ldr_fmt_tags),
+	                              MEM_ALIGN_WORD);
+
+	for (i = 0, format = fmt_list; format; format = format->next, i++) {
+		ldr_fmt_tags[i] = ldr_format_tag(format);
+		ldr_fmt_all[i].format = format;
+		ldr_fmt_all[i].tag =
+			format->methods.prepare != fmt_default_prepare ?
+			ldr_fmt_tags[i] : NULL;
+	}
+	ldr_fmt_all[i].format = NULL;
+}
+
+/*
+ * Returns the list of formats to try valid() of for a ciphertext.
+ */
+static struct ldr_fmt_cand *ldr_fmt_candidates(char *ciphertext)
+{
+	static struct ldr_fmt_cand single[2];
+	struct ldr_tag_entry *entry;
+	struct ldr_fmt_cand *list;
+	unsigned int hash;
+	int len, count, i;
+
+/* Nothing to gain with one format, such as while loading a test db */
+	if (fmt_list && !fmt_list->next) {
+		single[0].format = fmt_list;
+		single[0].tag = NULL;
+		return single;
+	}
+
+	if (!ldr_fmt_all || ldr_fmt_head != fmt_list)
+		ldr_init_fmt_index();
+
+	if (!(len = ldr_tag_len(ciphertext)))
+		return ldr_fmt_all;
+
+	for (hash = 0, i = 0; i < len; i++)
+		hash = hash * 31 + (unsigned char)tolower(ARCH_INDEX(ciphertext[i]));
+	hash &= LDR_TAG_HASH_SIZE - 1;
+
+	for (entry = ldr_tag_hash[hash]; entry; entry = entry->next)
+	if ((int)strlen(entry->tag) == len &&
+	    !strncasecmp(entry->tag, ciphertext, len))
+		return entry->list;
+
+	if (ldr_tag_count >= LDR_TAG_CACHE_MAX)
+		return ldr_fmt_all;
+
+	for (count = 0; ldr_fmt_all[count].format; count++);
+	list = mem_alloc_tiny((count + 1) * sizeof(*list), MEM_ALIGN_WORD);
+
+	for (count = 0, i = 0; ldr_fmt_all[i].format; i++)
+	if (ldr_fmt_all[i].tag ||
+	    ldr_tag_match(ldr_fmt_all[i].format, ldr_fmt_tags[i], ciphertext))
+		list[count++] = ldr_fmt_all[i];
+	list[count].format = NULL;
+
+	entry = mem_alloc_tiny(sizeof(*entry), MEM_ALIGN_WORD);
+	entry->tag = mem_alloc_tiny(len + 1, MEM_ALIGN_NONE);
+	memcpy(entry->tag, ciphertext, len);
+	entry->tag[len] = 0;
+	entry->list = list;
+	entry->next = ldr_tag_hash[hash];
+	ldr_tag_hash[hash] = entry;
+	ldr_tag_count++;
+
+	return list;
+}
+
 static int ldr_split_line(char **login, char **ciphertext,
 	char **gecos, char **home, char **uid,
 	char *source, struct fmt_main **format,
 	struct db_options *db_opts, char *line)
 {
 	struct fmt_main *alt;
+	struct ldr_fmt_cand *cand;
 	char *fields[10], *gid, *shell;
 	int i, retval;
 
@@ -734,8 +1029,8 @@ find_format:
 
 		ldr_set_encoding(*format);
 
-		alt = fmt_list;
-		do {
+		for (cand = ldr_fmt_candidates(*ciphertext);
+		     (alt = cand->format); cand++) {
 			if (alt == *format)
 				continue;
 			if (alt->params.flags & FMT_WARNED)
@@ -756,27 +1051,20 @@ find_format:
 #endif
 #endif
 			prepared = alt->methods.prepare(fields, alt);
+			if (!ldr_tag_match(alt, cand->tag, prepared))
+				continue;
 			if (alt->methods.valid(prepared, alt)) {
-				alt->params.flags |= FMT_WARNED;
-				if (john_main_process)
-				fprintf(stderr,
-				    "Warning: only loading hashes of type "
-				    "\"%s\", but also saw type \"%s\"\n"
-				    "Use the \"--format=%s\" option to force "
-				    "loading hashes of that type instead\n",
-				    (*format)->params.label,
-				    alt->params.label,
-				    alt->params.label);
+				ldr_warn_alt(*format, alt);
 				break;
 			}
-		} while ((alt = alt->next));
+		}
 
 		return 0;
 	}
 
 	retval = -1;
-	if ((alt = fmt_list))
-	do {
+	for (cand = ldr_fmt_candidates(*ciphertext);
+	     (alt = cand->format); cand++) {
 		char *prepared;
 		int valid;
 
@@ -806,6 +1094,8 @@ find_format:
 		prepared = alt->methods.prepare(fields, alt);
 		if (!prepared)
 			continue;
+		if (!ldr_tag_match(alt, cand->tag, prepared))
+			continue;
 		valid = alt->methods.valid(prepared, alt);
 		if (!valid)
 			continue;
@@ -837,7 +1127,7 @@ find_format:
 		    (*format)->params.label, alt->params.label,
 		    alt->params.label);
 #endif
-	} while ((alt = alt->next));
+	}
 
 	return retval;
 }
@@ -893,24 +1183,193 @@ static struct list_main *ldr_init_words(char *login, char *gecos, char *home)
 	return words;
 }
 
+/*
+ * Adds one piece (as returned by split()) of a password file line to the
+ * database.  The "single crack" mode words for the line are built on first
+ * use and passed back in *words for the line's further pieces.
+ */
+static void ldr_load_pw_piece(struct db_main *db, char *piece, void *binary,
+	char *login, char *uid, char *gecos, char *home,
+	int index, int count, struct list_main **words)
+{
+	struct fmt_main *format = db->format;
+	void *salt;
+	int salt_hash, pw_hash;
+	struct db_salt *current_salt, *last_salt;
+	struct db_password *current_pw, *last_pw;
+	size_t pw_size;
+	int i;
+
+	pw_hash = db->password_hash_func(binary);
+
+	if (options.flags & FLG_REJECT_PRINTABLE) {
+		int i = 0;
+
+		while (isprint((int)((unsigned char*)binary)[i]) &&
+		       i < format->params.binary_size)
+			i++;
+
+		if (i == format->params.binary_size) {
+			if (john_main_process)
+			fprintf(stderr, "rejecting printable binary"
+			        " \"%.*s\" (%s)\n",
+			        format->params.binary_size,
+			        (char*)binary, piece);
+			return;
+		}
+	}
+
+	if (!(db->options->flags & DB_WORDS) && !skip_dupe_checking) {
+		int collisions = 0;
+		if ((current_pw = db->password_hash[pw_hash]))
+		do {
+			if (!memcmp(binary, current_pw->binary,
+			    format->params.binary_size) &&
+			    !strcmp(piece, format->methods.source(
+			    current_pw->source, current_pw->binary))) {
+				db->options->flags |= DB_NODUP;
+				break;
+			}
+			if (++collisions <= LDR_HASH_COLLISIONS_MAX)
+				continue;
+
+			if (john_main_process) {
+				if (format->params.binary_size)
+				fprintf(stderr, "Warning: "
+				    "excessive partial hash "
+				    "collisions detected\n%s",
+				    db->password_hash_func !=
+				    fmt_default_binary_hash ? "" :
+				    "(cause: the \"format\" lacks "
+				    "proper binary_hash() function "
+				    "definitions)\n");
+				else
+				fprintf(stderr, "Warning: "
+				    "check for duplicates partially "
+				    "bypassed to speedup loading\n");
+			}
+			skip_dupe_checking = 1;
+			current_pw = NULL; /* no match */
+			break;
+		} while ((current_pw = current_pw->next_hash));
+
+		if (current_pw) return;
+	}
+
+	salt = format->methods.salt(piece);
+	dyna_salt_create(salt);
+	salt_hash = format->methods.salt_hash(salt);
+
+	if ((current_salt = db->salt_hash[salt_hash])) {
+		do {
+			if (!dyna_salt_cmp(current_salt->salt, salt, format->params.salt_size))
+				break;
+		}  while ((current_salt = current_salt->next));
+	}
+
+	if (!current_salt) {
+		last_salt = db->salt_hash[salt_hash];
+		current_salt = db->salt_hash[salt_hash] =
+			mem_alloc_tiny(db->salt_size, MEM_ALIGN_WORD);
+		current_salt->next = last_salt;
+
+		current_salt->salt = mem_alloc_copy(salt,
+			format->params.salt_size,
+			format->params.salt_align);
+
+		for (i = 0; i < FMT_TUNABLE_COSTS && format->methods.tunable_cost_value[i] != NULL; ++i)
+			current_salt->cost[i] = format->methods.tunable_cost_value[i](current_salt->salt);
+
+		current_salt->index = fmt_dummy_hash;
+		current_salt->bitmap = NULL;
+		current_salt->list = NULL;
+		current_salt->hash = &current_salt->list;
+		current_salt->hash_size = -1;
+
+		current_salt->count = 0;
+
+		if (db->options->flags & DB_WORDS)
+			current_salt->keys = NULL;
+
+		db->salt_count++;
+	} else
+		dyna_salt_remove(salt);
+
+	current_salt->count++;
+	db->password_count++;
+
+/* If we're not allocating memory for the "login" field, we may as well not
+ * allocate it for the "source" field if the format doesn't need it. */
+	pw_size = db->pw_size;
+	if (!(db->options->flags & DB_LOGIN) &&
+	    format->methods.source != fmt_default_source)
+		pw_size -= sizeof(char *);
+
+	last_pw = current_salt->list;
+	current_pw = current_salt->list = mem_alloc_tiny(
+		pw_size, MEM_ALIGN_WORD);
+	current_pw->next = last_pw;
+
+	last_pw = db->password_hash[pw_hash];
+	db->password_hash[pw_hash] = current_pw;
+	current_pw->next_hash = last_pw;
+
+/* If we're not going to use the source field for its usual purpose yet we had
+ * to allocate memory for it (because we need at least one field after it), see
+ * if we can pack the binary value in it. */
+	if ((db->options->flags & DB_LOGIN) &&
+	    format->methods.source != fmt_default_source &&
+	    sizeof(current_pw->source) >= format->params.binary_size)
+		current_pw->binary = memcpy(&current_pw->source,
+			binary, format->params.binary_size);
+	else
+		current_pw->binary = mem_alloc_copy(binary,
+			format->params.binary_size,
+			format->params.binary_align);
+
+	if (format->methods.source == fmt_default_source)
+		current_pw->source = str_alloc_copy(piece);
+
+	if (db->options->flags & DB_WORDS) {
+		if (!*words)
+			*words = ldr_init_words(login, gecos, home);
+		current_pw->words = *words;
+	}
+
+	if (db->options->flags & DB_LOGIN) {
+		if (login != no_username)
+			login = ldr_conv(login);
+
+		if (options.show_uid_in_cracks)
+			current_pw->uid = str_alloc_copy(uid);
+
+		if (count >= 2 && count <= 9) {
+			current_pw->login = mem_alloc_tiny(
+				strlen(login) + 3, MEM_ALIGN_NONE);
+			sprintf(current_pw->login, "%s:%d",
+				login, index + 1);
+		} else
+		if (login == no_username)
+			current_pw->login = login;
+		else
+		if (*words && *login)
+			current_pw->login = (*words)->head->data;
+		else
+			current_pw->login = str_alloc_copy(login);
+	}
+}
+
 #ifdef HAVE_FUZZ
 void ldr_load_pw_line(struct db_main *db, char *line)
 #else
 static void ldr_load_pw_line(struct db_main *db, char *line)
 #endif
 {
-	static int skip_dupe_checking = 0;
 	struct fmt_main *format;
 	int index, count;
 	char *login, *ciphertext, *gecos, *home, *uid;
 	char *piece;
-	void *binary, *salt;
-	int salt_hash, pw_hash;
-	struct db_salt *current_salt, *last_salt;
-	struct db_password *current_pw, *last_pw;
 	struct list_main *words;
-	size_t pw_size;
-	int i;
 
 #ifdef HAVE_FUZZ
 	char *line_sb;
@@ -932,189 +1391,691 @@ static void ldr_load_pw_line(struct db_main *db, char *line)
 
 	words = NULL;
 
-	if (!db->password_hash) {
-		ldr_init_password_hash(db);
-		if (cfg_get_bool(SECTION_OPTIONS, NULL,
-		                 "NoLoaderDupeCheck", 0)) {
-			skip_dupe_checking = 1;
-			if (john_main_process)
-				fprintf(stderr, "No dupe-checking performed "
-				        "when loading hashes.\n");
-		}
+	if (!db->password_hash)
+		ldr_init_dupe_check(db);
+
+	for (index = 0; index < count; index++) {
+		piece = format->methods.split(ciphertext, index, format);
+		ldr_load_pw_piece(db, piece, format->methods.binary(piece),
+			login, uid, gecos, home, index, count, &words);
 	}
+}
+
+#if OS_FORK
+/*
+ * Multi-process loading of a password file.  The format methods aren't
+ * thread-safe (most return static buffers), so we use child processes: once
+ * the format is known, the rest of the file is cut into chunks on line
+ * boundaries and each child runs prepare(), valid(), split() and binary()
+ * over its chunk, writing the results to a temporary file.  The parent then
+ * merges the chunks in file order, so the database ends up the same as when
+ * loading serially.
+ */
+#define LDR_PAR_MIN_CHUNK		0x400000
+
+static void ldr_par_line(struct db_main *db, char *line)
+{
+	struct fmt_main *format = db->format;
+	char *login, *ciphertext, *gecos, *home, *uid;
+	char *piece;
+	int index, count;
+
+	count = ldr_split_line(&login, &ciphertext, &gecos, &home, &uid,
+		NULL, &db->format, db->options, line);
 
 	for (index = 0; index < count; index++) {
 		piece = format->methods.split(ciphertext, index, format);
+		ldr_put_rec(LDR_REC_HASH, index, count, login == no_username,
+			format->methods.binary(piece),
+			format->params.binary_size, piece, login, uid);
+	}
+}
 
-		binary = format->methods.binary(piece);
-		pw_hash = db->password_hash_func(binary);
+static void ldr_par_child(struct db_main *db, char *name,
+	int64_t start, int64_t end, int warn_enc)
+{
+	char line_buf[LINE_BUFFER_SIZE], *line, *warned;
+	struct fmt_main *alt;
+	FILE *file;
+	int i;
 
-		if (options.flags & FLG_REJECT_PRINTABLE) {
-			int i = 0;
+/* The parent prints any warnings after merging our records */
+	john_main_process = 0;
 
-			while (isprint((int)((unsigned char*)binary)[i]) &&
-			       i < format->params.binary_size)
-				i++;
+	if (!(file = fopen(path_expand(name), "r")) ||
+	    jtr_fseek64(file, start ? start - 1 : 0, SEEK_SET))
+		_exit(1);
 
-			if (i == format->params.binary_size) {
-				if (john_main_process)
-				fprintf(stderr, "rejecting printable binary"
-				        " \"%.*s\" (%s)\n",
-				        format->params.binary_size,
-				        (char*)binary, piece);
-				continue;
-			}
+/* Skip the partial line, if any; it belongs to the previous chunk */
+	if (start && getc(file) != '\n' &&
+	    (line = fgetll(line_buf, sizeof(line_buf), file)) &&
+	    line != line_buf)
+		MEM_FREE(line);
+
+	for (i = 0, alt = fmt_list; alt; alt = alt->next)
+		i++;
+	warned = mem_alloc(i + 1);
+	for (i = 0, alt = fmt_list; alt; alt = alt->next)
+		warned[i++] = !!(alt->params.flags & FMT_WARNED);
+
+	read_lines(db, file, name, RF_ALLOW_DIR, ldr_par_line, end, &warn_enc);
+
+	for (i = 0, alt = fmt_list; alt; alt = alt->next, i++)
+	if (!warned[i] && (alt->params.flags & FMT_WARNED))
+		ldr_put_rec(LDR_REC_WARN_ALT, 0, 0, 0, NULL, 0,
+			alt->params.label, "", "");
+
+	if (ferror(file) || fflush(ldr_rec_out) || ferror(ldr_rec_out))
+		_exit(1);
+	_exit(0);
+}
+
+static void ldr_par_merge(struct db_main *db, FILE *file, char *name,
+	int *warn_enc)
+{
+	struct fmt_main *format = db->format, *alt;
+	struct list_main *words = NULL;
+	struct ldr_rec rec;
+	char *buf, *login, *uid;
+	size_t buf_size;
+	void *binary;
+	int binary_size = format->params.binary_size;
+
+	binary = mem_alloc_align(binary_size + 1, MEM_ALIGN_CACHE);
+	buf = NULL;
+	buf_size = 0;
+
+	rewind(file);
+	while (fread(&rec, sizeof(rec), 1, file) == 1) {
+		if (rec.type == LDR_REC_HASH && binary_size &&
+		    fread(binary, binary_size, 1, file) != 1)
+			break;
+		if (rec.size > buf_size) {
+			MEM_FREE(buf);
+			buf = mem_alloc(buf_size = rec.size);
 		}
+		if (fread(buf, rec.size, 1, file) != 1)
+			break;
 
-		if (!(db->options->flags & DB_WORDS) && !skip_dupe_checking) {
-			int collisions = 0;
-			if ((current_pw = db->password_hash[pw_hash]))
-			do {
-				if (!memcmp(binary, current_pw->binary,
-				    format->params.binary_size) &&
-				    !strcmp(piece, format->methods.source(
-				    current_pw->source, current_pw->binary))) {
-					db->options->flags |= DB_NODUP;
-					break;
-				}
-				if (++collisions <= LDR_HASH_COLLISIONS_MAX)
-					continue;
-
-				if (john_main_process) {
-					if (format->params.binary_size)
-					fprintf(stderr, "Warning: "
-					    "excessive partial hash "
-					    "collisions detected\n%s",
-					    db->password_hash_func !=
-					    fmt_default_binary_hash ? "" :
-					    "(cause: the \"format\" lacks "
-					    "proper binary_hash() function "
-					    "definitions)\n");
-					else
-					fprintf(stderr, "Warning: "
-					    "check for duplicates partially "
-					    "bypassed to speedup loading\n");
-				}
-				skip_dupe_checking = 1;
-				current_pw = NULL; /* no match */
-				break;
-			} while ((current_pw = current_pw->next_hash));
+		switch (rec.type) {
+		case LDR_REC_HASH:
+			login = buf + strlen(buf) + 1;
+			uid = login + strlen(login) + 1;
+			if (rec.count >= 2)
+				db->options->flags |= DB_SPLIT;
+			ldr_load_pw_piece(db, buf, binary,
+				rec.nouser ? no_username : login, uid, "", "",
+				rec.index, rec.count, &words);
+			break;
+
+		case LDR_REC_WARN_ENC:
+			if (*warn_enc) {
+				*warn_enc = 0;
+				ldr_warn_enc(name, rec.index);
+			}
+			break;
 
-			if (current_pw) continue;
+		case LDR_REC_WARN_ALT:
+			for (alt = fmt_list; alt; alt = alt->next)
+			if (!strcmp(alt->params.label, buf) &&
+			    !(alt->params.flags & FMT_WARNED))
+				ldr_warn_alt(format, alt);
+			break;
 		}
+	}
 
-		salt = format->methods.salt(piece);
-		dyna_salt_create(salt);
-		salt_hash = format->methods.salt_hash(salt);
+	if (ferror(file) || !feof(file))
+		error_msg("Error reading loader child output\n");
 
-		if ((current_salt = db->salt_hash[salt_hash])) {
-			do {
-				if (!dyna_salt_cmp(current_salt->salt, salt, format->params.salt_size))
-					break;
-			}  while ((current_salt = current_salt->next));
+	MEM_FREE(buf);
+	MEM_FREE(binary);
+}
+
+/*
+ * Returns zero if the file isn't to be loaded this way.
+ */
+static int ldr_load_pw_file_par(struct db_main *db, char *name)
+{
+	struct stat file_stat;
+	FILE *file, **out;
+	pid_t *pids;
+	int64_t start, size;
+	int procs, i, status, failed, warn_enc;
+
+	if ((procs = cfg_get_int(SECTION_OPTIONS, NULL,
+	    "LoaderProcesses")) < 2 ||
+	    (db->options->flags & DB_WORDS) ||
+	    db->options->showtypes || db->options->showinvalid ||
+	    stat(path_expand(name), &file_stat) ||
+	    !S_ISREG(file_stat.st_mode) ||
+	    file_stat.st_size < 2 * LDR_PAR_MIN_CHUNK)
+		return 0;
+
+	if (!(file = fopen(path_expand(name), "r")))
+		pexit("fopen: %s", path_expand(name));
+
+	warn_enc = ldr_want_warn_enc();
+
+/* Load serially until the format is known */
+	dyna_salt_init(db->format);
+	while (!db->format && !feof(file) && !ferror(file))
+		read_lines(db, file, name, RF_ALLOW_DIR, ldr_load_pw_line,
+			jtr_ftell64(file) + 1, &warn_enc);
+
+	start = jtr_ftell64(file);
+	size = file_stat.st_size;
+	if (procs > (size - start) / LDR_PAR_MIN_CHUNK)
+		procs = (size - start) / LDR_PAR_MIN_CHUNK;
+
+	if (procs < 2 || ferror(file)) {
+		read_lines(db, file, name, RF_ALLOW_DIR, ldr_load_pw_line, -1,
+			&warn_enc);
+	} else {
+		dyna_salt_init(db->format);
+		if (!db->password_hash)
+			ldr_init_dupe_check(db);
+
+		out = mem_alloc(procs * sizeof(*out));
+		pids = mem_alloc(procs * sizeof(*pids));
+
+		fflush(stdout);
+		fflush(stderr);
+		for (i = 0; i < procs; i++) {
+			if (!(out[i] = tmpfile()))
+				pexit("tmpfile");
+			switch ((pids[i] = fork())) {
+			case -1:
+				pexit("fork");
+
+			case 0:
+				ldr_rec_out = out[i];
+				ldr_par_child(db, name,
+					start + (size - start) * i / procs,
+					i == procs - 1 ? -1 :
+					start + (size - start) * (i + 1) / procs,
+					warn_enc);
+			}
 		}
 
-		if (!current_salt) {
-			last_salt = db->salt_hash[salt_hash];
-			current_salt = db->salt_hash[salt_hash] =
-				mem_alloc_tiny(db->salt_size, MEM_ALIGN_WORD);
-			current_salt->next = last_salt;
+		failed = 0;
+		for (i = 0; i < procs; i++)
+		if (waitpid(pids[i], &status, 0) < 0 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status))
+			failed = 1;
+		if (failed)
+			error_msg("Loader child process failed\n");
+
+		for (i = 0; i < procs; i++) {
+			ldr_par_merge(db, out[i], name, &warn_enc);
+			fclose(out[i]);
+		}
 
-			current_salt->salt = mem_alloc_copy(salt,
-				format->params.salt_size,
-				format->params.salt_align);
+		MEM_FREE(pids);
+		MEM_FREE(out);
+		check_abort(0);
+	}
 
-			for (i = 0; i < FMT_TUNABLE_COSTS && format->methods.tunable_cost_value[i] != NULL; ++i)
-				current_salt->cost[i] = format->methods.tunable_cost_value[i](current_salt->salt);
+	if (ferror(file)) pexit("fgets");
 
-			current_salt->index = fmt_dummy_hash;
-			current_salt->bitmap = NULL;
-			current_salt->list = NULL;
-			current_salt->hash = &current_salt->list;
-			current_salt->hash_size = -1;
+	if (fclose(file)) pexit("fclose");
 
-			current_salt->count = 0;
+	return 1;
+}
+#endif
 
-			if (db->options->flags & DB_WORDS)
-				current_salt->keys = NULL;
+/*
+ * Loaded hashes cache.  When LoaderCacheDir is set, the hashes loaded from a
+ * password file are saved there in a flat form (post split() and binary(),
+ * after filtering and dupe removal), and later sessions over the same file
+ * map that read-only and point their db_password entries into it instead of
+ * parsing the file again.  The per-salt bitmaps and hash tables are cheap to
+ * build and are set up by ldr_fix_database() as usual.  Only unsalted formats
+ * are supported since salts may hold pointers.
+ */
+#define LDR_CACHE_MAGIC			"JtRldc02"
+#define LDR_CACHE_SAMPLE		0x100000
+#define LDR_CACHE_ALIGN			64
+
+struct ldr_cache_key {
+	char magic[8];
+	char version[32];
+	uint64_t file_size, file_mtime;
+/* MD5 of the first and last LDR_CACHE_SAMPLE bytes of the file */
+	unsigned char sample[16];
+/* Options affecting what gets loaded */
+	unsigned int login, uid, reject_printable, field_sep_char;
+	int input_enc, target_enc;
+/* The --format requested, if any, since it decides what's detected */
+	char format[64];
+};
+
+struct ldr_cache_header {
+	struct ldr_cache_key key;
+	char label[64];
+	unsigned int binary_size, stride, db_flags, count;
+	uint64_t bin_offset, str_offset, size;
+};
+
+static char *ldr_cache_path(char *name)
+{
+	static char path[PATH_BUFFER_SIZE + 1];
+	unsigned char hash[16];
+	char *dir, *p;
+	MD5_CTX ctx;
+	int i;
 
-			db->salt_count++;
-		} else
-			dyna_salt_remove(salt);
+	if (!(dir = cfg_get_param(SECTION_OPTIONS, NULL, "LoaderCacheDir")) ||
+	    !*dir)
+		return NULL;
 
-		current_salt->count++;
-		db->password_count++;
+	p = path_expand(name);
+	MD5_Init(&ctx);
+	MD5_Update(&ctx, p, strlen(p));
+	MD5_Final(hash, &ctx);
 
-/* If we're not allocating memory for the "login" field, we may as well not
- * allocate it for the "source" field if the format doesn't need it. */
-		pw_size = db->pw_size;
-		if (!(db->options->flags & DB_LOGIN) &&
-		    format->methods.source != fmt_default_source)
-			pw_size -= sizeof(char *);
+	strnzcpy(path, path_expand(dir), sizeof(path) - 40);
+	p = path + strlen(path);
+	*p++ = '/';
+	for (i = 0; i < 16; i++)
+		p += sprintf(p, "%02x", hash[i]);
+	strcpy(p, ".ldc");
 
-		last_pw = current_salt->list;
-		current_pw = current_salt->list = mem_alloc_tiny(
-			pw_size, MEM_ALIGN_WORD);
-		current_pw->next = last_pw;
+	return path;
+}
 
-		last_pw = db->password_hash[pw_hash];
-		db->password_hash[pw_hash] = current_pw;
-		current_pw->next_hash = last_pw;
+static int ldr_cache_usable(struct db_main *db, struct fmt_main *format)
+{
+	struct db_options *o = db->options;
 
-/* If we're not going to use the source field for its usual purpose yet we had
- * to allocate memory for it (because we need at least one field after it), see
- * if we can pack the binary value in it. */
-		if ((db->options->flags & DB_LOGIN) &&
-		    format->methods.source != fmt_default_source &&
-		    sizeof(current_pw->source) >= format->params.binary_size)
-			current_pw->binary = memcpy(&current_pw->source,
-				binary, format->params.binary_size);
+	if ((o->flags & DB_WORDS) || o->users->head || o->groups->head ||
+	    o->shells->head || o->showtypes || o->showinvalid ||
+	    options.regen_lost_salts)
+		return 0;
+
+	if (format && (format->params.salt_size ||
+	    !format->params.binary_size ||
+	    (format->params.flags & (FMT_DYNAMIC | FMT_DYNA_SALT))))
+		return 0;
+
+	return 1;
+}
+
+/*
+ * Computes the cache key for a password file, before anything is loaded from
+ * it (loading may change options.target_enc).  Returns zero if the file isn't
+ * to be cached.
+ */
+static int ldr_cache_key(struct db_main *db, struct ldr_cache_key *key,
+	char *name)
+{
+	struct stat file_stat;
+	FILE *file;
+	char *buf;
+	size_t count;
+	MD5_CTX ctx;
+
+	if (!ldr_cache_usable(db, db->format) || !ldr_cache_path(name) ||
+	    stat(path_expand(name), &file_stat) ||
+	    !S_ISREG(file_stat.st_mode))
+		return 0;
+	if (!(file = fopen(path_expand(name), "rb")))
+		return 0;
+
+	memset(key, 0, sizeof(*key));
+	memcpy(key->magic, LDR_CACHE_MAGIC, sizeof(key->magic));
+	strncpy(key->version, JOHN_VERSION, sizeof(key->version) - 1);
+	key->file_size = file_stat.st_size;
+	key->file_mtime = file_stat.st_mtime;
+	key->login = !!(db->options->flags & DB_LOGIN);
+	key->uid = options.show_uid_in_cracks;
+	key->reject_printable = !!(options.flags & FLG_REJECT_PRINTABLE);
+	key->field_sep_char = (unsigned char)db->options->field_sep_char;
+	key->input_enc = options.input_enc;
+	key->target_enc = options.target_enc;
+	strncpy(key->format, options.format ? options.format : "none",
+	        sizeof(key->format) - 1);
+
+	buf = mem_alloc(LDR_CACHE_SAMPLE);
+	MD5_Init(&ctx);
+	count = fread(buf, 1, LDR_CACHE_SAMPLE, file);
+	MD5_Update(&ctx, buf, count);
+	if (key->file_size > 2 * LDR_CACHE_SAMPLE &&
+	    jtr_fseek64(file, -LDR_CACHE_SAMPLE, SEEK_END))
+		count = 0;
+	while (count && (count = fread(buf, 1, LDR_CACHE_SAMPLE, file)))
+		MD5_Update(&ctx, buf, count);
+	MD5_Final(key->sample, &ctx);
+	MEM_FREE(buf);
+
+	count = ferror(file);
+	fclose(file);
+
+	return !count;
+}
+
+static int ldr_cache_load(struct db_main *db, char *name,
+	struct ldr_cache_key *key)
+{
+	struct ldr_cache_header header;
+	struct fmt_main *format;
+	struct db_salt *salt;
+	struct db_password *pw;
+	struct stat file_stat;
+	FILE *file;
+	char *path, *map, *ptr, *end, *source, *login, *uid;
+	void *binary;
+	size_t pw_size;
+	int salt_hash, pw_hash, i;
+	unsigned int index;
+	int mapped = 0;
+
+	path = ldr_cache_path(name);
+	if (!(file = fopen(path, "rb")))
+		return 0;
+	if (fstat(fileno(file), &file_stat) ||
+	    fread(&header, sizeof(header), 1, file) != 1 ||
+	    memcmp(&header.key, key, sizeof(*key)) ||
+	    header.size != (uint64_t)file_stat.st_size ||
+	    header.label[sizeof(header.label) - 1] ||
+	    header.str_offset != header.bin_offset +
+	    (uint64_t)header.count * header.stride ||
+	    header.str_offset >= header.size) {
+		fclose(file);
+		return 0;
+	}
+
+	if ((format = db->format)) {
+		if (strcmp(format->params.label, header.label))
+			format = NULL;
+	} else
+	if ((format = fmt_list))
+	do {
+		if (!strcmp(format->params.label, header.label))
+			break;
+	} while ((format = format->next));
+
+	if (!format || !ldr_cache_usable(db, format) ||
+	    format->params.binary_size != header.binary_size) {
+		fclose(file);
+		return 0;
+	}
+
+	map = NULL;
+#ifdef HAVE_MMAP
+#if (SIZEOF_SIZE_T < 8)
+	if (header.size < ((1ULL)<<32))
+#endif
+	{
+		map = mmap(NULL, header.size, PROT_READ, MAP_SHARED,
+		           fileno(file), 0);
+		if (map == MAP_FAILED)
+			map = NULL;
 		else
-			current_pw->binary = mem_alloc_copy(binary,
-				format->params.binary_size,
-				format->params.binary_align);
+			mapped = 1;
+	}
+#endif
+	if (!map) {
+		map = mem_alloc_align(header.size, LDR_CACHE_ALIGN);
+		if (jtr_fseek64(file, 0, SEEK_SET) ||
+		    fread(map, header.size, 1, file) != 1) {
+			MEM_FREE(map);
+			fclose(file);
+			return 0;
+		}
+	}
+	fclose(file);
+
+	ptr = map + header.str_offset;
+	end = map + header.size;
+	if (end[-1]) {
+		fprintf(stderr, "Warning: ignoring corrupted cache %s\n", path);
+#ifdef HAVE_MMAP
+		if (mapped)
+			munmap(map, header.size);
+		else
+#endif
+		MEM_FREE(map);
+		return 0;
+	}
 
-		if (format->methods.source == fmt_default_source)
-			current_pw->source = str_alloc_copy(piece);
+	if (!db->format) {
+		ldr_set_encoding(format);
+#ifdef HAVE_OPENCL
+		if (options.gpu_devices->count && options.fork &&
+		    strstr(format->params.label, "-opencl"))
+			db->format = format;
+		else
+#endif
+		fmt_init(db->format = format);
+	}
+	dyna_salt_init(format);
 
-		if (db->options->flags & DB_WORDS) {
-			if (!words)
-				words = ldr_init_words(login, gecos, home);
-			current_pw->words = words;
+	if (!db->password_hash)
+		ldr_init_dupe_check(db);
+
+	db->options->flags |= header.db_flags & (DB_SPLIT | DB_NODUP);
+
+	pw_size = db->pw_size;
+	if (!(db->options->flags & DB_LOGIN) &&
+	    format->methods.source != fmt_default_source)
+		pw_size -= sizeof(char *);
+
+	salt = NULL;
+	for (index = 0; index < header.count; index++) {
+		binary = map + header.bin_offset +
+			(size_t)index * header.stride;
+		source = login = uid = "";
+		if (ptr < end)
+			ptr += strlen(source = ptr) + 1;
+		if (ptr < end)
+			ptr += strlen(login = ptr) + 1;
+		if (ptr < end)
+			ptr += strlen(uid = ptr) + 1;
+		else
+			ptr++;
+		if (ptr > end) {
+			fprintf(stderr, "Warning: truncated cache %s\n", path);
+			break;
 		}
 
-		if (db->options->flags & DB_LOGIN) {
-			if (login != no_username && index == 0)
-				login = ldr_conv(login);
+		pw_hash = db->password_hash_func(binary);
+
+		if (!skip_dupe_checking) {
+			int collisions = 0;
+
+			for (pw = db->password_hash[pw_hash]; pw;
+			     pw = pw->next_hash) {
+				if (!memcmp(binary, pw->binary,
+				    format->params.binary_size) &&
+				    (format->methods.source !=
+				     fmt_default_source ||
+				     !strcmp(source, pw->source)))
+					break;
+				if (++collisions > LDR_HASH_COLLISIONS_MAX) {
+					pw = NULL;
+					break;
+				}
+			}
+			if (pw) {
+				db->options->flags |= DB_NODUP;
+				continue;
+			}
+		}
+
+		if (!salt) {
+			void *salt_data = format->methods.salt(
+				format->methods.source(source, binary));
+
+			salt_hash = format->methods.salt_hash(salt_data);
+			if (!(salt = db->salt_hash[salt_hash])) {
+				salt = db->salt_hash[salt_hash] =
+					mem_alloc_tiny(db->salt_size,
+					               MEM_ALIGN_WORD);
+				salt->next = NULL;
+				salt->salt = mem_alloc_copy(salt_data,
+					format->params.salt_size,
+					format->params.salt_align);
+				for (i = 0; i < FMT_TUNABLE_COSTS &&
+				     format->methods.tunable_cost_value[i]; ++i)
+					salt->cost[i] = format->methods.
+						tunable_cost_value[i](salt->salt);
+				salt->index = fmt_dummy_hash;
+				salt->bitmap = NULL;
+				salt->list = NULL;
+				salt->hash = &salt->list;
+				salt->hash_size = -1;
+				salt->count = 0;
+				db->salt_count++;
+			}
+		}
+
+		salt->count++;
+		db->password_count++;
 
+		pw = mem_alloc_tiny(pw_size, MEM_ALIGN_WORD);
+		pw->next = salt->list;
+		salt->list = pw;
+		pw->next_hash = db->password_hash[pw_hash];
+		db->password_hash[pw_hash] = pw;
+
+		pw->binary = binary;
+		if (format->methods.source == fmt_default_source)
+			pw->source = source;
+
+		if (db->options->flags & DB_LOGIN) {
+			pw->login = strcmp(login, no_username) ?
+				login : no_username;
 			if (options.show_uid_in_cracks)
-				current_pw->uid = str_alloc_copy(uid);
+				pw->uid = uid;
+		}
+	}
 
-			if (count >= 2 && count <= 9) {
-				current_pw->login = mem_alloc_tiny(
-					strlen(login) + 3, MEM_ALIGN_NONE);
-				sprintf(current_pw->login, "%s:%d",
-					login, index + 1);
-			} else
-			if (login == no_username)
-				current_pw->login = login;
-			else
-			if (words && *login)
-				current_pw->login = words->head->data;
-			else
-				current_pw->login = str_alloc_copy(login);
+	if (john_main_process && options.verbosity > VERB_DEFAULT)
+		fprintf(stderr, "Loaded %u hashes from cache %s\n",
+		        header.count, path);
+
+	return 1;
+}
+
+static void ldr_cache_save(struct db_main *db, char *name,
+	struct ldr_cache_key *key)
+{
+	struct fmt_main *format = db->format;
+	struct ldr_cache_header header;
+	struct db_salt *salt;
+	struct db_password *pw, **list;
+	char *path, tmp_path[PATH_BUFFER_SIZE + 1];
+	char pad[LDR_CACHE_ALIGN];
+	FILE *file;
+	unsigned int count, index;
+	int i, align;
+
+	if (!john_main_process || !format || !db->password_count ||
+	    !ldr_cache_usable(db, format) || !(path = ldr_cache_path(name)))
+		return;
+
+	memset(&header, 0, sizeof(header));
+	header.key = *key;
+
+	salt = NULL;
+	for (i = 0; i < SALT_HASH_SIZE && !salt; i++)
+		salt = db->salt_hash[i];
+	if (!salt || salt->next || db->salt_count != 1)
+		return;
+
+	count = salt->count;
+	list = mem_alloc(count * sizeof(*list));
+	index = count;
+	for (pw = salt->list; pw && index; pw = pw->next)
+		list[--index] = pw;
+
+	strnzcpy(header.label, format->params.label, sizeof(header.label));
+	header.binary_size = format->params.binary_size;
+	align = format->params.binary_align > 1 ?
+		format->params.binary_align : 1;
+	header.stride = (header.binary_size + align - 1) / align * align;
+	header.db_flags = db->options->flags & (DB_SPLIT | DB_NODUP);
+	header.count = count;
+	header.bin_offset = (sizeof(header) + LDR_CACHE_ALIGN - 1) /
+		LDR_CACHE_ALIGN * LDR_CACHE_ALIGN;
+	header.str_offset = header.bin_offset +
+		(uint64_t)count * header.stride;
+	header.size = header.str_offset;
+	for (index = 0; index < count; index++) {
+		pw = list[index];
+		if (format->methods.source == fmt_default_source)
+			header.size += strlen(pw->source);
+		if (db->options->flags & DB_LOGIN) {
+			header.size += strlen(pw->login);
+			if (options.show_uid_in_cracks && pw->uid)
+				header.size += strlen(pw->uid);
 		}
+		header.size += 3;
+	}
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%u", path,
+	         (unsigned int)getpid());
+	if (!(file = fopen(tmp_path, "wb"))) {
+		fprintf(stderr, "Warning: can't create cache %s: %s\n",
+		        tmp_path, strerror(errno));
+		MEM_FREE(list);
+		return;
+	}
+
+	memset(pad, 0, sizeof(pad));
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(pad, header.bin_offset - sizeof(header), 1, file);
+	for (index = 0; index < count; index++) {
+		fwrite(list[index]->binary, header.binary_size, 1, file);
+		if (header.stride > header.binary_size)
+			fwrite(pad, header.stride - header.binary_size, 1,
+			       file);
+	}
+	for (index = 0; index < count; index++) {
+		pw = list[index];
+		if (format->methods.source == fmt_default_source)
+			fputs(pw->source, file);
+		putc(0, file);
+		if (db->options->flags & DB_LOGIN)
+			fputs(pw->login, file);
+		putc(0, file);
+		if ((db->options->flags & DB_LOGIN) &&
+		    options.show_uid_in_cracks && pw->uid)
+			fputs(pw->uid, file);
+		putc(0, file);
+	}
+	MEM_FREE(list);
+
+	if (ferror(file) | fclose(file) || rename(tmp_path, path)) {
+		fprintf(stderr, "Warning: can't write cache %s: %s\n",
+		        path, strerror(errno));
+		unlink(tmp_path);
 	}
 }
 
 void ldr_load_pw_file(struct db_main *db, char *name)
 {
+	struct ldr_cache_key key;
+	int first = !db->password_count;
+	int cache;
+
 	pristine_gecos = cfg_get_bool(SECTION_OPTIONS, NULL,
 	        "PristineGecos", 0);
 	single_skip_login = cfg_get_bool(SECTION_OPTIONS, NULL,
 	        "SingleSkipLogin", 0);
 
+	if ((cache = ldr_cache_key(db, &key, name)) &&
+	    ldr_cache_load(db, name, &key))
+		return;
+
+#if OS_FORK
+	if (!ldr_load_pw_file_par(db, name))
+#endif
 	read_file(db, name, RF_ALLOW_DIR, ldr_load_pw_line);
+
+/* Only cache a file's hashes if none were dropped as dupes of earlier files */
+	if (cache && first)
+		ldr_cache_save(db, name, &key);
 }
 
 static void ldr_load_pot_line(struct db_main *db, char *line)
@@ -1238,11 +2199,357 @@ void ldr_free_test_db(struct db_main *db)
 	}
 }
 
+/*
+ * Pot file index.  When PotIndex is enabled, a sidecar file per pot file and
+ * format ("john.pot.Raw-MD5.pidx") holds a 64-bit fingerprint of the split()
+ * ciphertext and the file offset of every pot line valid for that format.
+ * Loading then only needs to parse the part of the pot file appended since
+ * the index was last updated, while earlier lines are only re-read and fully
+ * checked (by ldr_load_pot_line() as usual) where their fingerprint matches
+ * one of a loaded hash.  The index is rebuilt from scratch if the pot file
+ * appears to have been rewritten rather than appended to.
+ */
+#define LDR_PIDX_MAGIC			"JtRpix01"
+#define LDR_PIDX_SAMPLE			0x1000
+
+struct ldr_pidx_header {
+	char magic[8];
+	char version[32];
+	char label[64];
+	unsigned int field_sep_char;
+	int input_enc, target_enc;
+	uint64_t count;
+/* Size of the pot file covered and MD5 of the first and last covered bytes */
+	uint64_t covered;
+	unsigned char head[16], tail[16];
+};
+
+struct ldr_pidx_entry {
+	uint64_t key;
+	uint64_t offset;
+};
+
+static char *ldr_pidx_path(char *name, struct fmt_main *format)
+{
+	static char path[PATH_BUFFER_SIZE + 1];
+	char *p;
+
+	strnzcpy(path, path_expand(name), sizeof(path) - 80);
+	p = path + strlen(path);
+	snprintf(p, 80, ".%s.pidx", format->params.label);
+	while ((p = strpbrk(p, "/\\:*?\"<>| ")))
+		*p++ = '_';
+
+	return path;
+}
+
+/*
+ * Trimmed pot entries (see ldr_pot_source()) are keyed by the hash of the
+ * full source only, so that they match however long the kept prefix is.
+ */
+static uint64_t ldr_pidx_key(const char *ciphertext)
+{
+	const char *p;
+	uint64_t key = 0xcbf29ce484222325ULL;
+
+	if ((p = strstr(ciphertext, "$SOURCE_HASH$"))) {
+		ciphertext = p;
+		while (*p) {
+			key ^= (unsigned char)tolower(ARCH_INDEX(*p++));
+			key *= 0x100000001b3ULL;
+		}
+	} else
+	while (*ciphertext) {
+		key ^= (unsigned char)*ciphertext++;
+		key *= 0x100000001b3ULL;
+	}
+
+	return key ? key : 1;
+}
+
+static int ldr_pidx_sample(FILE *file, uint64_t covered,
+	unsigned char *head, unsigned char *tail)
+{
+	char buf[LDR_PIDX_SAMPLE];
+	uint64_t pos;
+	size_t count;
+	MD5_CTX ctx;
+
+	count = covered < sizeof(buf) ? covered : sizeof(buf);
+	if (jtr_fseek64(file, 0, SEEK_SET) ||
+	    fread(buf, 1, count, file) != count)
+		return 0;
+	MD5_Init(&ctx);
+	MD5_Update(&ctx, buf, count);
+	MD5_Final(head, &ctx);
+
+	pos = covered - count;
+	if (jtr_fseek64(file, pos, SEEK_SET) ||
+	    fread(buf, 1, count, file) != count)
+		return 0;
+	MD5_Init(&ctx);
+	MD5_Update(&ctx, buf, count);
+	MD5_Final(tail, &ctx);
+
+	return 1;
+}
+
+static void ldr_pidx_lock(FILE *file, int lock)
+{
+#if FCNTL_LOCKS
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = lock ? F_WRLCK : F_UNLCK;
+	while (fcntl(fileno(file), lock ? F_SETLKW : F_SETLK, &fl) &&
+	       errno == EINTR);
+#elif OS_FLOCK
+	while (flock(fileno(file), lock ? LOCK_EX : LOCK_UN) && errno == EINTR);
+#endif
+}
+
+/*
+ * Brings the index up to date with the pot file and returns its entries, or
+ * NULL if the index can't be used.  *covered is set to the end of the last
+ * complete line in the pot file.
+ */
+static struct ldr_pidx_entry *ldr_pidx_update(struct db_main *db,
+	FILE *pot, char *name, uint64_t *count, uint64_t *covered)
+{
+	struct fmt_main *format = db->format;
+	struct ldr_pidx_header header, expect;
+	struct ldr_pidx_entry *entries;
+	struct stat pot_stat;
+	char line_buf[LINE_BUFFER_SIZE], *path, *line, *ex_size_line;
+	char *ciphertext;
+	uint64_t alloc, start, last_count, pos, last_pos;
+	FILE *file;
+
+	path = ldr_pidx_path(name, format);
+	if (!(file = fopen(path, "r+b")) &&
+	    (errno != ENOENT || !(file = fopen(path, "w+b"))))
+		return NULL;
+	ldr_pidx_lock(file, 1);
+
+	memset(&expect, 0, sizeof(expect));
+	memcpy(expect.magic, LDR_PIDX_MAGIC, sizeof(expect.magic));
+	strncpy(expect.version, JOHN_VERSION, sizeof(expect.version) - 1);
+	strnzcpy(expect.label, format->params.label, sizeof(expect.label));
+	expect.field_sep_char = (unsigned char)db->options->field_sep_char;
+	expect.input_enc = options.input_enc;
+	expect.target_enc = options.target_enc;
+
+	if (fstat(fileno(pot), &pot_stat) ||
+	    fread(&header, sizeof(header), 1, file) != 1 ||
+	    memcmp(&header, &expect, offsetof(struct ldr_pidx_header, count)) ||
+	    header.covered > (uint64_t)pot_stat.st_size ||
+	    !ldr_pidx_sample(pot, header.covered, expect.head, expect.tail) ||
+	    memcmp(header.head, expect.head, sizeof(header.head)) ||
+	    memcmp(header.tail, expect.tail, sizeof(header.tail))) {
+		header = expect;
+		header.count = header.covered = 0;
+	}
+
+	alloc = header.count + 0x1000;
+	entries = mem_alloc(alloc * sizeof(*entries));
+	if (header.count &&
+	    fread(entries, sizeof(*entries), header.count, file) !=
+	    header.count)
+		header.count = header.covered = 0;
+	start = header.count;
+
+/* Index what was appended to the pot file since */
+	last_count = header.count;
+	last_pos = pos = header.covered;
+	if (jtr_fseek64(pot, pos, SEEK_SET))
+		goto fail;
+	while ((ex_size_line = fgetll(line_buf, sizeof(line_buf), pot))) {
+		last_count = header.count;
+		last_pos = pos;
+		pos = jtr_ftell64(pot);
+
+		line = skip_bom(ex_size_line);
+		ciphertext = ldr_get_field(&line, db->options->field_sep_char);
+		if (format->methods.valid(ciphertext, format) == 1) {
+			if (header.count >= alloc) {
+				alloc *= 2;
+				entries = realloc(entries,
+				    alloc * sizeof(*entries));
+				if (!entries)
+					pexit("realloc");
+			}
+			ciphertext = format->methods.split(ciphertext, 0,
+			                                   format);
+			entries[header.count].key = ldr_pidx_key(ciphertext);
+			entries[header.count++].offset = last_pos;
+		}
+		if (ex_size_line != line_buf)
+			MEM_FREE(ex_size_line);
+		check_abort(0);
+	}
+	if (ferror(pot))
+		goto fail;
+
+/* Leave a line that is still being written for next time */
+	if (pos > header.covered) {
+		if (jtr_fseek64(pot, pos - 1, SEEK_SET))
+			goto fail;
+		if (getc(pot) != '\n') {
+			header.count = last_count;
+			pos = last_pos;
+		}
+	}
+	*covered = pos;
+
+	if (pos > header.covered) {
+		uint64_t new_count = header.count;
+
+/* Entries first, then the header that makes them valid */
+		if (!start) {
+			header.count = header.covered = 0;
+			jtr_fseek64(file, 0, SEEK_SET);
+			fwrite(&header, sizeof(header), 1, file);
+		}
+		jtr_fseek64(file, sizeof(header) + start * sizeof(*entries),
+		            SEEK_SET);
+		fwrite(&entries[start], sizeof(*entries), new_count - start,
+		       file);
+		fflush(file);
+		header.count = new_count;
+		header.covered = pos;
+		if (!ldr_pidx_sample(pot, pos, header.head, header.tail))
+			goto fail;
+		jtr_fseek64(file, 0, SEEK_SET);
+		fwrite(&header, sizeof(header), 1, file);
+		if (ferror(file) | fflush(file))
+			fprintf(stderr, "Warning: can't write %s: %s\n",
+			        path, strerror(errno));
+	}
+
+	ldr_pidx_lock(file, 0);
+	fclose(file);
+	*count = header.count;
+	return entries;
+
+fail:
+	ldr_pidx_lock(file, 0);
+	fclose(file);
+	MEM_FREE(entries);
+	return NULL;
+}
+
+static int ldr_pidx_cmp_offset(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void ldr_pidx_add_key(uint64_t *set, uint64_t mask, uint64_t key)
+{
+	uint64_t i = key & mask;
+
+	while (set[i] && set[i] != key)
+		i = (i + 1) & mask;
+	set[i] = key;
+}
+
+static int ldr_pidx_has_key(uint64_t *set, uint64_t mask, uint64_t key)
+{
+	uint64_t i = key & mask;
+
+	while (set[i]) {
+		if (set[i] == key)
+			return 1;
+		i = (i + 1) & mask;
+	}
+	return 0;
+}
+
+/*
+ * Removes the loaded hashes found in a pot file by means of its index.
+ * Returns zero if the index can't be used, for the caller to fall back to
+ * reading the whole file.
+ */
+static int ldr_load_pot_file_indexed(struct db_main *db, char *name)
+{
+	struct fmt_main *format = db->format;
+	struct ldr_pidx_entry *entries;
+	struct db_salt *salt;
+	struct db_password *pw;
+	char line_buf[LINE_BUFFER_SIZE], *line, *ex_size_line;
+	char pot_buf[LINE_BUFFER_SIZE + 1];
+	const char *source, *pot_source;
+	uint64_t *set, *hits, mask, count, covered, nhits, i;
+	FILE *pot;
+	int j;
+
+	if (!cfg_get_bool(SECTION_OPTIONS, NULL, "PotIndex", 0) ||
+	    options.regen_lost_salts || (db->options->flags & DB_CRACKED) ||
+	    !db->password_count)
+		return 0;
+
+	if (!(pot = fopen(path_expand(name), "rb")))
+		return errno == ENOENT;
+
+	dyna_salt_init(format);
+	if (!(entries = ldr_pidx_update(db, pot, name, &count, &covered))) {
+		fclose(pot);
+		return 0;
+	}
+
+/* Fingerprints of the loaded hashes, as they'd be written to a pot file */
+	for (mask = 0xff; mask < (uint64_t)db->password_count * 4; )
+		mask = mask << 1 | 1;
+	set = mem_calloc(mask + 1, sizeof(*set));
+	for (j = 0; j < SALT_HASH_SIZE; j++)
+	for (salt = db->salt_hash[j]; salt; salt = salt->next)
+	for (pw = salt->list; pw; pw = pw->next) {
+		if (!pw->binary)
+			continue;
+		source = format->methods.source(pw->source, pw->binary);
+		ldr_pidx_add_key(set, mask, ldr_pidx_key(source));
+		pot_source = ldr_pot_source(source, pot_buf);
+		if (pot_source != source)
+			ldr_pidx_add_key(set, mask, ldr_pidx_key(pot_source));
+	}
+
+	nhits = 0;
+	hits = (uint64_t *)entries;
+	for (i = 0; i < count; i++)
+		if (ldr_pidx_has_key(set, mask, entries[i].key))
+			hits[nhits++] = entries[i].offset;
+	MEM_FREE(set);
+	qsort(hits, nhits, sizeof(*hits), ldr_pidx_cmp_offset);
+
+	for (i = 0; i < nhits; i++) {
+		if (i && hits[i] == hits[i - 1])
+			continue;
+		if (jtr_fseek64(pot, hits[i], SEEK_SET) ||
+		    !(ex_size_line = fgetll(line_buf, sizeof(line_buf), pot)))
+			break;
+		line = skip_bom(ex_size_line);
+		ldr_load_pot_line(db, line);
+		if (ex_size_line != line_buf)
+			MEM_FREE(ex_size_line);
+	}
+	MEM_FREE(entries);
+
+	if (name == options.activepot)
+		crk_pot_pos = covered;
+
+	if (fclose(pot)) pexit("fclose");
+
+	return 1;
+}
+
 void ldr_load_pot_file(struct db_main *db, char *name)
 {
 	if (db->format && !(db->format->params.flags & FMT_NOT_EXACT)) {
 		ldr_in_pot = 1;
-		read_file(db, name, RF_ALLOW_MISSING, ldr_load_pot_line);
+		if (!ldr_load_pot_file_indexed(db, name))
+			read_file(db, name, RF_ALLOW_MISSING,
+			          ldr_load_pot_line);
 		ldr_in_pot = 0;
 	}
 }
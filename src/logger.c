@@ -40,6 +40,9 @@
 #include <stdarg.h>
 #include <string.h>
 #include <signal.h>
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #include "arch.h"
 #include "misc.h"
@@ -90,6 +93,44 @@ static struct log_file pot = {NULL, NULL, NULL, 0, -1};
 
 static int in_logger = 0;
 
+/*
+ * Asynchronous guess reporting.  With "AsyncGuessLog" enabled, log_guess()
+ * only queues a copy of its arguments, which is cheap enough to do from the
+ * cracking loop even when thousands of guesses come in at once.  A writer
+ * thread then prints the guesses and adds them to john.pot and the log file,
+ * taking the file locks.  The queue is a lock-free stack that the writer
+ * takes over as a whole; the mutex is only used for sleeping and waking up.
+ * The logger's state is otherwise shared, so while the writer is running,
+ * all log_*() functions hold log_mutex (recursive, for the pexit() paths).
+ */
+#if HAVE_PTHREAD && defined(__GNUC__)
+#define LOG_ASYNC 1
+
+struct log_guess_rec {
+	struct log_guess_rec *next;
+	unsigned long long cand;
+	char *login, *uid, *ciphertext, *rep_plain, *store_plain;
+	char field_sep;
+};
+
+static int cfg_async;
+static int log_async, log_async_busy, log_async_quit;
+static struct log_guess_rec *volatile log_async_queue;
+static pthread_t log_async_thread;
+static pthread_mutex_t log_mutex;
+static pthread_mutex_t log_async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_async_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log_async_idle = PTHREAD_COND_INITIALIZER;
+
+#define LOG_LOCK() \
+	do { if (log_async) pthread_mutex_lock(&log_mutex); } while (0)
+#define LOG_UNLOCK() \
+	do { if (log_async) pthread_mutex_unlock(&log_mutex); } while (0)
+#else
+#define LOG_LOCK()
+#define LOG_UNLOCK()
+#endif
+
 static void log_file_init(struct log_file *f, char *name, int size)
 {
 	if (f == &log && (options.flags & FLG_NOLOG)) return;
@@ -328,6 +369,11 @@ void log_init(char *log_name, char *pot_name, char *session)
 	                            "LogDateFormatUTC", 0);
 	LogDateStderrFormat = cfg_get_param(SECTION_OPTIONS, NULL,
 			            "LogDateStderrFormat");
+#if LOG_ASYNC
+	if (pot.fd >= 0 && !log_async)
+		cfg_async = cfg_get_bool(SECTION_OPTIONS, NULL,
+		                         "AsyncGuessLog", 0);
+#endif
 	in_logger = 0;
 }
 
@@ -359,8 +405,9 @@ static char *components(char *string, int len)
 	return out;
 }
 
-void log_guess(char *login, char *uid, char *ciphertext, char *rep_plain,
-               char *store_plain, char field_sep, int index)
+static void log_guess_write(char *login, char *uid, char *ciphertext,
+	char *rep_plain, char *store_plain, char field_sep,
+	unsigned long long cand)
 {
 	int count1, count2;
 	int len;
@@ -435,9 +482,7 @@ void log_guess(char *login, char *uid, char *ciphertext, char *rep_plain,
 			if (cfg_showcand)
 				count2 += (int)sprintf(log.ptr + count2,
 				                       " as candidate #"LLu"",
-				                       ((unsigned long long)
-				                       status.cands.hi << 32) +
-				                       status.cands.lo + index + 1);
+				                       cand);
 			count2 += (int)sprintf(log.ptr + count2, "\n");
 
 			if (count2 > 0)
@@ -460,11 +505,179 @@ void log_guess(char *login, char *uid, char *ciphertext, char *rep_plain,
 		write_loop(fileno(stderr), "\007", 1);
 }
 
+#if LOG_ASYNC
+static void *log_async_main(void *arg)
+{
+	struct log_guess_rec *list, *guess, *next;
+	sigset_t set;
+
+/* Leave the signals to the main thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	pthread_mutex_lock(&log_async_mutex);
+	while (1) {
+		while (!log_async_queue && !log_async_quit) {
+			log_async_busy = 0;
+			pthread_cond_broadcast(&log_async_idle);
+			pthread_cond_wait(&log_async_work, &log_async_mutex);
+		}
+		if (!log_async_queue)
+			break;
+		log_async_busy = 1;
+		list = __sync_lock_test_and_set(&log_async_queue, NULL);
+		pthread_mutex_unlock(&log_async_mutex);
+
+/* The stack has the latest guess first */
+		guess = NULL;
+		while (list) {
+			next = list->next;
+			list->next = guess;
+			guess = list;
+			list = next;
+		}
+
+		pthread_mutex_lock(&log_mutex);
+		while (guess) {
+			log_guess_write(guess->login, guess->uid,
+			                guess->ciphertext, guess->rep_plain,
+			                guess->store_plain, guess->field_sep,
+			                guess->cand);
+			next = guess->next;
+			MEM_FREE(guess);
+			guess = next;
+		}
+		pthread_mutex_unlock(&log_mutex);
+
+		pthread_mutex_lock(&log_async_mutex);
+	}
+	log_async_busy = 0;
+	pthread_cond_broadcast(&log_async_idle);
+	pthread_mutex_unlock(&log_async_mutex);
+
+	return NULL;
+}
+
+/*
+ * The writer is started on the first guess rather than in log_init(), so
+ * that it exists in each "--fork" child.
+ */
+static int log_async_start(void)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&log_mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	log_async_busy = log_async_quit = 0;
+	log_async_queue = NULL;
+	if (pthread_create(&log_async_thread, NULL, log_async_main, NULL)) {
+		cfg_async = 0;
+		return 0;
+	}
+
+	return log_async = 1;
+}
+
+static int log_async_is_writer(void)
+{
+	return pthread_equal(pthread_self(), log_async_thread);
+}
+
+static void log_async_stop(void)
+{
+	if (!log_async || log_async_is_writer())
+		return;
+
+	pthread_mutex_lock(&log_async_mutex);
+	log_async_quit = 1;
+	pthread_cond_signal(&log_async_work);
+	pthread_mutex_unlock(&log_async_mutex);
+
+	pthread_join(log_async_thread, NULL);
+	pthread_mutex_destroy(&log_mutex);
+	log_async = cfg_async = 0;
+}
+#endif
+
+void log_guess(char *login, char *uid, char *ciphertext, char *rep_plain,
+               char *store_plain, char field_sep, int index)
+{
+	unsigned long long cand = ((unsigned long long)status.cands.hi << 32) +
+		status.cands.lo + index + 1;
+
+#if LOG_ASYNC
+	if (cfg_async && (log_async || log_async_start())) {
+		struct log_guess_rec *guess, *head;
+		size_t login_len = strlen(login) + 1;
+		size_t uid_len = strlen(uid) + 1;
+		size_t ct_len = ciphertext ? strlen(ciphertext) + 1 : 0;
+		size_t rep_len = strlen(rep_plain) + 1;
+		size_t store_len = strlen(store_plain) + 1;
+		char *p;
+
+		guess = mem_alloc(sizeof(*guess) + login_len + uid_len +
+		                  ct_len + rep_len + store_len);
+		p = (char*)(guess + 1);
+		guess->login = memcpy(p, login, login_len);
+		p += login_len;
+		guess->uid = memcpy(p, uid, uid_len);
+		p += uid_len;
+		if (ciphertext) {
+			guess->ciphertext = memcpy(p, ciphertext, ct_len);
+			p += ct_len;
+		} else
+			guess->ciphertext = NULL;
+		guess->rep_plain = memcpy(p, rep_plain, rep_len);
+		p += rep_len;
+		guess->store_plain = memcpy(p, store_plain, store_len);
+		guess->field_sep = field_sep;
+		guess->cand = cand;
+
+		do {
+			head = log_async_queue;
+			guess->next = head;
+		} while (!__sync_bool_compare_and_swap(&log_async_queue,
+		                                       head, guess));
+
+/* Only wake the writer up if it might be waiting for work */
+		if (!head) {
+			pthread_mutex_lock(&log_async_mutex);
+			pthread_cond_signal(&log_async_work);
+			pthread_mutex_unlock(&log_async_mutex);
+		}
+		return;
+	}
+#endif
+
+	LOG_LOCK();
+	log_guess_write(login, uid, ciphertext, rep_plain, store_plain,
+	                field_sep, cand);
+	LOG_UNLOCK();
+}
+
+void log_guess_sync(void)
+{
+#if LOG_ASYNC
+	if (!log_async || log_async_is_writer())
+		return;
+
+	pthread_mutex_lock(&log_async_mutex);
+	while (log_async_queue || log_async_busy)
+		pthread_cond_wait(&log_async_idle, &log_async_mutex);
+	pthread_mutex_unlock(&log_async_mutex);
+#endif
+}
+
 void log_event(const char *format, ...)
 {
 	va_list args;
 	int count1, count2;
 
+	LOG_LOCK();
+
 	if (options.flags & FLG_LOG_STDERR) {
 		unsigned int Time;
 
@@ -499,17 +712,25 @@ void log_event(const char *format, ...)
 		vfprintf(stderr, format, args);
 		va_end(args);
 		fprintf(stderr, "\n");
-		if (options.flags & FLG_NOLOG)
+		if (options.flags & FLG_NOLOG) {
+			LOG_UNLOCK();
 			return;
+		}
 	}
 
-	if (log.fd < 0) return;
+	if (log.fd < 0) {
+		LOG_UNLOCK();
+		return;
+	}
 
 /*
  * Handle possible recursion:
  * log_*() -> ... -> pexit() -> ... -> log_event()
  */
-	if (in_logger) return;
+	if (in_logger) {
+		LOG_UNLOCK();
+		return;
+	}
 	in_logger = 1;
 
 	count1 = log_time();
@@ -532,16 +753,22 @@ void log_event(const char *format, ...)
 	}
 
 	in_logger = 0;
+
+	LOG_UNLOCK();
 }
 
 void log_discard(void)
 {
 	if ((options.flags & FLG_NOLOG)) return;
+	LOG_LOCK();
 	log.ptr = log.buffer;
+	LOG_UNLOCK();
 }
 
 void log_flush(void)
 {
+	log_guess_sync();
+	LOG_LOCK();
 	in_logger = 1;
 
 	if (options.fork)
@@ -551,19 +778,28 @@ void log_flush(void)
 	log_file_fsync(&pot);
 
 	in_logger = 0;
+	LOG_UNLOCK();
 }
 
 void log_done(void)
 {
+#if LOG_ASYNC
+	log_async_stop();
+#endif
+	LOG_LOCK();
 /*
  * Handle possible recursion:
  * log_*() -> ... -> pexit() -> ... -> log_done()
  */
-	if (in_logger) return;
+	if (in_logger) {
+		LOG_UNLOCK();
+		return;
+	}
 	in_logger = 1;
 
 	log_file_done(&log, !options.fork);
 	log_file_done(&pot, 1);
 
 	in_logger = 0;
+	LOG_UNLOCK();
 }
@@ -29,6 +29,12 @@ extern void log_init(char *log_name, char *pot_name, char *session);
 extern void log_guess(char *login, char *uid, char *ciphertext, char *rep_plain,
                       char *store_plain, char field_sep, int index);
 
+/*
+ * Waits until the guesses queued by log_guess() (with "AsyncGuessLog") have
+ * been printed and written to the john.pot and log file buffers.
+ */
+extern void log_guess_sync(void);
+
 /*
  * Logs an arbitrary event.
  *
@@ -14,6 +14,9 @@
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "arch.h"
 #include "misc.h" /* for error() */
@@ -56,6 +59,19 @@ int mask_add_len, mask_num_qw, mask_cur_len;
  */
 static int mask_has_8bit;
 
+#ifdef _OPENMP
+/*
+ * With MaskParallelKeys, generate_keys() has all OpenMP threads produce the
+ * keys of a batch, each thread one contiguous range of keyspace indices,
+ * and then feeds them to the cracker in order.  mask_par_index is the index
+ * of the key last passed to the cracker, for mask_fix_state().
+ */
+#define MASK_BATCH_PER_THREAD	0x1000
+static int mask_par_keys, mask_par_active;
+static unsigned long long mask_par_index;
+static char *mask_par_buf;
+#endif
+
 /*
  * cand and rec_cand is the number of remaining candidates.
  * So, its value decreases as cracking progress.
@@ -1525,6 +1541,181 @@ static MAYBE_INLINE char* mask_cp_to_utf8(char *in)
 		start ? start + ranges(ps).iter:			\
 		ranges(ps).chars[ranges(ps).iter];
 
+/*
+ * Byte range of the key covered by the placeholders, and the position of the
+ * first (fastest-moving) one.
+ */
+static void mask_key_span(mask_cpu_context *cpu_mask_ctx, int *from, int *to,
+                          int *pos1)
+{
+	int ps;
+
+	*from = PLAINTEXT_BUFFER_SIZE;
+	*to = *pos1 = 0;
+	for (ps = cpu_mask_ctx->ps1; ps != MAX_NUM_MASK_PLHDR;
+	     ps = ranges(ps).next) {
+		int pos = ranges(ps).pos + ranges(ps).offset;
+
+		if (ps == cpu_mask_ctx->ps1)
+			*pos1 = pos;
+		if (pos < *from)
+			*from = pos;
+		if (pos >= *to)
+			*to = pos + 1;
+	}
+}
+
+#ifdef _OPENMP
+/*
+ * Sets the iteration state of the placeholders in chain[] to what it is for
+ * keyspace index i, the first placeholder being the fastest-moving one.
+ */
+static void mask_par_set_iters(mask_cpu_context *cpu_mask_ctx, int *chain,
+                               int n, unsigned long long i)
+{
+	int j;
+
+	for (j = 0; j < n; j++) {
+		ranges(chain[j]).iter = i % ranges(chain[j]).count;
+		i /= ranges(chain[j]).count;
+	}
+}
+
+static int generate_keys_parallel(mask_cpu_context *cpu_mask_ctx,
+                                  unsigned long long *my_candidates)
+{
+	char key_e[PLAINTEXT_BUFFER_SIZE];
+	char *key, **filtered;
+	int chain[MAX_NUM_MASK_PLHDR + 1], n = 0, ps;
+	int threads = omp_get_max_threads();
+	int key_len = strlen(template_key);
+	int convert = mask_has_8bit &&
+		options.internal_cp != UTF_8 && options.target_enc == UTF_8;
+	size_t stride;
+	unsigned long long index = 0, total = 1, end;
+	int batch = MASK_BATCH_PER_THREAD * threads;
+	int span_from, span_to, pos1, first_key = 1;
+
+/* An external filter gets to see the keys before they're converted */
+	if (f_filter)
+		convert = 0;
+	stride = convert ? PLAINTEXT_BUFFER_SIZE + 1 : key_len + 1;
+
+	for (ps = cpu_mask_ctx->ps1; ps != MAX_NUM_MASK_PLHDR;
+	     ps = ranges(ps).next) {
+		index += ranges(ps).iter * total;
+		total *= ranges(ps).count;
+		chain[n++] = ps;
+	}
+	end = total;
+	if (options.node_count && !(options.flags & FLG_MASK_STACKED) &&
+	    *my_candidates < end - index)
+		end = index + *my_candidates;
+
+	if (!mask_par_buf)
+		mask_par_buf = mem_alloc((size_t)batch *
+		                         (PLAINTEXT_BUFFER_SIZE + 1));
+
+	mask_key_span(cpu_mask_ctx, &span_from, &span_to, &pos1);
+
+	mask_par_active = 1;
+	while (index < end) {
+		int count = end - index < batch ? end - index : batch;
+		int per = (count + threads - 1) / threads, t, j;
+
+#pragma omp parallel for default(none) private(t) \
+	shared(threads, count, per, index, stride, key_len, convert, chain, n, \
+	       cpu_mask_ctx, template_key, mask_par_buf, fmt_maxlen)
+		for (t = 0; t < threads; t++) {
+			char tkey[PLAINTEXT_BUFFER_SIZE + 1];
+			unsigned char iter[MAX_NUM_MASK_PLHDR + 1];
+			unsigned long long i = index + (unsigned long long)t * per;
+			int first = t * per, last = first + per, k, c;
+
+			if (last > count)
+				last = count;
+			if (first >= last)
+				continue;
+
+			memcpy(tkey, template_key, key_len + 1);
+			for (c = 0; c < n; c++) {
+				iter[c] = i % ranges(chain[c]).count;
+				i /= ranges(chain[c]).count;
+				tkey[ranges(chain[c]).pos + ranges(chain[c]).offset] =
+					ranges(chain[c]).chars[iter[c]];
+			}
+
+			for (k = first; k < last; k++) {
+				char *out = &mask_par_buf[k * stride];
+
+				if (convert)
+					cp_to_utf8_r(tkey, out, fmt_maxlen);
+				else
+					memcpy(out, tkey, key_len + 1);
+
+				for (c = 0; c < n; c++) {
+					mask_range *r = &ranges(chain[c]);
+
+					if (++iter[c] == r->count)
+						iter[c] = 0;
+					tkey[r->pos + r->offset] = r->chars[iter[c]];
+					if (iter[c])
+						break;
+				}
+			}
+		}
+
+		filtered = NULL;
+		if (f_filter && ext_threads > 1)
+			filtered = ext_filter_keys(mask_par_buf, stride, count);
+
+		for (j = 0; j < count; j++) {
+			int done;
+
+			if (options.node_count &&
+			    !(options.flags & FLG_MASK_STACKED))
+				(*my_candidates)--;
+			mask_par_index = index + j;
+			key = &mask_par_buf[j * stride];
+			if (filtered) {
+				if (!filtered[j])
+					continue;
+				done = crk_process_key(mask_cp_to_utf8(filtered[j]));
+			} else
+			if (f_filter) {
+				if (!ext_filter_body(key, key_e))
+					continue;
+				done = crk_process_key(mask_cp_to_utf8(key_e));
+			} else
+			if (convert)
+				done = crk_process_key(key);
+			else
+/* Only the first placeholder moves unless it just wrapped around */
+			if (first_key) {
+				done = crk_process_key_delta(key, -1, 0);
+				first_key = 0;
+			} else
+			if (mask_par_index % ranges(chain[0]).count)
+				done = crk_process_key_delta(key, pos1, pos1 + 1);
+			else
+				done = crk_process_key_delta(key, span_from,
+				                             span_to);
+			if (done) {
+				mask_par_set_iters(cpu_mask_ctx, chain, n,
+				                   mask_par_index);
+				mask_par_active = 0;
+				return 1;
+			}
+		}
+		index += count;
+	}
+	mask_par_set_iters(cpu_mask_ctx, chain, n, end);
+	mask_par_active = 0;
+
+	return 0;
+}
+#endif
+
 static int generate_keys(mask_cpu_context *cpu_mask_ctx,
 			  unsigned long long *my_candidates)
 {
@@ -1533,10 +1724,30 @@ static int generate_keys(mask_cpu_context *cpu_mask_ctx,
 	int ps1 = MAX_NUM_MASK_PLHDR, ps2 = MAX_NUM_MASK_PLHDR,
 	    ps3 = MAX_NUM_MASK_PLHDR, ps4 = MAX_NUM_MASK_PLHDR, ps ;
 	int start1, start2, start3, start4;
+	int delta, delta_from, delta_to, span_from, span_to, pos1;
+
+#ifdef _OPENMP
+	if (mask_par_keys) {
+		unsigned long long left = 1;
+
+		for (ps = cpu_mask_ctx->ps1; ps != MAX_NUM_MASK_PLHDR &&
+		     left < MASK_BATCH_PER_THREAD; ps = ranges(ps).next)
+			left *= ranges(ps).count;
+
+/* Small keyspaces, as for each word in hybrid mode, aren't worth it */
+		if (left >= MASK_BATCH_PER_THREAD)
+			return generate_keys_parallel(cpu_mask_ctx,
+			                              my_candidates);
+	}
+#endif
 
 #define process_key(key_i)	  \
 	do { \
 		key = key_i; \
+		if (delta) { \
+			if (crk_process_key_delta(key, delta_from, delta_to)) \
+				return 1; \
+		} else \
 		if (!f_filter || ext_filter_body(key_i, key = key_e)) \
 			if ((crk_process_key(mask_cp_to_utf8(key)))) \
 				return 1; \
@@ -1547,6 +1758,17 @@ static int generate_keys(mask_cpu_context *cpu_mask_ctx,
 	ps3 = cpu_mask_ctx->ranges[ps2].next;
 	ps4 = cpu_mask_ctx->ranges[ps3].next;
 
+/*
+ * Successive keys only differ within the placeholders' span, and usually just
+ * in the first placeholder, so the cracker can tell formats to patch only
+ * those bytes.  The first key may be a new hybrid word or length.
+ */
+	delta = !f_filter && !(mask_has_8bit && options.internal_cp != UTF_8 &&
+	                       options.target_enc == UTF_8);
+	delta_from = -1;
+	delta_to = 0;
+	mask_key_span(cpu_mask_ctx, &span_from, &span_to, &pos1);
+
 	if (cpu_mask_ctx->cpu_count < 4) {
 		ps = ps1;
 
@@ -1560,6 +1782,8 @@ static int generate_keys(mask_cpu_context *cpu_mask_ctx,
 				goto done;
 
 			process_key(template_key);
+			delta_from = span_from;
+			delta_to = span_to;
 			ps = ps1;
 			next_state(ps);
 		}
@@ -1590,8 +1814,12 @@ static int generate_keys(mask_cpu_context *cpu_mask_ctx,
 								goto done;
 							set_template_key(ps1, start1);
 							process_key(template_key);
+							delta_from = pos1;
+							delta_to = pos1 + 1;
 						}
 					ranges(ps1).iter = 0;
+					delta_from = span_from;
+					delta_to = span_to;
 					}
 				ranges(ps2).iter = 0;
 				}
@@ -1888,6 +2116,21 @@ void mask_fix_state(void)
 	rec_len = max_keylen;
 	for (i = 0; i < rec_ctx.count; i++)
 		rec_ctx.ranges[i].iter = cpu_mask_ctx.ranges[i].iter;
+
+#ifdef _OPENMP
+/* The keys were made ahead of time, so work out where we really are */
+	if (mask_par_active) {
+		unsigned long long index = mask_par_index;
+		int ps;
+
+		for (ps = cpu_mask_ctx.ps1; ps != MAX_NUM_MASK_PLHDR;
+		     ps = cpu_mask_ctx.ranges[ps].next) {
+			rec_ctx.ranges[ps].iter =
+				index % cpu_mask_ctx.ranges[ps].count;
+			index /= cpu_mask_ctx.ranges[ps].count;
+		}
+	}
+#endif
 }
 
 void remove_slash(char *mask)
@@ -2203,6 +2446,15 @@ void mask_init(struct db_main *db, char *unprocessed_mask)
 	for (i = 0; i < mask_num_qw + 1; i++)
 		template_key_offsets[i] = -1;
 
+#ifdef _OPENMP
+	mask_par_keys = omp_get_max_threads() > 1 &&
+		!(options.flags & FLG_TEST_CHK) &&
+		cfg_get_bool(SECTION_OPTIONS, NULL, "MaskParallelKeys", 1);
+	if (mask_par_keys)
+		log_event("- Generating mask keys on %d threads",
+		          omp_get_max_threads());
+#endif
+
 #ifdef MASK_DEBUG
 	fprintf(stderr, "Custom masks expanded (this is 'mask' when passed to "
 	        "init_cpu_mask()):\n%s\n", mask);
@@ -2267,10 +2519,15 @@ void mask_done()
 
 	MEM_FREE(template_key);
 	MEM_FREE(template_key_offsets);
+#ifdef _OPENMP
+	MEM_FREE(mask_par_buf);
+#endif
 	if (mask_skip_ranges)
 		MEM_FREE(mask_skip_ranges);
 	if (mask_int_cand.int_cand)
 		MEM_FREE(mask_int_cand.int_cand);
+	MEM_FREE(mask_int_hits);
+	mask_num_int_hits = 0;
 	mask_int_cand.num_int_cand = 0;
 	mask_int_cand_target = 0;
 }
@@ -8,6 +8,8 @@
  * There's ABSOLUTELY NO WARRANTY, express or implied.
  */
 
+#include <string.h>
+
 #include "mask_ext.h"
 #include "misc.h"	// error()
 #include "options.h"
@@ -19,6 +21,9 @@ int mask_max_skip_loc = -1;
 int mask_int_cand_target = 0;
 int mask_gpu_is_static = 0;
 mask_int_cand_ctx mask_int_cand = {NULL, NULL, 1};
+mask_int_hit *mask_int_hits = NULL;
+int mask_num_int_hits = 0;
+static int mask_max_int_hits = 0;
 
 static void combination_util(int *data, int start, int end, int index,
                              int r, mask_cpu_context *ptr, int *delta)
@@ -162,3 +167,100 @@ void mask_calc_combination(mask_cpu_context *ptr, int max_static_range) {
 		fprintf(stderr, "%c%c%c%c\n", mask_int_cand.int_cand[i].x[0], mask_int_cand.int_cand[i].x[1], mask_int_cand.int_cand[i].x[2], mask_int_cand.int_cand[i].x[3]);*/
 	MEM_FREE(data);
 }
+
+void mask_int_cpu_init(int target)
+{
+/*
+ * Internal placeholders can't be truncated (nor moved around as in hybrid
+ * mode), so we don't ask for any if the length might get iterated.
+ */
+	if (options.flags & (FLG_MASK_STACKED | FLG_TEST_CHK))
+		return;
+	if (options.req_minlength >= 0 || options.req_maxlength)
+		return;
+
+	mask_int_cand_target = target;
+}
+
+int mask_int_cpu_pos(int *pos)
+{
+	int i;
+
+	if (mask_int_cand.num_int_cand <= 1 || !mask_skip_ranges)
+		return 0;
+
+	for (i = 0; i < MASK_FMT_INT_PLHDR && mask_skip_ranges[i] != -1; i++)
+		pos[i] = mask_int_cand.int_cpu_mask_ctx->
+			ranges[mask_skip_ranges[i]].pos;
+
+	return i;
+}
+
+int mask_int_cpu_check(struct db_salt *salt, int index,
+	int (*cmp_one)(void *binary, int index))
+{
+	struct db_password *pw;
+
+	if (salt->bitmap) {
+		unsigned int hash = salt->index(index);
+
+		if (!(salt->bitmap[hash / (sizeof(*salt->bitmap) * 8)] &
+		    (1U << (hash % (sizeof(*salt->bitmap) * 8)))))
+			return 0;
+		pw = salt->hash[hash >> PASSWORD_HASH_SHR];
+		do {
+			if (cmp_one(pw->binary, index))
+				return 1;
+		} while ((pw = pw->next_hash));
+		return 0;
+	}
+
+	pw = salt->list;
+	do {
+		if (cmp_one(pw->binary, index))
+			return 1;
+	} while ((pw = pw->next));
+
+	return 0;
+}
+
+void mask_int_cpu_hit(int index, int int_index, unsigned int hash)
+{
+#ifdef _OPENMP
+#pragma omp critical (mask_int_cpu_hit)
+#endif
+	{
+		if (!mask_int_hits)
+			mask_max_int_hits = 0;
+		if (mask_num_int_hits >= mask_max_int_hits) {
+			mask_int_hit *hits;
+
+			mask_max_int_hits = mask_max_int_hits ?
+				2 * mask_max_int_hits : 64;
+			hits = mem_alloc(mask_max_int_hits * sizeof(*hits));
+			if (mask_num_int_hits)
+				memcpy(hits, mask_int_hits,
+				       mask_num_int_hits * sizeof(*hits));
+			MEM_FREE(mask_int_hits);
+			mask_int_hits = hits;
+		}
+		mask_int_hits[mask_num_int_hits].index = index;
+		mask_int_hits[mask_num_int_hits].int_index = int_index;
+		mask_int_hits[mask_num_int_hits++].hash = hash;
+	}
+}
+
+int mask_int_cpu_key(int index, int num_keys, int *int_index)
+{
+	if (index < mask_num_int_hits) {
+		*int_index = mask_int_hits[index].int_index;
+		return mask_int_hits[index].index;
+	}
+
+/* Not a hit, so this is only for status reporting */
+	if (mask_int_cand.num_int_cand > 1)
+		index /= mask_int_cand.num_int_cand;
+	*int_index = 0;
+
+	return index < num_keys ? index : num_keys - 1;
+}
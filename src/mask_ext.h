@@ -32,4 +32,49 @@ extern int mask_int_cand_target;
 extern int mask_gpu_is_static;
 extern mask_int_cand_ctx mask_int_cand;
 
+/*
+ * CPU formats may also take internal candidates, in plain mask mode only
+ * (where the internal placeholders are at the same positions in every key).
+ * Their crypt_all() then patches each internal candidate into the keys in
+ * place and keeps only the outputs possibly matching a loaded hash, as hits
+ * (which become its output indices).
+ */
+typedef struct {
+	unsigned int index;	/* key index, as used with set_key() */
+	unsigned int int_index;	/* internal candidate */
+	unsigned int hash;	/* the output word used by cmp_one() */
+} mask_int_hit;
+
+extern mask_int_hit *mask_int_hits;
+extern int mask_num_int_hits;
+
+/*
+ * To be called from a CPU format's init().
+ */
+extern void mask_int_cpu_init(int target);
+
+/*
+ * Returns the number of internal placeholders currently in use (zero if
+ * none), and fills in their positions in the key.
+ */
+extern int mask_int_cpu_pos(int *pos);
+
+/*
+ * Returns true if crypt_all() output index (for the internal candidate just
+ * computed) might match one of the salt's hashes.
+ */
+extern int mask_int_cpu_check(struct db_salt *salt, int index,
+	int (*cmp_one)(void *binary, int index));
+
+/*
+ * Records a hit.  Thread-safe.
+ */
+extern void mask_int_cpu_hit(int index, int int_index, unsigned int hash);
+
+/*
+ * Maps an output index of a crypt_all() that did num_keys keys to its key
+ * index, and sets *int_index to its internal candidate.
+ */
+extern int mask_int_cpu_key(int index, int num_keys, int *int_index);
+
 #endif
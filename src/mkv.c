@@ -7,6 +7,9 @@
 
 #include <stdio.h>
 #include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "arch.h"
 #include "misc.h"
@@ -42,6 +45,14 @@ static int regex_case;
 static char *regex;
 #endif
 
+#ifdef _OPENMP
+#define MKV_BATCH_PER_THREAD	0x1000
+static int mkv_par_keys;
+static char *mkv_par_buf;
+static unsigned long long *mkv_par_pos;
+static int *mkv_par_count;
+#endif
+
 static void save_state(FILE *file)
 {
 	fprintf(file, LLd "\n", tidx);
@@ -69,258 +80,265 @@ void mkv_hybrid_fix_state(void)
 	hybrid_tidx = gidx;
 }
 
-static int show_pwd_rnbs(struct db_main *db, struct s_pwd *pwd)
+/*
+ * Walk state for the Markov tree.  A node comes after all of its children
+ * (in charsorted[] order, as far as the level allows), and gidx counts the
+ * nodes walked.  For the current node at each length len, k[len] is its
+ * position among its parent's children, lvl[len] its level and left[len] is
+ * how much of its parent's nbparts[] is left for its following siblings,
+ * a sibling being there as long as that's above 1.
+ */
+struct mkv_walk {
+	struct s_pwd pwd;
+	unsigned long long left[MAX_MKV_LEN + 2];
+	unsigned int k[MAX_MKV_LEN + 2];
+	unsigned int lvl[MAX_MKV_LEN + 2];
+};
+
+/* Number of nodes in the current node's subtree, including itself */
+#define mkv_size(w, len) \
+	nbparts[(w)->pwd.password[(len) - 1] + (len) * 256 + \
+	        (w)->lvl[len] * 256 * gmax_len]
+
+/* Whether the first characters have a k-th one */
+#define mkv_first_char(k) \
+	((k) < 256 && proba1[charsorted[k]] <= gmax_level)
+
+/*
+ * Makes the k-th child of the node at len - 1 the current node.
+ */
+static void mkv_set(struct mkv_walk *w, unsigned int len, unsigned int k)
 {
-	unsigned long long i;
-	unsigned int k;
-	unsigned long lvl;
-	char pass_filtered[PLAINTEXT_BUFFER_SIZE];
-	char *pass;
-
-	k = 0;
-	i = nbparts[pwd->password[pwd->len - 1] + pwd->len * 256 +
-	            pwd->level * 256 * gmax_len];
-	pwd->len++;
-	lvl = pwd->level;
-	pwd->password[pwd->len] = 0;
-	while (i > 1) {
-		pwd->password[pwd->len - 1] =
-		    charsorted[pwd->password[pwd->len - 2] * 256 + k];
-		pwd->level =
-		    lvl + proba2[pwd->password[pwd->len - 2] * 256 +
-		                 pwd->password[pwd->len - 1]];
-		i -= nbparts[pwd->password[pwd->len - 1] + pwd->len * 256 +
-		             pwd->level * 256 * gmax_len];
-		if (pwd->len <= gmax_len) {
-			if (show_pwd_rnbs(db, pwd))
-				return 1;
-		}
-		if ((pwd->len >= gmin_len) && (pwd->level >= gmin_level)) {
-			pass = (char *)pwd->password;
-#if HAVE_REXGEN
-			if (regex) {
-				if (do_regex_hybrid_crack(db, regex, pass,
-				                          regex_case, regex_alpha))
-					return 1;
-				mkv_hybrid_fix_state();
-			} else
-#endif
-			if (f_new) {
-				if (do_external_hybrid_crack(db, pass))
-					return 1;
-				mkv_hybrid_fix_state();
-			} else
-			if (options.mask) {
-				if (do_mask_crack(pass))
-					return 1;
-			} else
-			if (!f_filter ||
-			    ext_filter_body((char *)pwd->password, pass = pass_filtered))
-				if (crk_process_key(pass))
-					return 1;
-		}
-		gidx++;
-		k++;
-		if (gidx > gend)
-			return 1;
+	unsigned char c;
+
+	if (len == 1) {
+		c = charsorted[k];
+		w->lvl[1] = proba1[c];
+	} else {
+		unsigned int p = w->pwd.password[len - 2];
+
+		c = charsorted[p * 256 + k];
+		w->lvl[len] = w->lvl[len - 1] + proba2[p * 256 + c];
 	}
-	pwd->len--;
-	pwd->password[pwd->len] = 0;
-	pwd->level = lvl;
-	return 0;
+	w->k[len] = k;
+	w->pwd.password[len - 1] = c;
+	w->pwd.password[len] = 0;
+	w->pwd.len = len;
+	w->pwd.level = w->lvl[len];
 }
 
-static int show_pwd_r(struct db_main *db, struct s_pwd *pwd, unsigned int bs)
+/*
+ * Goes down to the first node of the current node's subtree.
+ */
+static void mkv_descend(struct mkv_walk *w)
 {
-	unsigned long long i;
-	unsigned int k;
-	unsigned long lvl;
-	unsigned char curchar;
-	char pass_filtered[PLAINTEXT_BUFFER_SIZE];
-	char *pass;
-
-	k = 0;
-	i = nbparts[pwd->password[pwd->len - 1] + pwd->len * 256 +
-	            pwd->level * 256 * gmax_len];
-	pwd->len++;
-	lvl = pwd->level;
-	if (bs) {
-		while ((curchar =
-		            charsorted[pwd->password[pwd->len - 2] * 256 + k]) !=
-		        pwd->password[pwd->len - 1]) {
-			i -= nbparts[curchar + pwd->len * 256 + (pwd->level +
-			             proba2[pwd->password[pwd->len - 2] * 256 +
-			                    curchar]) * 256 * gmax_len];
+	unsigned int len = w->pwd.len;
+	unsigned long long size;
+
+	while ((size = mkv_size(w, len)) > 1) {
+		mkv_set(w, ++len, 0);
+		w->left[len] = size - mkv_size(w, len);
+	}
+}
+
+/*
+ * Moves on to the next node, returning zero if there's none.
+ */
+static int mkv_next(struct mkv_walk *w)
+{
+	unsigned int len = w->pwd.len;
+
+	if (len == 1) {
+		if (!mkv_first_char(w->k[1] + 1))
+			return 0;
+		mkv_set(w, 1, w->k[1] + 1);
+	} else
+	if (w->left[len] > 1) {
+		unsigned long long left = w->left[len];
+
+		mkv_set(w, len, w->k[len] + 1);
+		w->left[len] = left - mkv_size(w, len);
+	} else {
+		w->pwd.password[--w->pwd.len] = 0;
+		w->pwd.level = w->lvl[len - 1];
+		return 1;
+	}
+
+	mkv_descend(w);
+	return 1;
+}
+
+/*
+ * Makes the node at (zero-based) position pos the current one, returning zero
+ * if there are not that many nodes.
+ */
+static int mkv_seek(struct mkv_walk *w, unsigned long long pos)
+{
+	unsigned int len = 1, k = 0;
+	unsigned long long size, left;
+
+	while (1) {
+		if (!mkv_first_char(k))
+			return 0;
+		mkv_set(w, 1, k);
+		if (pos < (size = mkv_size(w, 1)))
+			break;
+		pos -= size;
+		k++;
+	}
+
+/* Not the node itself, so in one of its children's subtrees */
+	while (pos != size - 1) {
+		left = size;
+		k = 0;
+		while (1) {
+			mkv_set(w, len + 1, k);
+			size = mkv_size(w, len + 1);
+			left -= size;
+			if (pos < size)
+				break;
+			pos -= size;
 			k++;
 		}
-		pwd->level +=
-		    proba2[pwd->password[pwd->len - 2] * 256 + pwd->password[pwd->len -
-		            1]];
-		if (pwd->password[pwd->len] != 0)
-			if (show_pwd_r(db, pwd, 1))
-				return 1;
-		i -= nbparts[pwd->password[pwd->len - 1] + pwd->len * 256 +
-		             pwd->level * 256 * gmax_len];
-		if ((pwd->len >= gmin_len) && (pwd->level >= gmin_level)) {
-			pass = (char *)pwd->password;
+		w->left[++len] = left;
+	}
+
+	return 1;
+}
+
+static int mkv_process(struct db_main *db, char *key)
+{
+	char pass_filtered[PLAINTEXT_BUFFER_SIZE], *pass = key;
+
 #if HAVE_REXGEN
-			if (regex) {
-				if (do_regex_hybrid_crack(db, regex, pass,
-				                          regex_case, regex_alpha))
-					return 1;
-				mkv_hybrid_fix_state();
-			} else
+	if (regex) {
+		if (do_regex_hybrid_crack(db, regex, pass,
+		                          regex_case, regex_alpha))
+			return 1;
+		mkv_hybrid_fix_state();
+	} else
 #endif
-			if (f_new) {
-				if (do_external_hybrid_crack(db, pass))
-					return 1;
-				mkv_hybrid_fix_state();
-			} else
-			if (options.mask) {
-				if (do_mask_crack(pass))
-					return 1;
-			} else
-			if (!f_filter ||
-			    ext_filter_body((char *)pwd->password, pass = pass_filtered))
-				if (crk_process_key(pass))
-					return 1;
-		}
-		gidx++;
-		k++;
+	if (f_new) {
+		if (do_external_hybrid_crack(db, pass))
+			return 1;
+		mkv_hybrid_fix_state();
+	} else
+	if (options.mask) {
+		if (do_mask_crack(pass))
+			return 1;
+	} else
+	if (!f_filter || ext_filter_body(key, pass = pass_filtered))
+		if (crk_process_key(pass))
+			return 1;
+
+	return 0;
+}
+
+#ifdef _OPENMP
+/*
+ * Walks positions pos to end - 1 (limited to gend) in batches, each OpenMP
+ * thread seeking to and walking its own contiguous range of nodes.  The keys
+ * are fed to the cracker in order, gidx being what it would be serially.
+ */
+static int show_pwd_parallel(struct db_main *db, unsigned long long pos,
+                             unsigned long long end)
+{
+	int threads = omp_get_max_threads();
+	int batch = MKV_BATCH_PER_THREAD * threads;
+	unsigned long long offset = gidx - pos;
+	int stride = gmax_len + 1;
+
+	if (end > gend + 1 - offset)
+		end = gend + 1 - offset;
+
+	if (!mkv_par_buf) {
+		mkv_par_buf = mem_alloc((size_t)batch * (MAX_MKV_LEN + 1));
+		mkv_par_pos = mem_alloc(batch * sizeof(*mkv_par_pos));
+		mkv_par_count = mem_alloc(threads * sizeof(*mkv_par_count));
 	}
-	pwd->password[pwd->len] = 0;
-	while (i > 1) {
-		pwd->password[pwd->len - 1] =
-		    charsorted[pwd->password[pwd->len - 2] * 256 + k];
-		pwd->level =
-		    lvl + proba2[pwd->password[pwd->len - 2] * 256 +
-		                 pwd->password[pwd->len - 1]];
-		i -= nbparts[pwd->password[pwd->len - 1] + pwd->len * 256 +
-		             pwd->level * 256 * gmax_len];
-		if (pwd->len <= gmax_len) {
-			if (show_pwd_r(db, pwd, 0))
-				return 1;
+
+	while (pos < end) {
+		int count = end - pos < batch ? end - pos : batch;
+		int per = (count + threads - 1) / threads, t, i;
+
+#pragma omp parallel for default(none) private(t) \
+	shared(threads, count, per, pos, stride, mkv_par_buf, mkv_par_pos, \
+	       mkv_par_count, gmin_len, gmin_level)
+		for (t = 0; t < threads; t++) {
+			struct mkv_walk w;
+			int first = t * per, last = first + per, n = first, j;
+
+			if (last > count)
+				last = count;
+			if (first < last && mkv_seek(&w, pos + first))
+			for (j = first; j < last; j++) {
+				if (w.pwd.len >= gmin_len &&
+				    w.pwd.level >= gmin_level) {
+					memcpy(&mkv_par_buf[n * stride],
+					       w.pwd.password, w.pwd.len + 1);
+					mkv_par_pos[n++] = pos + j;
+				}
+				if (!mkv_next(&w))
+					break;
+			}
+			mkv_par_count[t] = n - first;
 		}
-		if ((pwd->len >= gmin_len) && (pwd->level >= gmin_level)) {
-			pass = (char *)pwd->password;
-#if HAVE_REXGEN
-			if (regex) {
-				if (do_regex_hybrid_crack(db, regex, pass,
-				                          regex_case, regex_alpha))
-					return 1;
-				mkv_hybrid_fix_state();
-			} else
-#endif
-			if (f_new) {
-				if (do_external_hybrid_crack(db, pass))
-					return 1;
-				mkv_hybrid_fix_state();
-			} else
-			if (options.mask) {
-				if (do_mask_crack(pass))
-					return 1;
-			} else
-			if (!f_filter ||
-			    ext_filter_body((char *)pwd->password, pass = pass_filtered))
-				if (crk_process_key(pass))
-					return 1;
+
+		for (t = 0; t < threads; t++)
+		for (i = t * per; i < t * per + mkv_par_count[t]; i++) {
+			gidx = mkv_par_pos[i] + offset;
+			if (mkv_process(db, &mkv_par_buf[i * stride]))
+				return 1;
 		}
-		gidx++;
-		k++;
-		if (gidx > gend)
-			return 1;
+
+		pos += count;
+		gidx = pos + offset;
 	}
-	pwd->len--;
-	pwd->password[pwd->len] = 0;
-	pwd->level = lvl;
-	return 0;
+
+	return gidx > gend;
 }
+#endif
 
 static int show_pwd(struct db_main *db, unsigned long long start)
 {
-	struct s_pwd pwd;
-	unsigned int i;
-	char pass_filtered[PLAINTEXT_BUFFER_SIZE];
-	char *pass;
+	struct mkv_walk w;
+	unsigned long long pos;
 
 	if (gidx == 0)
 		gidx = start;
-	i = 0;
-
-	if (gidx > 0) {
-		print_pwd(gidx, &pwd, gmax_level, gmax_len);
-		while (charsorted[i] != pwd.password[0])
-			i++;
-		pwd.len = 1;
-		pwd.level = proba1[pwd.password[0]];
-		if (pwd.level <= gmax_level) {
-			if (show_pwd_r(db, &pwd, 1))
-				return 1;
 
-			if ((pwd.len >= gmin_len) && (pwd.level >= gmin_level)) {
-				pass = (char *)pwd.password;
+/* A fresh walk numbers the nodes from 0, a resumed or split one from 1 */
+	pos = gidx ? gidx - 1 : 0;
+
+#ifdef _OPENMP
+	if (mkv_par_keys &&
 #if HAVE_REXGEN
-				if (regex) {
-					if (do_regex_hybrid_crack(db, regex, pass,
-					                          regex_case, regex_alpha))
-						return 1;
-					mkv_hybrid_fix_state();
-				} else
+	    !regex &&
 #endif
-				if (f_new) {
-					if (do_external_hybrid_crack(db, pass))
-						return 1;
-					mkv_hybrid_fix_state();
-				} else
-				if (options.mask) {
-					if (do_mask_crack(pass))
-						return 1;
-				} else
-				if (!f_filter ||
-				    ext_filter_body((char *)pwd.password, pass = pass_filtered))
-					if (crk_process_key(pass))
-						return 1;
-			}
+	    !f_new && !options.mask) {
+		unsigned long long nodes = 0;
+		unsigned int k;
+
+		for (k = 0; mkv_first_char(k); k++) {
+			mkv_set(&w, 1, k);
+			nodes += mkv_size(&w, 1);
 		}
-		gidx++;
-		i++;
+		if (nodes > pos && nodes - pos >= MKV_BATCH_PER_THREAD)
+			return show_pwd_parallel(db, pos, nodes);
 	}
-	while (proba1[charsorted[i]] <= gmax_level) {
+#endif
+
+	if (!mkv_seek(&w, pos))
+		return 0;
+	do {
 		if (gidx > gend)
 			return 1;
-		pwd.len = 1;
-		pwd.password[0] = charsorted[i];
-		pwd.level = proba1[pwd.password[0]];
-		pwd.password[1] = 0;
-		if (show_pwd_rnbs(db, &pwd))
+		if (w.pwd.len >= gmin_len && w.pwd.level >= gmin_level &&
+		    mkv_process(db, (char *)w.pwd.password))
 			return 1;
-		if ((pwd.len >= gmin_len) && (pwd.level >= gmin_level)) {
-			pass = (char *)pwd.password;
-#if HAVE_REXGEN
-			if (regex) {
-				if (do_regex_hybrid_crack(db, regex, pass,
-				                          regex_case, regex_alpha))
-					return 1;
-				mkv_hybrid_fix_state();
-			} else
-#endif
-			if (f_new) {
-				if (do_external_hybrid_crack(db, pass))
-					return 1;
-				mkv_hybrid_fix_state();
-			} else
-			if (options.mask) {
-				if (do_mask_crack(pass))
-					return 1;
-			} else
-			if (!f_filter ||
-			    ext_filter_body((char *)pwd.password, pass = pass_filtered))
-				if (crk_process_key(pass))
-					return 1;
-		}
 		gidx++;
-		i++;
-	}
+	} while (mkv_next(&w));
+
 	return 0;
 }
 
@@ -730,6 +748,14 @@ void do_markov_crack(struct db_main *db, char *mkv_param)
 	log_event("- Markov level: %d - %d", mkv_minlevel, mkv_level);
 	log_event("- Length: %d - %d", mkv_minlen, mkv_maxlen);
 	log_event("- Start-End: " LLd " - " LLd, mkv_start, mkv_end);
+#ifdef _OPENMP
+	mkv_par_keys = omp_get_max_threads() > 1 &&
+		cfg_get_bool(SECTION_OPTIONS, NULL, "MarkovParallelKeys", 1);
+	if (mkv_par_keys)
+		log_event("- Generating Markov keys on %d threads",
+		          omp_get_max_threads());
+#endif
+
 
 	show_pwd(db, mkv_start);
 
@@ -739,6 +765,11 @@ void do_markov_crack(struct db_main *db, char *mkv_param)
 	crk_done();
 	rec_done(event_abort);
 
+#ifdef _OPENMP
+	MEM_FREE(mkv_par_count);
+	MEM_FREE(mkv_par_pos);
+	MEM_FREE(mkv_par_buf);
+#endif
 	MEM_FREE(nbparts);
 	MEM_FREE(proba1);
 	MEM_FREE(proba2);
@@ -42,6 +42,7 @@ john_register_one(&fmt_NT2);
 #include "memory.h"
 #include "johnswap.h"
 #include "simd-intrinsics.h"
+#include "mask_ext.h"
 #include "memdbg.h"
 
 #define FORMAT_LABEL			"NT"
@@ -112,6 +113,9 @@ static char *source(char *source, void *binary)
 static unsigned char (*saved_key);
 static unsigned char (*crypt_key);
 static unsigned int (**buf_ptr);
+static int crypt_key_max;
+/* Mask mode's internal candidates, see crypt_int_cand() */
+static int int_pos[MASK_FMT_INT_PLHDR], num_int_pos, int_keys;
 #else
 static MD4_CTX ctx;
 static int saved_len;
@@ -184,6 +188,8 @@ static void init(struct fmt_main *self)
 	if (options.target_enc == UTF_8) {
 		/* This avoids an if clause for every set_key */
 		self->methods.set_key = set_key_utf8;
+		self->methods.set_keys = NULL;
+		self->methods.set_key_delta = NULL;
 #if SIMD_COEF_32
 		/* kick it up from 27. We will truncate in setkey_utf8() */
 		self->params.plaintext_length = 3 * PLAINTEXT_LENGTH;
@@ -200,6 +206,8 @@ static void init(struct fmt_main *self)
 		if (options.target_enc != ASCII && options.target_enc != ISO_8859_1) {
 			/* This avoids an if clause for every set_key */
 			self->methods.set_key = set_key_CP;
+			self->methods.set_keys = NULL;
+			self->methods.set_key_delta = NULL;
 		}
 		if (CP_to_Unicode[0xfc] == 0x00fc) {
 			tests[1].plaintext = "\xFC";	// German u-umlaut in UTF-8
@@ -221,6 +229,9 @@ static void init(struct fmt_main *self)
 	buf_ptr = mem_calloc(self->params.max_keys_per_crypt, sizeof(*buf_ptr));
 	for (i=0; i<self->params.max_keys_per_crypt; i++)
 		buf_ptr[i] = (unsigned int*)&saved_key[GETPOS(0, i)];
+	crypt_key_max = self->params.max_keys_per_crypt;
+	if (options.target_enc != UTF_8)
+		mask_int_cpu_init(100);
 #endif
 }
 
@@ -382,6 +393,52 @@ key_cleaning:
 #endif
 }
 
+#ifdef SIMD_COEF_32
+// ISO-8859-1 to UCS-2 like set_key(), but with the lengths known up front
+static void set_keys(char *_keys, int *lengths, int count)
+{
+	const unsigned char *keys = (unsigned char*)_keys;
+	int index;
+
+	for (index = 0; index < count; index++) {
+		unsigned int *keybuf_word = buf_ptr[index];
+		unsigned int len = lengths[index];
+		unsigned int last = keybuf_word[14*SIMD_COEF_32] >> 5;
+		unsigned int i;
+
+		if (len > PLAINTEXT_LENGTH)
+			len = PLAINTEXT_LENGTH;
+		for (i = 0; i < len >> 1; i++)
+			keybuf_word[i*SIMD_COEF_32] =
+				keys[2*i] | (keys[2*i + 1] << 16);
+		keybuf_word[i*SIMD_COEF_32] =
+			(len & 1) ? keys[2*i] | (0x80 << 16) : 0x80;
+		while (i++ < last)
+			keybuf_word[i*SIMD_COEF_32] = 0;
+		keybuf_word[14*SIMD_COEF_32] = len << 4;
+
+		keys += lengths[index] + 1;
+	}
+}
+
+// Patches just the changed characters, same length as before
+static void set_key_delta(char *_key, int index, int from, int to)
+{
+	const unsigned char *key = (unsigned char*)_key;
+	unsigned int *keybuf_word = buf_ptr[index];
+	int i;
+
+	if (to > PLAINTEXT_LENGTH)
+		to = PLAINTEXT_LENGTH;
+	for (i = from; i < to; i++) {
+		unsigned int *w = &keybuf_word[(i >> 1)*SIMD_COEF_32];
+		unsigned int shift = (i & 1) << 4;
+
+		*w = (*w & ~(0xffffU << shift)) | (key[i] << shift);
+	}
+}
+#endif
+
 // Legacy codepage to UCS-2, directly into vector key buffer
 static void set_key_CP(char *_key, int index)
 {
@@ -566,10 +623,15 @@ static char *get_key(int index)
 {
 #ifdef SIMD_COEF_32
 	// Get the key back from the key buffer, from UCS-2
-	unsigned int *keybuffer = (unsigned int*)&saved_key[GETPOS(0, index)];
+	unsigned int *keybuffer;
 	static UTF16 key[PLAINTEXT_LENGTH + 1];
 	unsigned int md4_size=0;
 	unsigned int i=0;
+	int int_index, int_cand = int_keys && mask_int_cand.int_cand;
+
+	if (int_cand)
+		index = mask_int_cpu_key(index, int_keys, &int_index);
+	keybuffer = (unsigned int*)&saved_key[GETPOS(0, index)];
 
 	for(; md4_size < PLAINTEXT_LENGTH; i += SIMD_COEF_32, md4_size++)
 	{
@@ -585,6 +647,16 @@ static char *get_key(int index)
 			break;
 		}
 	}
+
+	if (int_cand) {
+		unsigned int len = keybuffer[14*SIMD_COEF_32] >> 4;
+
+		for (i = 0; i < num_int_pos; i++)
+			if (int_pos[i] < len)
+				key[int_pos[i]] = CP_to_Unicode[
+					mask_int_cand.int_cand[int_index].x[i]];
+	}
+
 	return (char*)utf16_to_enc(key);
 #else
 	return (char*)utf16_to_enc(saved_key);
@@ -596,13 +668,81 @@ static char *get_key(int index)
 #define SSEi_REVERSE_STEPS 0
 #endif
 
+#ifdef SIMD_COEF_32
+static int cmp_one(void *binary, int index);
+
+/*
+ * Mask mode with internal candidates: each one is patched into the keys in
+ * place, and only the outputs possibly matching a loaded hash are kept (as
+ * our output indices).
+ */
+static int crypt_int_cand(int *pcount, struct db_salt *salt)
+{
+	const int count = *pcount;
+	const int num_int = mask_int_cand.num_int_cand;
+	int loops = (count + NBKEYS - 1) / NBKEYS;
+	int index;
+
+	mask_num_int_hits = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (index = 0; index < loops; index++) {
+		unsigned char *key = &saved_key[index*NBKEYS*64];
+		unsigned int *hash = (unsigned int*)&crypt_key[index*NBKEYS*DIGEST_SIZE];
+		unsigned int len[NBKEYS];
+		int i, j, t;
+
+		for (i = 0; i < NBKEYS; i++)
+			len[i] = ((unsigned int*)key)[14*SIMD_COEF_32 + (i&(SIMD_COEF_32-1)) + i/SIMD_COEF_32*16*SIMD_COEF_32] >> 4;
+
+		for (j = 0; j < num_int; j++) {
+			for (t = 0; t < num_int_pos; t++) {
+				UTF16 c = CP_to_Unicode[mask_int_cand.int_cand[j].x[t]];
+
+				for (i = 0; i < NBKEYS; i++)
+					if (int_pos[t] < len[i])
+						*(UTF16*)&key[GETPOS(2 * int_pos[t], i)] = c;
+			}
+
+			SIMDmd4body(key, hash, NULL, SSEi_REVERSE_STEPS | SSEi_MIXED_IN);
+
+			for (i = 0; i < NBKEYS && index * NBKEYS + i < count; i++)
+				if (mask_int_cpu_check(salt, index * NBKEYS + i, cmp_one))
+					mask_int_cpu_hit(index * NBKEYS + i, j, hash[(i&(SIMD_COEF_32-1)) + i/SIMD_COEF_32*SIMD_COEF_32*4 + SIMD_COEF_32]);
+		}
+	}
+
+	if (mask_num_int_hits > crypt_key_max) {
+		MEM_FREE(crypt_key);
+		crypt_key_max = (mask_num_int_hits + NBKEYS - 1) / NBKEYS * NBKEYS;
+		crypt_key = mem_calloc_align(DIGEST_SIZE * crypt_key_max,
+		                             sizeof(*crypt_key), MEM_ALIGN_SIMD);
+	}
+	for (index = 0; index < mask_num_int_hits; index++)
+		((unsigned int*)crypt_key)[(index&(SIMD_COEF_32-1)) + (unsigned int)index/SIMD_COEF_32*SIMD_COEF_32*4 + SIMD_COEF_32] = mask_int_hits[index].hash;
+
+	int_keys = count;
+	*pcount = count * num_int;
+
+	return mask_num_int_hits;
+}
+#endif
+
 static int crypt_all(int *pcount, struct db_salt *salt)
 {
 #ifdef SIMD_COEF_32
 	int i = 0;
 #ifdef _OPENMP
 	const unsigned int count = (*pcount + NBKEYS - 1) / NBKEYS;
+#endif
 
+	int_keys = 0;
+	if (salt && (num_int_pos = mask_int_cpu_pos(int_pos)))
+		return crypt_int_cand(pcount, salt);
+
+#ifdef _OPENMP
 #pragma omp parallel for
 	for (i = 0; i < count; i++)
 #endif
@@ -759,7 +899,14 @@ struct fmt_main fmt_NT2 = {
 		},
 		cmp_all,
 		cmp_one,
-		cmp_exact
+		cmp_exact,
+#ifdef SIMD_COEF_32
+		set_keys,
+		set_key_delta
+#else
+		NULL,
+		NULL
+#endif
 	}
 };
 
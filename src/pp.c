@@ -110,6 +110,10 @@
 #include <unistd.h>
 #endif
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "arch.h"
 #include "jumbo.h"
 #include "misc.h"
@@ -712,6 +716,28 @@ static void chain_set_pwbuf_increment (const chain_t *chain_buf, const db_entry_
   }
 }
 
+static void chain_set_ks_poses_add (const chain_t *chain_buf, const db_entry_t *db_entries, u64 cur_chain_ks_poses[OUT_LEN_MAX], u64 add)
+{
+  const u8 *buf = chain_buf->buf;
+
+  const int cnt = chain_buf->cnt;
+
+  for (int idx = 0; idx < cnt && add; idx++)
+  {
+    const u8 db_key = buf[idx];
+
+    const db_entry_t *db_entry = &db_entries[db_key];
+
+    const u64 elems_cnt = db_entry->elems_cnt;
+
+    add += cur_chain_ks_poses[idx];
+
+    cur_chain_ks_poses[idx] = add % elems_cnt;
+
+    add /= elems_cnt;
+  }
+}
+
 static void chain_gen_with_idx (chain_t *chain_buf, const int len1, const int chains_idx)
 {
   chain_buf->cnt = 0;
@@ -848,6 +874,11 @@ static mpz_t hybrid_rec_pos;
 static int rec_pos_destroyed;
 static int rule_count;
 static struct list_main *rule_list;
+#ifdef _OPENMP
+#define PP_BATCH_PER_THREAD 0x1000
+static int pp_par_keys;
+static char *pp_par_buf;
+#endif
 
 static void save_state(FILE *file)
 {
@@ -962,6 +993,75 @@ static MAYBE_INLINE char *mgets(int *len)
   return pos;
 }
 
+#ifdef _OPENMP
+/*
+ * Produces iter_cnt candidates from the chain's current position, in batches
+ * where each OpenMP thread fills in its own contiguous part of the buffer,
+ * then feeds them to the cracker in order.  Leaves cur_chain_ks_poses just
+ * like the serial loop would.
+ */
+static int pp_par_crack(const chain_t *chain_buf, const db_entry_t *db_entries, u64 cur_chain_ks_poses[OUT_LEN_MAX], const int pw_len, u64 iter_cnt)
+{
+  const int threads = omp_get_max_threads();
+  const int stride = pw_len + 1;
+
+  char key_e[PLAINTEXT_BUFFER_SIZE];
+
+  if (!pp_par_buf)
+    pp_par_buf = mem_alloc((size_t)PP_BATCH_PER_THREAD * threads * (OUT_LEN_MAX + 1));
+
+  while (iter_cnt)
+  {
+    const int count = MIN(iter_cnt, (u64)PP_BATCH_PER_THREAD * threads);
+    const int per = (count + threads - 1) / threads;
+
+    int t;
+
+#pragma omp parallel for
+    for (t = 0; t < threads; t++)
+    {
+      const int first = t * per;
+      const int last = MIN(first + per, count);
+
+      u64 poses[OUT_LEN_MAX];
+      char pw_buf[OUT_LEN_MAX + 1];
+
+      if (first >= last) continue;
+
+      memcpy (poses, cur_chain_ks_poses, sizeof (poses));
+
+      chain_set_ks_poses_add (chain_buf, db_entries, poses, first);
+
+      chain_set_pwbuf_init (chain_buf, db_entries, poses, pw_buf);
+
+      pw_buf[pw_len] = '\0';
+
+      for (int idx = first; idx < last; idx++)
+      {
+        memcpy (&pp_par_buf[idx * stride], pw_buf, stride);
+
+        chain_set_pwbuf_increment (chain_buf, db_entries, poses, pw_buf);
+      }
+    }
+
+    for (int idx = 0; idx < count; idx++)
+    {
+      char *key_i = &pp_par_buf[idx * stride], *key = key_i;
+
+      if (!f_filter || ext_filter_body(key_i, key = key_e))
+        if (crk_process_key(key))
+          return 1;
+    }
+
+    chain_set_ks_poses_add (chain_buf, db_entries, cur_chain_ks_poses, count);
+
+    iter_cnt -= count;
+  }
+
+  return 0;
+}
+#endif
+
 void do_prince_crack(struct db_main *db, char *wordlist, int rules)
 #endif
 {
@@ -2143,6 +2243,18 @@ void do_prince_crack(struct db_main *db, char *wordlist, int rules)
     log_event("- Limit %s", l_msg);
   }
 
+#ifdef _OPENMP
+  pp_par_keys = omp_get_max_threads() > 1 && !rules &&
+#if HAVE_REXGEN
+    !regex &&
+#endif
+    !f_new && !options.mask &&
+    cfg_get_bool(SECTION_OPTIONS, NULL, "PrinceParallelKeys", 1);
+
+  if (pp_par_keys)
+    log_event("- Generating PRINCE keys on %d threads", omp_get_max_threads());
+#endif
+
   log_event("Starting candidate generation");
 
   int jtr_done = 0;
@@ -2232,6 +2344,15 @@ void do_prince_crack(struct db_main *db, char *wordlist, int rules)
 
           const u64 iter_pos_save = iter_max_u64 - iter_pos_u64;
 
+#if defined(JTR_MODE) && defined(_OPENMP)
+          if (pp_par_keys && iter_pos_save >= PP_BATCH_PER_THREAD)
+          {
+            jtr_done = pp_par_crack (chain_buf, db_entries, db_entry->cur_chain_ks_poses, pw_len, iter_pos_save);
+
+            iter_pos_u64 = iter_max_u64;
+          }
+#endif
+
           while (iter_pos_u64 < iter_max_u64)
           {
 #ifndef JTR_MODE
@@ -2424,6 +2545,9 @@ void do_prince_crack(struct db_main *db, char *wordlist, int rules)
   crk_done();
   rec_done(event_abort || (status.pass && db->salts));
 
+#ifdef _OPENMP
+  MEM_FREE(pp_par_buf);
+#endif
   mpf_clear(count);
   rec_pos_destroyed = 1;
   mpz_clear(rec_pos);
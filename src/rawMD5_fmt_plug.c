@@ -23,6 +23,7 @@ john_register_one(&fmt_rawMD5);
 #include "johnswap.h"
 #include "formats.h"
 #include "base64_convert.h"
+#include "mask_ext.h"
 
 #if !FAST_FORMATS_OMP
 #undef _OPENMP
@@ -108,6 +109,9 @@ static struct fmt_tests tests[] = {
 #ifdef SIMD_COEF_32
 static ARCH_WORD_32 (*saved_key)[MD5_BUF_SIZ*NBKEYS];
 static ARCH_WORD_32 (*crypt_key)[DIGEST_SIZE/4*NBKEYS];
+static int crypt_key_max;
+/* Mask mode's internal candidates, see crypt_int_cand() */
+static int int_pos[MASK_FMT_INT_PLHDR], num_int_pos, int_keys;
 #else
 static int (*saved_len);
 static char (*saved_key)[PLAINTEXT_LENGTH + 1];
@@ -136,6 +140,8 @@ static void init(struct fmt_main *self)
 	                             sizeof(*saved_key), MEM_ALIGN_SIMD);
 	crypt_key = mem_calloc_align(self->params.max_keys_per_crypt/NBKEYS,
 	                             sizeof(*crypt_key), MEM_ALIGN_SIMD);
+	crypt_key_max = self->params.max_keys_per_crypt;
+	mask_int_cpu_init(100);
 #endif
 }
 
@@ -315,6 +321,61 @@ key_cleaning:
 	}
 	keybuffer[14*SIMD_COEF_32] = len << 3;
 }
+
+/*
+ * With the lengths known, whole words are copied without looking for the NUL.
+ * The previous key's length (still in the buffer) tells how many stale words
+ * need clearing.
+ */
+static void set_keys(char *keys, int *lengths, int count)
+{
+	int index;
+
+	for (index = 0; index < count; index++) {
+		ARCH_WORD_32 *keybuffer = &((ARCH_WORD_32*)saved_key)[(index&(SIMD_COEF_32-1)) + (unsigned int)index/SIMD_COEF_32*MD5_BUF_SIZ*SIMD_COEF_32];
+		unsigned int len = lengths[index];
+		unsigned int last = keybuffer[14*SIMD_COEF_32] >> 5;
+		unsigned int tail;
+		unsigned int i;
+		ARCH_WORD_32 temp;
+
+		if (len > PLAINTEXT_LENGTH)
+			len = PLAINTEXT_LENGTH;
+		tail = (len & 3) << 3;
+		for (i = 0; i < len >> 2; i++) {
+			memcpy(&temp, &keys[i << 2], 4);
+			keybuffer[i*SIMD_COEF_32] = temp;
+		}
+		memcpy(&temp, &keys[i << 2], 4);
+		keybuffer[i*SIMD_COEF_32] =
+			(temp & ((1U << tail) - 1)) | (0x80U << tail);
+		while (i++ < last)
+			keybuffer[i*SIMD_COEF_32] = 0;
+		keybuffer[14*SIMD_COEF_32] = len << 3;
+
+		keys += lengths[index] + 1;
+	}
+}
+
+/*
+ * Only the changed bytes are patched into their words, the length, padding
+ * and the rest of the key being the same as before.
+ */
+static void set_key_delta(char *key, int index, int from, int to)
+{
+	ARCH_WORD_32 *keybuffer = &((ARCH_WORD_32*)saved_key)[(index&(SIMD_COEF_32-1)) + (unsigned int)index/SIMD_COEF_32*MD5_BUF_SIZ*SIMD_COEF_32];
+	int i;
+
+	if (to > PLAINTEXT_LENGTH)
+		to = PLAINTEXT_LENGTH;
+	for (i = from; i < to; i++) {
+		ARCH_WORD_32 *w = &keybuffer[(i >> 2)*SIMD_COEF_32];
+		unsigned int shift = (i & 3) << 3;
+
+		*w = (*w & ~(0xffU << shift)) |
+			((ARCH_WORD_32)(unsigned char)key[i] << shift);
+	}
+}
 #else
 static void set_key(char *key, int index)
 {
@@ -322,6 +383,29 @@ static void set_key(char *key, int index)
 	saved_len[index] = len;
 	memcpy(saved_key[index], key, len);
 }
+
+static void set_keys(char *keys, int *lengths, int count)
+{
+	int index;
+
+	for (index = 0; index < count; index++) {
+		int len = lengths[index];
+
+		if (len > PLAINTEXT_LENGTH)
+			len = PLAINTEXT_LENGTH;
+		saved_len[index] = len;
+		memcpy(saved_key[index], keys, len);
+		keys += lengths[index] + 1;
+	}
+}
+
+static void set_key_delta(char *key, int index, int from, int to)
+{
+	if (to > PLAINTEXT_LENGTH)
+		to = PLAINTEXT_LENGTH;
+	if (from < to)
+		memcpy(saved_key[index] + from, key + from, to - from);
+}
 #endif
 
 #ifdef SIMD_COEF_32
@@ -329,11 +413,23 @@ static char *get_key(int index)
 {
 	static char out[PLAINTEXT_LENGTH + 1];
 	unsigned int i;
-	ARCH_WORD_32 len = ((ARCH_WORD_32*)saved_key)[14*SIMD_COEF_32 + (index&(SIMD_COEF_32-1)) + (unsigned int)index/SIMD_COEF_32*MD5_BUF_SIZ*SIMD_COEF_32] >> 3;
+	int int_index, int_cand = int_keys && mask_int_cand.int_cand;
+	ARCH_WORD_32 len;
+
+	if (int_cand)
+		index = mask_int_cpu_key(index, int_keys, &int_index);
+
+	len = ((ARCH_WORD_32*)saved_key)[14*SIMD_COEF_32 + (index&(SIMD_COEF_32-1)) + (unsigned int)index/SIMD_COEF_32*MD5_BUF_SIZ*SIMD_COEF_32] >> 3;
 
 	for(i=0;i<len;i++)
 		out[i] = ((char*)saved_key)[GETPOS(i, index)];
 	out[i] = 0;
+
+	if (int_cand)
+	for (i = 0; i < num_int_pos; i++)
+		if (int_pos[i] < len)
+			out[int_pos[i]] = mask_int_cand.int_cand[int_index].x[i];
+
 	return (char*)out;
 }
 #else
@@ -349,6 +445,68 @@ static char *get_key(int index)
 #define SSEi_REVERSE_STEPS 0
 #endif
 
+#ifdef SIMD_COEF_32
+static int cmp_one(void *binary, int index);
+
+/*
+ * Mask mode with internal candidates: each one is patched into the keys in
+ * place, and only the outputs possibly matching a loaded hash are kept (as
+ * our output indices).
+ */
+static int crypt_int_cand(int *pcount, struct db_salt *salt)
+{
+	const int count = *pcount;
+	const int num_int = mask_int_cand.num_int_cand;
+	int loops = (count + NBKEYS - 1) / NBKEYS;
+	int index;
+
+	mask_num_int_hits = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+	for (index = 0; index < loops; index++) {
+		unsigned char *key = (unsigned char*)saved_key[index];
+		ARCH_WORD_32 *hash = crypt_key[index];
+		unsigned int len[NBKEYS];
+		int i, j, t;
+
+		for (i = 0; i < NBKEYS; i++)
+			len[i] = saved_key[index][14*SIMD_COEF_32 + (i&(SIMD_COEF_32-1)) + i/SIMD_COEF_32*MD5_BUF_SIZ*SIMD_COEF_32] >> 3;
+
+		for (j = 0; j < num_int; j++) {
+			for (t = 0; t < num_int_pos; t++) {
+				unsigned char c = mask_int_cand.int_cand[j].x[t];
+
+				for (i = 0; i < NBKEYS; i++)
+					if (int_pos[t] < len[i])
+						key[GETPOS(int_pos[t], i)] = c;
+			}
+
+			SIMDmd5body(saved_key[index], hash, NULL, SSEi_REVERSE_STEPS | SSEi_MIXED_IN);
+
+			for (i = 0; i < NBKEYS && index * NBKEYS + i < count; i++)
+				if (mask_int_cpu_check(salt, index * NBKEYS + i, cmp_one))
+					mask_int_cpu_hit(index * NBKEYS + i, j, hash[(i&(SIMD_COEF_32-1)) + i/SIMD_COEF_32*SIMD_COEF_32*4]);
+		}
+	}
+
+	if (mask_num_int_hits > crypt_key_max) {
+		MEM_FREE(crypt_key);
+		crypt_key_max = (mask_num_int_hits + NBKEYS - 1) / NBKEYS * NBKEYS;
+		crypt_key = mem_calloc_align(crypt_key_max/NBKEYS,
+		                             sizeof(*crypt_key), MEM_ALIGN_SIMD);
+	}
+	for (index = 0; index < mask_num_int_hits; index++)
+		((ARCH_WORD_32*)crypt_key)[(index&(SIMD_COEF_32-1)) + (unsigned int)index/SIMD_COEF_32*SIMD_COEF_32*4] = mask_int_hits[index].hash;
+
+	int_keys = count;
+	*pcount = count * num_int;
+
+	return mask_num_int_hits;
+}
+#endif
+
 static int crypt_all(int *pcount, struct db_salt *salt)
 {
 	const int count = *pcount;
@@ -356,6 +514,12 @@ static int crypt_all(int *pcount, struct db_salt *salt)
 
 	int loops = (count + MAX_KEYS_PER_CRYPT - 1) / MAX_KEYS_PER_CRYPT;
 
+#ifdef SIMD_COEF_32
+	int_keys = 0;
+	if (salt && (num_int_pos = mask_int_cpu_pos(int_pos)))
+		return crypt_int_cand(pcount, salt);
+#endif
+
 #ifdef _OPENMP
 #pragma omp parallel for
 #endif
@@ -509,7 +673,9 @@ struct fmt_main fmt_rawMD5 = {
 		},
 		cmp_all,
 		cmp_one,
-		cmp_exact
+		cmp_exact,
+		set_keys,
+		set_key_delta
 	}
 };
 
@@ -103,6 +103,14 @@ static struct {
 	char *classes[0x100];
 } CC_CACHE_ALIGN rules_data;
 
+/*
+ * Each thread running rules_apply_batch() gets its own copy of the above,
+ * as well as of the compiled rule below.
+ */
+#ifdef _OPENMP
+#pragma omp threadprivate(rules_data)
+#endif
+
 #define rules_pass rules_data.pass
 #define rules_classes rules_data.classes
 #define rules_vars rules_data.vars
@@ -1136,11 +1144,597 @@ static void rules_init_length(int max_length)
 	rules_vars['z'] = INFINITE_LENGTH;
 }
 
+/*
+ * Final length checks, conversion back to the target encoding, and comparison
+ * against the previous candidate; shared by the interpreter and by compiled
+ * rules.
+ */
+static MAYBE_INLINE char *rules_output(char *in, int length, char *last)
+{
+	in[rules_max_length] = 0;
+	if (minlength)
+		if (length < minlength)
+			return NULL;
+	/* --maxlength will skip, not truncate */
+	if (maxlength)
+		if (length > maxlength)
+			return NULL;
+	if (!(options.flags & FLG_MASK_STACKED) &&
+	    options.internal_cp != UTF_8 && options.target_enc == UTF_8) {
+		char out[PLAINTEXT_BUFFER_SIZE + 1];
+
+		strcpy(in, cp_to_utf8_r(in, out, rules_max_length));
+		length = strlen(in);
+	}
+
+	if (last) {
+		if (length > rules_max_length)
+			length = rules_max_length;
+		if (length >= ARCH_SIZE - 1) {
+			if (*(ARCH_WORD *)in != *(ARCH_WORD *)last)
+				return in;
+			if (strcmp(&in[ARCH_SIZE - 1], &last[ARCH_SIZE - 1]))
+				return in;
+			return NULL;
+		}
+		if (last[length])
+			return in;
+		if (memcmp(in, last, length))
+			return in;
+		return NULL;
+	}
+	return in;
+}
+
+/*
+ * Precompiled rules.  rules_apply() is called with the same rule for every
+ * word in a wordlist, so rather than decoding the rule string again for each
+ * word we decode it once into an array of ops with their operands (positions,
+ * counts, characters) already resolved.  Only the commands below are handled
+ * this way; any rule using something else (character classes, variables,
+ * memory, "single crack" mode commands, etc.) is left to the interpreter.
+ * Each op mirrors its case in rules_apply() exactly, including how runs of
+ * "$", "^", "[", "]", "{" and "}" are grouped, so that the output is the same.
+ */
+#define RULES_PROG_SIZE			(RULE_BUFFER_SIZE / 2)
+
+enum {
+	ROP_LOWER, ROP_UPPER, ROP_CAPITALIZE, ROP_NCAPITALIZE, ROP_TOGGLE,
+	ROP_SHIFT, ROP_REVERSE, ROP_DUPLICATE, ROP_REFLECT,
+	ROP_APPEND, ROP_PREPEND, ROP_DEL_FIRST, ROP_DEL_LAST,
+	ROP_ROT_LEFT, ROP_ROT_RIGHT, ROP_SWAP_FIRST, ROP_SWAP_LAST,
+	ROP_LEN_EQ, ROP_LEN_LT, ROP_LEN_GT,
+	ROP_TOGGLE_AT, ROP_DELETE_AT, ROP_EXTRACT,
+	ROP_INSERT, ROP_OVERSTRIKE, ROP_REPLACE, ROP_PURGE
+};
+
+struct rules_op {
+	unsigned char op, a, b, c;
+	int count;
+};
+
+static struct {
+	char *rule;
+	int hc_logic;
+	int count;		/* 0 if the rule isn't compiled */
+	struct rules_op ops[RULES_PROG_SIZE];
+} rules_prog;
+
+#ifdef _OPENMP
+#pragma omp threadprivate(rules_prog)
+#endif
+
+/*
+ * Position codes are only resolved at compile time when they are constants;
+ * the length variables and "*", "-", "+" are left to the interpreter.
+ */
+#define CPOSITION(pos) { \
+	char code = RULE; \
+	if (!((code >= '0' && code <= '9') || (code >= 'A' && code <= 'Z'))) \
+		return 0; \
+	(pos) = rules_vars[ARCH_INDEX(code)]; \
+}
+
+#define CVALUE(value) { \
+	if (!((value) = RULE)) return 0; \
+}
+
+#define CRUN(c, n) { \
+	(n) = 1; \
+	while (NEXT == (c)) { \
+		(void)RULE; \
+		(n)++; \
+	} \
+}
+
+static int rules_compile(char *rule)
+{
+	struct rules_op *op = rules_prog.ops;
+
+	while (RULE) {
+		if (op >= &rules_prog.ops[RULES_PROG_SIZE])
+			return 0;
+
+		switch (LAST) {
+		case ':':
+		case ' ':
+		case '\t':
+			continue;
+
+		case 'l':
+			op->op = ROP_LOWER;
+			break;
+
+		case 'u':
+			op->op = ROP_UPPER;
+			break;
+
+		case 'c':
+			op->op = ROP_CAPITALIZE;
+			break;
+
+		case 'C':
+			op->op = ROP_NCAPITALIZE;
+			break;
+
+		case 't':
+			op->op = ROP_TOGGLE;
+			break;
+
+		case 'S':
+			op->op = ROP_SHIFT;
+			break;
+
+		case 'r':
+			op->op = ROP_REVERSE;
+			break;
+
+		case 'd':
+			op->op = ROP_DUPLICATE;
+			break;
+
+		case 'f':
+			op->op = ROP_REFLECT;
+			break;
+
+		case 'k':
+			op->op = ROP_SWAP_FIRST;
+			break;
+
+		case 'K':
+			op->op = ROP_SWAP_LAST;
+			break;
+
+		case '$':
+			op->op = ROP_APPEND;
+			op->count = 1;
+			CVALUE(op->a)
+			if (NEXT == '$') {
+				(void)RULE;
+				op->count++;
+				CVALUE(op->b)
+				if (NEXT == '$') {
+					(void)RULE;
+					op->count++;
+					CVALUE(op->c)
+				}
+			}
+			break;
+
+		case '^':
+			op->op = ROP_PREPEND;
+			op->count = 1;
+			CVALUE(op->a)
+			if (NEXT == '^') {
+				(void)RULE;
+				op->count++;
+				CVALUE(op->b)
+				if (NEXT == '^') {
+					(void)RULE;
+					op->count++;
+					CVALUE(op->c)
+				}
+			}
+			break;
+
+		case '[':
+			op->op = ROP_DEL_FIRST;
+			CRUN('[', op->count)
+			break;
+
+		case ']':
+			op->op = ROP_DEL_LAST;
+			CRUN(']', op->count)
+			break;
+
+		case '{':
+			op->op = ROP_ROT_LEFT;
+			CRUN('{', op->count)
+			break;
+
+		case '}':
+			op->op = ROP_ROT_RIGHT;
+			CRUN('}', op->count)
+			break;
+
+		case '_':
+			op->op = ROP_LEN_EQ;
+			CPOSITION(op->a)
+			break;
+
+		case '<':
+			op->op = ROP_LEN_LT;
+			CPOSITION(op->a)
+			break;
+
+		case '>':
+			op->op = ROP_LEN_GT;
+			CPOSITION(op->a)
+			break;
+
+		case 'T':
+			op->op = ROP_TOGGLE_AT;
+			CPOSITION(op->a)
+			break;
+
+		case 'D':
+			op->op = ROP_DELETE_AT;
+			CPOSITION(op->a)
+			break;
+
+		case 'x':
+			if (hc_logic)
+				return 0;
+			op->op = ROP_EXTRACT;
+			CPOSITION(op->a)
+			CPOSITION(op->b)
+			break;
+
+		case 'i':
+			if (hc_logic)
+				return 0;
+			op->op = ROP_INSERT;
+			CPOSITION(op->a)
+			CVALUE(op->b)
+			break;
+
+		case 'o':
+			op->op = ROP_OVERSTRIKE;
+			CPOSITION(op->a)
+			CVALUE(op->b)
+			break;
+
+		case 's':
+			op->op = ROP_REPLACE;
+			CVALUE(op->a)
+			if (op->a == '?' && !hc_logic)
+				return 0;
+			CVALUE(op->b)
+			break;
+
+		case '@':
+			op->op = ROP_PURGE;
+			CVALUE(op->a)
+			if (op->a == '?' && !hc_logic)
+				return 0;
+			break;
+
+		default:
+			return 0;
+		}
+
+		op++;
+	}
+
+	return op - rules_prog.ops;
+}
+
+#undef CPOSITION
+#undef CVALUE
+#undef CRUN
+
+/*
+ * Returns the compiled form of rule, or NULL if it has to be interpreted.
+ * The cache is keyed on the rule pointer alone, so that a hit costs next to
+ * nothing; rules_reject() is the only place that reuses a rule buffer for a
+ * different rule, and it drops the cached program when it does.
+ */
+static struct rules_op *rules_get_prog(char *rule, int *count)
+{
+	if (rule != rules_prog.rule || hc_logic != rules_prog.hc_logic) {
+		rules_prog.rule = rule;
+		rules_prog.hc_logic = hc_logic;
+		rules_prog.count = rules_compile(rule);
+	}
+
+	*count = rules_prog.count;
+	return rules_prog.count ? rules_prog.ops : NULL;
+}
+
+/*
+ * rules_apply() for a compiled rule.
+ */
+static char *rules_apply_prog(char *word_in, struct rules_op *op, int count,
+	char *last)
+{
+	char cpword[PLAINTEXT_BUFFER_SIZE + 1];
+	struct rules_op *end = op + count;
+	char *word, *in, *alt;
+	int length;
+
+	if (options.internal_cp != UTF_8 && options.target_enc == UTF_8)
+		word = utf8_to_cp_r(word_in, cpword, PLAINTEXT_BUFFER_SIZE);
+	else
+		word = word_in;
+
+	in = buffer[0];
+	if (in == last)
+		in = buffer[2];
+
+	length = 0;
+	while (length < RULE_WORD_SIZE - 1) {
+		if (!(in[length] = word[length]))
+			break;
+		length++;
+	}
+
+	if (!length)
+		return NULL;
+
+	alt = buffer[1];
+	if (alt == last)
+		alt = buffer[2];
+
+	do {
+		in[RULE_WORD_SIZE - 1] = 0;
+
+		switch (op->op) {
+		case ROP_LOWER:
+			CONV(conv_tolower)
+			break;
+
+		case ROP_UPPER:
+			CONV(conv_toupper)
+			break;
+
+		case ROP_CAPITALIZE:
+			{
+				int pos = 0;
+				if ((in[0] = conv_toupper[ARCH_INDEX(in[0])]))
+				while (in[++pos])
+					in[pos] =
+					    conv_tolower[ARCH_INDEX(in[pos])];
+				in[pos] = 0;
+			}
+			break;
+
+		case ROP_NCAPITALIZE:
+			{
+				int pos = 0;
+				if ((in[0] = conv_tolower[ARCH_INDEX(in[0])]))
+				while (in[++pos])
+					in[pos] =
+					    conv_toupper[ARCH_INDEX(in[pos])];
+				in[pos] = 0;
+			}
+			break;
+
+		case ROP_TOGGLE:
+			CONV(conv_invert)
+			break;
+
+		case ROP_SHIFT:
+			CONV(conv_shift)
+			break;
+
+		case ROP_REVERSE:
+			{
+				char *out;
+				GET_OUT
+				*(out += length) = 0;
+				while (*in)
+					*--out = *in++;
+				in = out;
+			}
+			break;
+
+		case ROP_DUPLICATE:
+			memcpy(in + length, in, length);
+			in[length <<= 1] = 0;
+			break;
+
+		case ROP_REFLECT:
+			{
+				int pos;
+				char *p = in;
+				in[pos = (length <<= 1)] = 0;
+				while (*p)
+					in[--pos] = *p++;
+			}
+			break;
+
+		case ROP_APPEND:
+			in[length++] = op->a;
+			if (op->count > 1) {
+				in[length++] = op->b;
+				if (op->count > 2)
+					in[length++] = op->c;
+			}
+			in[length] = 0;
+			break;
+
+		case ROP_PREPEND:
+			{
+				char *out;
+				GET_OUT
+				switch (op->count) {
+				case 1:
+					out[0] = op->a;
+					break;
+				case 2:
+					out[0] = op->b;
+					out[1] = op->a;
+					break;
+				default:
+					out[0] = op->c;
+					out[1] = op->b;
+					out[2] = op->a;
+				}
+				memcpy(&out[op->count], in, length + 1);
+				length += op->count;
+				in = out;
+			}
+			break;
+
+		case ROP_DEL_FIRST:
+			if ((length -= op->count) > 0) {
+				char *out;
+				GET_OUT
+				memcpy(out, &in[op->count], length + 1);
+				in = out;
+				break;
+			}
+			in[length = 0] = 0;
+			break;
+
+		case ROP_DEL_LAST:
+			if ((length -= op->count) < 0)
+				length = 0;
+			in[length] = 0;
+			break;
+
+		case ROP_ROT_LEFT:
+			{
+				char *out;
+				int count = op->count;
+				while (count >= length)
+					count -= length;
+				if (!count)
+					break;
+				GET_OUT
+				memcpy(out, &in[count], length - count);
+				memcpy(&out[length - count], in, count);
+				out[length] = 0;
+				in = out;
+			}
+			break;
+
+		case ROP_ROT_RIGHT:
+			{
+				char *out;
+				int pos, count = op->count;
+				while (count >= length)
+					count -= length;
+				if (!count)
+					break;
+				GET_OUT
+				memcpy(out, &in[pos = length - count],
+				    count);
+				memcpy(&out[count], in, pos);
+				out[length] = 0;
+				in = out;
+			}
+			break;
+
+		case ROP_SWAP_FIRST:
+			if (length > 1)
+				SWAP2(0,1)
+			break;
+
+		case ROP_SWAP_LAST:
+			if (length > 1)
+				SWAP2((unsigned)length-1,
+				    (unsigned)length-2)
+			break;
+
+		case ROP_LEN_EQ:
+			if (length != op->a)
+				return NULL;
+			break;
+
+		case ROP_LEN_LT:
+			if (length >= op->a)
+				return NULL;
+			break;
+
+		case ROP_LEN_GT:
+			if (length <= op->a)
+				return NULL;
+			break;
+
+		case ROP_TOGGLE_AT:
+			in[op->a] = conv_invert[ARCH_INDEX(in[op->a])];
+			break;
+
+		case ROP_DELETE_AT:
+			if (op->a < length) {
+				memmove(&in[op->a], &in[op->a + 1],
+				    length - op->a);
+				length--;
+			}
+			break;
+
+		case ROP_EXTRACT:
+			if (op->a < length) {
+				char *out;
+				GET_OUT
+				in += op->a;
+				strnzcpy(out, in, op->b + 1);
+				length = strlen(in = out);
+				break;
+			}
+			in[length = 0] = 0;
+			break;
+
+		case ROP_INSERT:
+			if (op->a < length) {
+				char *p = in + op->a;
+				memmove(p + 1, p, length++ - op->a);
+				*p = op->b;
+			} else
+				in[length++] = op->b;
+			in[length] = 0;
+			break;
+
+		case ROP_OVERSTRIKE:
+			if (op->a < length)
+				in[op->a] = op->b;
+			break;
+
+		case ROP_REPLACE:
+			{
+				int pos;
+				for (pos = 0; in[pos]; pos++)
+				if (in[pos] == (char)op->a)
+					in[pos] = op->b;
+			}
+			break;
+
+		case ROP_PURGE:
+			{
+				int pos;
+				length = 0;
+				for (pos = 0; in[pos]; pos++)
+				if (in[pos] != (char)op->a)
+					in[length++] = in[pos];
+				in[length] = 0;
+			}
+			break;
+		}
+
+		if (!length)
+			return NULL;
+	} while (++op < end);
+
+	return rules_output(in, length, last);
+}
+
 void rules_init(int max_length)
 {
 	rules_pass = 0;
 	rules_errno = RULES_ERROR_NONE;
 	hc_logic = 0;
+	rules_prog.rule = NULL;
 
 	if (max_length > RULE_WORD_SIZE - 1)
 		max_length = RULE_WORD_SIZE - 1;
@@ -1319,11 +1913,12 @@ accept:
 	strnzcpy(out_rule, rule - 1, sizeof(out_rule));
 	rules_apply("", out_rule, split, last);
 	rules_pass++;
+	rules_prog.rule = NULL;
 
 	return out_rule;
 }
 
-char *rules_apply(char *word_in, char *rule, int split, char *last)
+static char *rules_interpret(char *word_in, char *rule, int split, char *last)
 {
 	char cpword[PLAINTEXT_BUFFER_SIZE + 1];
 	char *word;
@@ -2249,39 +2844,7 @@ char *rules_apply(char *word_in, char *rule, int split, char *last)
 		goto out_which;
 
 out_OK:
-	in[rules_max_length] = 0;
-	if (minlength)
-		if (length < minlength)
-			return NULL;
-	/* --maxlength will skip, not truncate */
-	if (maxlength)
-		if (length > maxlength)
-			return NULL;
-	if (!(options.flags & FLG_MASK_STACKED) &&
-	    options.internal_cp != UTF_8 && options.target_enc == UTF_8) {
-		char out[PLAINTEXT_BUFFER_SIZE + 1];
-
-		strcpy(in, cp_to_utf8_r(in, out, rules_max_length));
-		length = strlen(in);
-	}
-
-	if (last) {
-		if (length > rules_max_length)
-			length = rules_max_length;
-		if (length >= ARCH_SIZE - 1) {
-			if (*(ARCH_WORD *)in != *(ARCH_WORD *)last)
-				return in;
-			if (strcmp(&in[ARCH_SIZE - 1], &last[ARCH_SIZE - 1]))
-				return in;
-			return NULL;
-		}
-		if (last[length])
-			return in;
-		if (memcmp(in, last, length))
-			return in;
-		return NULL;
-	}
-	return in;
+	return rules_output(in, length, last);
 
 out_which:
 	if (which == 1) {
@@ -2317,6 +2880,42 @@ out_ERROR_UNALLOWED:
 	goto out_NULL;
 }
 
+char *rules_apply(char *word_in, char *rule, int split, char *last)
+{
+	struct rules_op *prog;
+	int count;
+
+	if (!rules_pass && (prog = rules_get_prog(rule, &count)))
+		return rules_apply_prog(word_in, prog, count, last);
+
+	return rules_interpret(word_in, rule, split, last);
+}
+
+void rules_apply_batch(char **words, int count, char *rule, char *out)
+{
+	int i;
+
+/* Compile the rule here once, so that the threads get it with their copyin */
+	if (!rules_pass) {
+		int n;
+		(void)rules_get_prog(rule, &n);
+	}
+
+#ifdef _OPENMP
+#pragma omp parallel for default(none) private(i) \
+	shared(words, count, rule, out) copyin(rules_data, rules_prog)
+#endif
+	for (i = 0; i < count; i++) {
+		char *word = rules_apply(words[i], rule, -1, NULL);
+
+		if (word)
+			words[i] = strcpy(&out[i * (PLAINTEXT_BUFFER_SIZE + 1)],
+			                  word);
+		else
+			words[i] = NULL;
+	}
+}
+
 /*
  * This function is currently not used outside of rules.c, thus not exported.
  *
@@ -48,6 +48,16 @@ extern char *rules_reject(char *rule, int split, char *last,
  */
 extern char *rules_apply(char *word, char *rule, int split, char *last);
 
+/*
+ * Applies a wordlist mode rule (split < 0) to count words at once, using all
+ * OpenMP threads.  On return, words[i] points to the candidate produced from
+ * the i-th word, stored in out (which must hold count entries of
+ * PLAINTEXT_BUFFER_SIZE + 1 bytes), or is NULL if the word was rejected.
+ * Unlike rules_apply(), no comparison against the previous candidate is
+ * made; that is left to the caller, who sees the candidates in order.
+ */
+extern void rules_apply_batch(char **words, int count, char *rule, char *out);
+
 /*
  * Similar to rules_check(), but displays a message and does not return on
  * error.  Also performs 'dupe' rule removal, and lists if any rules were removed.
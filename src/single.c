@@ -35,14 +35,65 @@ static struct db_main *single_db;
 static int rule_number, rule_count;
 static int length, key_count;
 static struct db_keys *guessed_keys;
-static struct rpp_context *rule_ctx;
+static struct rpp_context *rule_ctx, rule_ctx_start;
 
 static int words_pair_max;
 static int retest_guessed;
 
+/*
+ * Salts are processed in groups, each group going through all of the rules
+ * before the next one starts, so that key buffers are only needed for one
+ * group at a time.  Unless SingleMaxBufferMemory says otherwise, all salts
+ * are in one group.  Groups are taken in salt_md5 order, which unlike the
+ * order of the salts list doesn't depend on what else got loaded, so that a
+ * restored session can tell which salts it's done with, and which ones the
+ * interrupted group had (those cracked since aren't loaded, so it would
+ * otherwise reach into the next group's salts).  Successful guesses
+ * are carried over to later groups, and finally tried against the earlier
+ * groups too.
+ */
+static struct db_salt **group_order, **group_salts;
+static struct db_keys **group_keys;
+static int group_size, group_count, grouped;
+static int group_first, group_next, *group_firsts;
+static int group_total, group_stop;
+static int group_number, *group_carried, retesting;
+static uint32_t rec_group[4], rec_group_last[4];
+static char *carried_keys;
+static int carried_count;
+
+static int single_md5_words_cmp(const uint32_t *a, const uint32_t *b)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+	if (a[i] != b[i])
+		return a[i] < b[i] ? -1 : 1;
+
+	return 0;
+}
+
+static int single_md5_cmp(const void *a, const void *b)
+{
+	return single_md5_words_cmp((*(struct db_salt **)a)->salt_md5,
+		(*(struct db_salt **)b)->salt_md5);
+}
+
 static void save_state(FILE *file)
 {
+/* All ones when there's nothing left, short of retesting */
+	uint32_t none[4] = { ~0U, ~0U, ~0U, ~0U }, *md5 = none, *last = none;
+
 	fprintf(file, "%d\n", rec_rule);
+	if (!grouped)
+		return;
+
+	if (!retesting && group_count) {
+		md5 = group_order[group_first]->salt_md5;
+		last = group_order[group_next - 1]->salt_md5;
+	}
+	fprintf(file, "%08x%08x%08x%08x\n", md5[0], md5[1], md5[2], md5[3]);
+	fprintf(file, "%08x%08x%08x%08x\n", last[0], last[1], last[2], last[3]);
 }
 
 static int restore_rule_number(void)
@@ -57,6 +108,12 @@ static int restore_rule_number(void)
 static int restore_state(FILE *file)
 {
 	if (fscanf(file, "%d\n", &rec_rule) != 1) return 1;
+	if (fscanf(file, "%8x%8x%8x%8x\n", &rec_group[0], &rec_group[1],
+	    &rec_group[2], &rec_group[3]) != 4)
+		memset(rec_group, 0, sizeof(rec_group));
+	if (fscanf(file, "%8x%8x%8x%8x\n", &rec_group_last[0],
+	    &rec_group_last[1], &rec_group_last[2], &rec_group_last[3]) != 4)
+		memset(rec_group_last, 0xff, sizeof(rec_group_last));
 
 	return restore_rule_number();
 }
@@ -65,8 +122,12 @@ static double get_progress(void)
 {
 	emms();
 
+	if (!progress && retesting)
+		return 100.0 * group_number / retesting;
+
 	return progress ? progress :
-		(double)rule_number / (rule_count + 1) * 100.0;
+		(group_first + (group_next - group_first) *
+		((double)rule_number / (rule_count + 1))) / group_total * 100.0;
 }
 
 static void single_alloc_keys(struct db_keys **keys)
@@ -92,6 +153,8 @@ static void single_alloc_keys(struct db_keys **keys)
 static void single_init(void)
 {
 	struct db_salt *salt;
+	size_t salt_size;
+	int max_mem, index;
 
 	log_event("Proceeding with \"single crack\" mode");
 
@@ -137,22 +200,78 @@ static void single_init(void)
 
 	log_event("- %d preprocessed word mangling rules", rule_count);
 
+	rule_ctx_start = *rule_ctx;
+	memset(rec_group, 0, sizeof(rec_group));
+	memset(rec_group_last, 0xff, sizeof(rec_group_last));
+
 	status_init(get_progress, 0);
 
 	rec_restore_mode(restore_state);
 	rec_init(single_db, save_state);
 
+	group_size = group_total = single_db->salt_count;
+	salt_size = sizeof(struct db_keys) - 1 + length * key_count +
+		sizeof(struct db_keys_hash) +
+		sizeof(struct db_keys_hash_entry) * (key_count - 1);
+	if ((max_mem = cfg_get_int(SECTION_OPTIONS, NULL,
+	                           "SingleMaxBufferMemory")) > 0 &&
+	    ((size_t)max_mem << 20) / salt_size < group_size)
+		if (!(group_size = ((size_t)max_mem << 20) / salt_size))
+			group_size = 1;
+	grouped = group_size < group_total ||
+		rec_group[0] || rec_group[1] || rec_group[2] || rec_group[3];
+
+	group_order = mem_alloc(group_total * sizeof(*group_order));
 	salt = single_db->salts;
-	do {
-		single_alloc_keys(&salt->keys);
-	} while ((salt = salt->next));
+	for (index = 0; index < group_total; index++) {
+		group_order[index] = salt;
+		salt = salt->next;
+	}
+	if (grouped)
+		qsort(group_order, group_total, sizeof(*group_order),
+		      single_md5_cmp);
+
+	group_salts = mem_alloc(group_size * sizeof(*group_salts));
+	group_keys = mem_calloc(group_size, sizeof(*group_keys));
+	carried_keys = NULL;
+	carried_count = group_number = retesting = 0;
+	group_firsts = NULL;
+	group_carried = NULL;
+	if (grouped) {
+/* A restored first group may be short, taking one more group overall */
+		int groups = (group_total + group_size - 1) / group_size + 1;
+
+		group_firsts = mem_alloc((groups + 1) * sizeof(*group_firsts));
+		group_carried = mem_alloc(groups * sizeof(*group_carried));
+	}
+
+/* Skip the salts that the groups done before restoring had */
+	group_count = group_next = 0;
+	if (group_total > 1)
+	while (group_next < group_total &&
+	       single_md5_words_cmp(group_order[group_next]->salt_md5,
+	       rec_group) < 0)
+		group_next++;
+	group_first = group_next;
+	group_stop = group_total > 1 ? group_next : group_total;
+/* ...and limit the first group to the salts the interrupted one had */
+	if (group_total > 1)
+	while (group_stop < group_total &&
+	       single_md5_words_cmp(group_order[group_stop]->salt_md5,
+	       rec_group_last) <= 0)
+		group_stop++;
 
 	if (key_count > 1)
 	log_event("- Allocated %d buffer%s of %d candidate passwords%s",
-		single_db->salt_count,
-		single_db->salt_count != 1 ? "s" : "",
+		group_size,
+		group_size != 1 ? "s" : "",
 		key_count,
-		single_db->salt_count != 1 ? " each" : "");
+		group_size != 1 ? " each" : "");
+	if (grouped)
+		log_event("- Processing salts in groups of %d", group_size);
+	if (group_next)
+		log_event("- Skipping %d salts done in earlier groups",
+		          group_next);
 
 	guessed_keys = NULL;
 	single_alloc_keys(&guessed_keys);
@@ -256,10 +375,22 @@ static int single_process_buffer(struct db_salt *salt)
 	struct db_salt *current;
 	struct db_keys *keys;
 	size_t size;
+	int index;
 
 	if (crk_process_salt(salt))
 		return 1;
 
+	if (grouped && !retesting && retest_guessed && guessed_keys->count) {
+		size = length * guessed_keys->count;
+		carried_keys = realloc(carried_keys,
+			length * carried_count + size);
+		if (!carried_keys)
+			pexit("realloc");
+		memcpy(carried_keys + length * carried_count,
+			guessed_keys->buffer, size);
+		carried_count += guessed_keys->count;
+	}
+
 /*
  * Flush the keys list (since we've just processed the keys), but not the hash
  * table to allow for more effective checking for duplicates.  We could flush
@@ -285,14 +416,14 @@ static int single_process_buffer(struct db_salt *salt)
 
 		keys->ptr = keys->buffer;
 		do {
-			current = single_db->salts;
-			do {
+			for (index = 0; index < group_count; index++) {
+				current = group_salts[index];
 				if (current == salt || !current->list)
 					continue;
 
 				if (single_add_key(current, keys->ptr, 1))
 					return 1;
-			} while ((current = current->next));
+			}
 			keys->ptr += length;
 		} while (--keys->count);
 
@@ -433,7 +564,7 @@ static void single_run(void)
 	char *prerule, *rule;
 	struct db_salt *salt;
 	int min, saved_min;
-	int have_words;
+	int have_words, index;
 
 	saved_min = rec_rule;
 	while ((prerule = rpp_next(rule_ctx))) {
@@ -475,9 +606,10 @@ static void single_run(void)
 		min = rule_number;
 
 		/* pot reload might have removed the salt */
-		if (!(salt = single_db->salts))
+		if (!single_db->salts)
 			return;
-		do {
+		for (index = 0; index < group_count; index++) {
+			salt = group_salts[index];
 			if (!salt->list)
 				continue;
 			if (single_process_salt(salt, rule))
@@ -487,7 +619,7 @@ static void single_run(void)
 			have_words = 1;
 			if (salt->keys->rule < min)
 				min = salt->keys->rule;
-		} while ((salt = salt->next));
+		}
 
 		if (event_reload && single_db->salts)
 			crk_reload_pot();
@@ -504,29 +636,182 @@ static void single_run(void)
 	}
 }
 
-static void single_done(void)
+/*
+ * Processes the current group's remaining buffered keys.
+ */
+static int single_flush_group(void)
 {
 	struct db_salt *salt;
+	int index;
 
-	if (!event_abort) {
-		if ((salt = single_db->salts)) {
-			log_event("- Processing the remaining buffered "
-				"candidate passwords, if any");
+	if (!single_db->salts)
+		return 0;
 
-			do {
-				if (!salt->list)
-					continue;
-				if (salt->keys->count)
-					if (single_process_buffer(salt))
-						break;
-			} while ((salt = salt->next));
+	log_event("- Processing the remaining buffered "
+		"candidate passwords, if any");
+
+	for (index = 0; index < group_count; index++) {
+		salt = group_salts[index];
+		if (!salt->list)
+			continue;
+		if (salt->keys->count)
+			if (single_process_buffer(salt))
+				return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Gives key buffers to up to group_size remaining salts from group_order[]
+ * start on, up to but not including stop, returning how many there were.
+ * They're then processed in the salts list order, which is what the format
+ * might prefer.
+ */
+static int single_start_group(int start, int stop)
+{
+	struct db_salt *salt;
+	int index = start;
+
+	group_first = start;
+	if (group_firsts)
+		group_firsts[group_number] = start;
+
+	group_count = 0;
+	while (index < stop && group_count < group_size) {
+		salt = group_order[index++];
+		if (!salt->list)
+			continue;
+		salt->keys = group_keys[group_count];
+		single_alloc_keys(&salt->keys);
+		group_keys[group_count++] = salt->keys;
+	}
+	group_next = index;
+
+	if (grouped) {
+		int count = 0;
+
+		salt = single_db->salts;
+		while (salt && count < group_count) {
+			if (salt->keys)
+				group_salts[count++] = salt;
+			salt = salt->next;
 		}
+	} else
+		memcpy(group_salts, group_order,
+		       group_count * sizeof(*group_salts));
+
+	return group_count;
+}
+
+static void single_end_group(void)
+{
+	int index;
+
+	for (index = 0; index < group_count; index++)
+		group_salts[index]->keys = NULL;
+	group_count = 0;
+}
+
+/*
+ * Adds the guesses carried over from number from on to the current group.
+ */
+static int single_add_carried(int from)
+{
+	int index, count = carried_count;
+
+/* carried_keys may grow, and move, as we go */
+	for (; from < count; from++)
+	for (index = 0; index < group_count; index++) {
+		if (!group_salts[index]->list)
+			continue;
+		if (single_add_key(group_salts[index],
+		    &carried_keys[length * from], 1))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Finishes the current group and moves on to the next one, starting over
+ * with the first rule and with the guesses made so far.  Returns zero when
+ * there are no more groups or we're done.
+ */
+static int single_next_group(void)
+{
+	if (event_abort || !single_db->salts || group_next >= group_total)
+		return 0;
+
+	if (single_flush_group())
+		return 0;
+
+	single_end_group();
+	group_carried[group_number++] = carried_count;
+
+	*rule_ctx = rule_ctx_start;
+	rec_rule = rule_number = 0;
+
+	if (!single_start_group(group_next, group_total))
+		return 0;
+
+	log_event("- Proceeding with the next %d salts", group_count);
+
+	return !single_add_carried(0);
+}
+
+/*
+ * Tries the guesses carried over from later groups against the salts of the
+ * earlier ones, which they would have been tried against had all salts been
+ * in one group.
+ */
+static void single_retest_carried(void)
+{
+	int number, count = group_number;
+
+	if (event_abort || !single_db->salts || !group_number ||
+	    group_carried[0] == carried_count)
+		return;
+
+	log_event("- Trying %d guesses for later salts against earlier ones",
+		carried_count - group_carried[0]);
+
+	if (single_flush_group())
+		return;
+	single_end_group();
+
+	retesting = count;
+	for (number = 0; number < count; number++) {
+		if (group_carried[number] == carried_count)
+			continue;
+		group_number = number;
+		if (!single_start_group(group_firsts[number],
+		    group_firsts[number + 1]))
+			continue;
+		if (single_add_carried(group_carried[number]) ||
+		    single_flush_group())
+			break;
+		single_end_group();
+	}
+}
+
+static void single_done(void)
+{
+	if (!event_abort) {
+		single_flush_group();
 
 		progress = 100;
 	}
 
 	rec_done(event_abort || (status.pass && single_db->salts));
 	c_cleanup();
+
+	MEM_FREE(group_carried);
+	MEM_FREE(group_firsts);
+	MEM_FREE(carried_keys);
+	MEM_FREE(group_keys);
+	MEM_FREE(group_salts);
+	MEM_FREE(group_order);
 }
 
 void do_single_crack(struct db_main *db)
@@ -536,7 +821,11 @@ void do_single_crack(struct db_main *db)
 	single_db = db;
 	rule_ctx = &ctx;
 	single_init();
-	single_run();
+	if (single_start_group(group_next, group_stop))
+	do {
+		single_run();
+	} while (single_next_group());
+	single_retest_carried();
 	single_done();
 	rule_ctx = NULL; /* Just for good measure */
 }
@@ -383,6 +383,18 @@ static void status_print_cracking(double percent)
 			p += n;
 	}
 
+	if (status.filtered.lo | status.filtered.hi) {
+		double filtered = status.filtered.hi * 4294967296.0 +
+			status.filtered.lo;
+		double cands = status.cands.hi * 4294967296.0 +
+			status.cands.lo;
+
+		n = sprintf(p, "dup:%.1f%% ",
+		            100.0 * filtered / (filtered + cands));
+		if (n > 0)
+			p += n;
+	}
+
 #if defined(HAVE_CUDA) || defined(HAVE_OPENCL)
 	n = sprintf(p, "%.31sC/s%s%s%.200s%s%.200s\n",
 	    status_get_cps(s_combs_ps, &status.combs, status.combs_ehi),
@@ -43,6 +43,8 @@ struct status_main {
 	int progress;
 	int resume_salt;
 	uint32_t *resume_salt_md5;
+/* Candidates dropped by wordlist mode's CandidateFilter as already tried */
+	int64 filtered;
 };
 
 extern struct status_main status;
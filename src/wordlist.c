@@ -58,6 +58,21 @@
 
 #include <errno.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if HAVE_PTHREAD && (HAVE_LIBZ || HAVE_LIBBZ2)
+#define WORDLIST_DECOMPRESS		1
+#include <pthread.h>
+#if HAVE_LIBZ
+#include <zlib.h>
+#endif
+#if HAVE_LIBBZ2
+#include <bzlib.h>
+#endif
+#endif
+
 #include "arch.h"
 #include "jumbo.h"
 #include "misc.h"
@@ -79,6 +94,7 @@
 #include "memory.h"
 #include "unicode.h"
 #include "regex.h"
+#include "crc32.h"
 #include "mask.h"
 #include "pseudo_intrinsics.h"
 #include "memdbg.h"
@@ -116,10 +132,82 @@ static char *mem_map, *map_pos, *map_end, *map_scan_end;
 static char *word_file_str, **words;
 static int64_t nWordFileLines;
 
+/*
+ * Blocked rules x words mode, for wordlists too large to load.  A block of
+ * up to --mem-file-size bytes of words is read once and all rules are run
+ * over it before reading the next, rather than reading the whole file once
+ * per rule.  The state is then (block's file offset and first line number,
+ * rule, line within block), with line_number counting lines of the block.
+ */
+static int blocked;
+static char *block_buf;
+static unsigned int *block_words;
+static size_t block_size, block_alloc;
+static int64_t block_pos, block_line, block_lines;
+static int block_rule, block_rule_count;
+static int64_t rec_block_line = -1;
+/* Where a restored session resumes, kept apart from what fix_state() sets */
+static int64_t resume_block_pos, resume_block_line = -1, resume_line;
+static int resume_rule;
+
+/*
+ * With WordlistNodeSlices, each node only reads its own contiguous slice
+ * [slice_start, slice_end) of the wordlist, split at line boundaries, rather
+ * than reading all of it and skipping other nodes' lines.
+ */
+static int sliced;
+static int64_t slice_start, slice_end;
+/* Where word_file is in a slice that isn't mapped, or -1 if not known */
+static int64_t slice_pos = -1;
+
+/*
+ * Optional sidecar line index (WordlistLineIndex): the offset of every
+ * LINE_INDEX_STEP'th line of the wordlist, kept in "<wordlist>.lidx" along
+ * with the file's size, mtime and a CRC of its head to tell when it's stale.
+ * It lets a restore seek to near the saved line rather than read up to it.
+ * A zero line_index_count means the file can't be indexed (too long lines).
+ */
+#define LINE_INDEX_STEP			0x10000
+#define LINE_INDEX_CHUNK		0x100000
+#define LINE_INDEX_MAGIC		"JtR line index v1"
+static int64_t *line_index;
+static int64_t line_index_count;
+
+/*
+ * Parallel rule application for in-memory wordlists.  Words are taken
+ * batch_size at a time, mangled by rules_apply_batch() on all threads, and
+ * the candidates are then processed here in the original order, with
+ * line_number set to each one's word so that state is saved as usual.
+ */
+#define RULES_BATCH_PER_THREAD		1024
+
+static int batch_size;
+static char **batch_words, *batch_buf;
+static int64_t *batch_lines;
+static char batch_last[PLAINTEXT_BUFFER_SIZE + 1];
+
+static uint64_t *cf_table;
+static void cf_save(void);
+static void cf_load(void);
+
+/* Candidates that got into the candidate filter since the restore point */
+struct cf_new {
+	uint64_t hash;
+/* Which of the filter's bits for it this candidate was the first to set */
+	unsigned int bits;
+};
+static struct cf_new *cf_pending;
+static size_t cf_pending_count, cf_pending_size, cf_hybrid_count;
+static void cf_commit(size_t count);
+
 static void save_state(FILE *file)
 {
 	fprintf(file, "%d\n" LLd "\n" LLd "\n",
 	        rec_rule, (long long)rec_pos, (long long)rec_line);
+	if (blocked)
+		fprintf(file, "B" LLd "\n", (long long)rec_block_line);
+	if (cf_table)
+		cf_save();
 }
 
 static int restore_rule_number(void)
@@ -252,6 +340,679 @@ static MAYBE_INLINE char *mgetl(char *res)
 	return res;
 }
 
+/*
+ * Returns the offset of the first line starting at or after pos.
+ */
+static int64_t slice_bound(int64_t pos, int64_t file_len)
+{
+	int c;
+
+	if (pos <= 0)
+		return 0;
+	if (pos >= file_len)
+		return file_len;
+
+	if (mem_map) {
+		char *p = memchr(mem_map + pos - 1, '\n', file_len - pos + 1);
+
+		return p ? p + 1 - mem_map : file_len;
+	}
+
+	if (jtr_fseek64(word_file, pos - 1, SEEK_SET))
+		pexit(STR_MACRO(jtr_fseek64));
+	while ((c = getc(word_file)) != EOF && c != '\n');
+	if (c == EOF)
+		return file_len;
+	return jtr_ftell64(word_file);
+}
+
+/*
+ * Whether there's anything left to read of our slice (mgetl() stops at the
+ * end of it on its own).  The file position is only asked for after a seek
+ * or a line slice_getl() couldn't count the bytes of.
+ */
+static MAYBE_INLINE int slice_left(void)
+{
+	if (!sliced || mem_map)
+		return 1;
+
+	if (slice_pos < 0)
+		slice_pos = jtr_ftell64(word_file);
+
+	return slice_pos < slice_end;
+}
+
+/*
+ * fgetl() that keeps slice_pos up to date.  A line ending in a newline that
+ * strlen() can see was read in full, so its length is what it took; anything
+ * else (a cut line, a NUL in it, the last line lacking a newline) makes us
+ * forget the position until slice_left() needs it again.
+ */
+static char *slice_getl(char *line)
+{
+	size_t len;
+	int c;
+
+	if (!fgets(line, LINE_BUFFER_SIZE, word_file))
+		return NULL;
+
+	len = strlen(line);
+	if (len && line[len - 1] == '\n') {
+		if (slice_pos >= 0)
+			slice_pos += len;
+		line[--len] = 0;
+		if (len && line[len - 1] == '\r')
+			line[len - 1] = 0;
+		return line;
+	}
+
+	slice_pos = -1;
+	if (!len)
+		return line;
+
+	if ((c = getc(word_file)) == '\n') {
+		if (line[len - 1] == '\r')
+			line[len - 1] = 0;
+	} else
+	while (c != EOF && c != '\n')
+		c = getc(word_file);
+
+	return line;
+}
+
+/*
+ * CRC of the first LINE_INDEX_CHUNK bytes of the wordlist, which together
+ * with its size and mtime identifies the file a line index was built for.
+ */
+static CRC32_t line_index_crc(int64_t size)
+{
+	CRC32_t crc;
+	unsigned int len = size < LINE_INDEX_CHUNK ? size : LINE_INDEX_CHUNK;
+
+	CRC32_Init(&crc);
+	if (mem_map)
+		CRC32_Update(&crc, mem_map, len);
+	else {
+		char *buf = mem_alloc(len + 1);
+
+		if (jtr_fseek64(word_file, 0, SEEK_SET))
+			pexit(STR_MACRO(jtr_fseek64));
+		if (fread(buf, 1, len, word_file) != len)
+			pexit("fread");
+		CRC32_Update(&crc, buf, len);
+		MEM_FREE(buf);
+	}
+
+	return crc;
+}
+
+static int line_index_load(char *name, int64_t size, long long mtime,
+                           CRC32_t crc)
+{
+	FILE *file;
+	char magic[sizeof(LINE_INDEX_MAGIC) + 1];
+	long long f_size, f_mtime, f_count, ofs;
+	unsigned int f_crc, f_step;
+	int64_t i;
+
+	if (!(file = fopen(name, "r")))
+		return 1;
+
+	if (!fgetl(magic, sizeof(magic), file) ||
+	    strcmp(magic, LINE_INDEX_MAGIC) ||
+	    fscanf(file, LLd" "LLd" %x %u "LLd"\n",
+	           &f_size, &f_mtime, &f_crc, &f_step, &f_count) != 5 ||
+	    f_size != size || f_mtime != mtime || f_crc != crc ||
+	    f_step != LINE_INDEX_STEP || f_count < 0 ||
+	    f_count > size / LINE_INDEX_STEP + 1) {
+		fclose(file);
+		return 1;
+	}
+
+	line_index = mem_alloc((f_count + 1) * sizeof(*line_index));
+	for (i = 0; i < f_count; i++) {
+		if (fscanf(file, LLd"\n", &ofs) != 1 || ofs < 0 || ofs > size) {
+			MEM_FREE(line_index);
+			fclose(file);
+			return 1;
+		}
+		line_index[i] = ofs;
+	}
+	line_index_count = f_count;
+
+	fclose(file);
+	return 0;
+}
+
+static void line_index_save(char *name, int64_t size, long long mtime,
+                            CRC32_t crc)
+{
+	char tmp_name[PATH_BUFFER_SIZE + 16];
+	FILE *file;
+	int64_t i;
+
+	snprintf(tmp_name, sizeof(tmp_name), "%s.%u", name, (unsigned)getpid());
+	if (!(file = fopen(tmp_name, "w"))) {
+		log_event("- Can't write line index %s: %s",
+		          tmp_name, strerror(errno));
+		return;
+	}
+
+	fprintf(file, LINE_INDEX_MAGIC "\n"LLd" "LLd" %08x %u "LLd"\n",
+	        (long long)size, mtime, crc, LINE_INDEX_STEP,
+	        (long long)line_index_count);
+	for (i = 0; i < line_index_count; i++)
+		fprintf(file, LLd"\n", (long long)line_index[i]);
+
+	/* Don't leave a partial index where a --fork sibling could read it */
+	if (fclose(file) || rename(tmp_name, name)) {
+		log_event("- Can't write line index %s: %s",
+		          name, strerror(errno));
+		unlink(tmp_name);
+	}
+}
+
+/*
+ * Reads the whole file once, noting where every LINE_INDEX_STEP'th line
+ * starts.  Lines are counted the way fgetl() does, so files with lines that
+ * mgetl() would split are left unindexed.
+ */
+static void line_index_build(int64_t size)
+{
+	char *buf = NULL;
+	int64_t pos = 0, start = 0, line = 0, alloc = 1024;
+
+	line_index = mem_alloc(alloc * sizeof(*line_index));
+	line_index[0] = 0;
+	line_index_count = 1;
+
+	if (!mem_map) {
+		buf = mem_alloc(LINE_INDEX_CHUNK);
+		if (jtr_fseek64(word_file, 0, SEEK_SET))
+			pexit(STR_MACRO(jtr_fseek64));
+	}
+
+	while (pos < size && line_index_count) {
+		char *data, *p, *end;
+		size_t len;
+
+		if (mem_map) {
+			data = mem_map;
+			len = size;
+		} else {
+			data = buf;
+			if (!(len = fread(buf, 1, LINE_INDEX_CHUNK, word_file)))
+				break;
+		}
+
+		p = data;
+		end = data + len;
+		while ((p = memchr(p, '\n', end - p))) {
+			int64_t next = pos + (++p - data);
+
+			if (next - start > LINE_BUFFER_SIZE - 1) {
+				line_index_count = 0;
+				break;
+			}
+			start = next;
+			if (++line % LINE_INDEX_STEP || next >= size)
+				continue;
+			if (line_index_count >= alloc) {
+				alloc *= 2;
+				line_index = realloc(line_index,
+				                     alloc * sizeof(*line_index));
+				if (!line_index)
+					pexit("realloc");
+			}
+			line_index[line_index_count++] = next;
+		}
+		pos += len;
+	}
+	if (size - start > LINE_BUFFER_SIZE - 1)
+		line_index_count = 0;
+
+	MEM_FREE(buf);
+	if (ferror(word_file))
+		pexit("fread");
+}
+
+static void line_index_init(char *wordlist)
+{
+	char name[PATH_BUFFER_SIZE + 1];
+	struct stat st;
+	int64_t pos;
+	CRC32_t crc;
+
+	if (fstat(fileno(word_file), &st) || !S_ISREG(st.st_mode) ||
+	    (pos = jtr_ftell64(word_file)) < 0)
+		return;
+
+	snprintf(name, sizeof(name), "%s.lidx", wordlist);
+	crc = line_index_crc(st.st_size);
+	if (line_index_load(name, st.st_size, (long long)st.st_mtime, crc)) {
+		line_index_build(st.st_size);
+		line_index_save(name, st.st_size, (long long)st.st_mtime, crc);
+		log_event("- Built line index %s ("LLd" entries)",
+		          name, (long long)line_index_count);
+	} else
+		log_event("- Using line index %s", name);
+
+	if (jtr_fseek64(word_file, pos, SEEK_SET))
+		pexit(STR_MACRO(jtr_fseek64));
+}
+
+/*
+ * Positions the file at the closest indexed line at or before line number n
+ * and returns how many more lines there are to skip to get to n.
+ */
+static int64_t line_index_seek(int64_t n)
+{
+	int64_t i;
+
+	if (!line_index_count)
+		return n;
+
+	if ((i = n / LINE_INDEX_STEP) >= line_index_count)
+		i = line_index_count - 1;
+
+	if (mem_map)
+		map_pos = mem_map + line_index[i];
+	else {
+		slice_pos = -1;
+		if (jtr_fseek64(word_file, line_index[i], SEEK_SET))
+			pexit(STR_MACRO(jtr_fseek64));
+	}
+
+	return n - i * LINE_INDEX_STEP;
+}
+
+#if WORDLIST_DECOMPRESS
+/*
+ * Compressed wordlists (gzip, and bzip2 where available) are decompressed by
+ * a helper thread into a ring buffer, from which dgetl() takes lines the way
+ * fgetl() would from the uncompressed file.  Positions (rec_pos) are offsets
+ * into the uncompressed data: seeking forward decompresses and discards, and
+ * seeking backwards restarts from the beginning of the file.
+ */
+#define DEC_RING_SIZE			0x400000
+#define DEC_CHUNK			0x40000
+
+enum { DEC_NONE, DEC_GZIP, DEC_BZIP2 };
+
+static struct {
+	int type;
+	char *name;
+#if HAVE_LIBZ
+	gzFile gz;
+#endif
+#if HAVE_LIBBZ2
+	BZFILE *bz;
+#endif
+	char *ring;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int running, stop, eof, error;
+/* Bytes produced and consumed so far, compressed bytes read and in total */
+	int64_t head, tail, in_pos, in_size;
+} dec = { DEC_NONE };
+
+/* The consumer's own view: what it has taken, and how much was available */
+static int64_t dec_tail, dec_head;
+
+static int dec_open_stream(void)
+{
+#if HAVE_LIBZ
+	if (dec.type == DEC_GZIP)
+		return !(dec.gz = gzopen(dec.name, "rb"));
+#endif
+#if HAVE_LIBBZ2
+	if (dec.type == DEC_BZIP2) {
+		int err;
+
+		if (jtr_fseek64(word_file, 0, SEEK_SET))
+			return 1;
+		dec.bz = BZ2_bzReadOpen(&err, word_file, 0, 0, NULL, 0);
+		return err != BZ_OK;
+	}
+#endif
+	return 1;
+}
+
+static void dec_close_stream(void)
+{
+#if HAVE_LIBZ
+	if (dec.type == DEC_GZIP && dec.gz) {
+		gzclose(dec.gz);
+		dec.gz = NULL;
+	}
+#endif
+#if HAVE_LIBBZ2
+	if (dec.type == DEC_BZIP2 && dec.bz) {
+		int err;
+
+		BZ2_bzReadClose(&err, dec.bz);
+		dec.bz = NULL;
+	}
+#endif
+}
+
+/*
+ * Returns the number of bytes decompressed, 0 at end of data, or -1 on error.
+ * Runs on the helper thread only.
+ */
+static int dec_read(char *buf, unsigned int len, int64_t *in_pos)
+{
+	int n = -1;
+
+#if HAVE_LIBZ
+	if (dec.type == DEC_GZIP) {
+		n = gzread(dec.gz, buf, len);
+		*in_pos = gzoffset(dec.gz);
+	}
+#endif
+#if HAVE_LIBBZ2
+	if (dec.type == DEC_BZIP2 && !dec.bz)
+		return 0;
+
+/* Files from parallel compressors are several concatenated bzip2 streams */
+	while (dec.type == DEC_BZIP2 && dec.bz) {
+		char unused[BZ_MAX_UNUSED];
+		void *p;
+		int err, c, nunused;
+
+		n = BZ2_bzRead(&err, dec.bz, buf, len);
+		*in_pos = jtr_ftell64(word_file);
+		if (err == BZ_OK)
+			break;
+		if (err != BZ_STREAM_END) {
+			n = -1;
+			break;
+		}
+
+		BZ2_bzReadGetUnused(&err, dec.bz, &p, &nunused);
+		memcpy(unused, p, nunused);
+		BZ2_bzReadClose(&err, dec.bz);
+		dec.bz = NULL;
+		if (!nunused) {
+			if ((c = getc(word_file)) == EOF)
+				break;
+			ungetc(c, word_file);
+		}
+		dec.bz = BZ2_bzReadOpen(&err, word_file, 0, 0, unused, nunused);
+		if (err != BZ_OK) {
+			n = -1;
+			break;
+		}
+		if (n)
+			break;
+	}
+#endif
+
+	return n;
+}
+
+static void *dec_main(void *arg)
+{
+	pthread_mutex_lock(&dec.mutex);
+	while (!dec.stop && !dec.eof) {
+		int64_t room = DEC_RING_SIZE - (dec.head - dec.tail);
+		unsigned int ofs = dec.head & (DEC_RING_SIZE - 1);
+		unsigned int len = DEC_RING_SIZE - ofs;
+		int64_t in_pos = dec.in_pos;
+		int n;
+
+		if (len > DEC_CHUNK)
+			len = DEC_CHUNK;
+		if (room < len) {
+			pthread_cond_wait(&dec.cond, &dec.mutex);
+			continue;
+		}
+
+/* The consumer doesn't touch the ring past dec.head, so fill it unlocked */
+		pthread_mutex_unlock(&dec.mutex);
+		n = dec_read(&dec.ring[ofs], len, &in_pos);
+		pthread_mutex_lock(&dec.mutex);
+
+		if (n > 0)
+			dec.head += n;
+		else {
+			dec.eof = 1;
+			dec.error = n < 0;
+		}
+		dec.in_pos = in_pos;
+		pthread_cond_broadcast(&dec.cond);
+	}
+	pthread_mutex_unlock(&dec.mutex);
+
+	return NULL;
+}
+
+static void dec_start(void)
+{
+	dec.head = dec.tail = dec.in_pos = 0;
+	dec_head = dec_tail = 0;
+	dec.stop = dec.eof = dec.error = 0;
+
+	if (dec_open_stream()) {
+		fprintf(stderr, "Can't decompress %s\n", dec.name);
+		error();
+	}
+	if (pthread_create(&dec.thread, NULL, dec_main, NULL))
+		pexit("pthread_create");
+	dec.running = 1;
+}
+
+static void dec_stop(void)
+{
+	if (!dec.running)
+		return;
+
+	pthread_mutex_lock(&dec.mutex);
+	dec.stop = 1;
+	pthread_cond_broadcast(&dec.cond);
+	pthread_mutex_unlock(&dec.mutex);
+	pthread_join(dec.thread, NULL);
+	dec.running = 0;
+
+	dec_close_stream();
+}
+
+/*
+ * Hands what we consumed back to the helper thread, then waits for more data
+ * if we've used up all that was available.  Returns 0 at end of data.
+ */
+static int dec_fill(void)
+{
+	pthread_mutex_lock(&dec.mutex);
+	dec.tail = dec_tail;
+	pthread_cond_broadcast(&dec.cond);
+	while (dec.head == dec_tail && !dec.eof)
+		pthread_cond_wait(&dec.cond, &dec.mutex);
+	dec_head = dec.head;
+	if (dec.error && dec_head == dec_tail) {
+		pthread_mutex_unlock(&dec.mutex);
+		fprintf(stderr, "Error decompressing %s\n", dec.name);
+		error();
+	}
+	pthread_mutex_unlock(&dec.mutex);
+
+	return dec_head > dec_tail;
+}
+
+/* Like fgetl() but for the compressed file. */
+static char *dgetl(char *res)
+{
+	char *pos = res, *end = res + LINE_BUFFER_SIZE - 1;
+	int got = 0;
+
+	for (;;) {
+		char *data, *nl;
+		unsigned int ofs, len, copy;
+
+		if (dec_tail == dec_head && !dec_fill())
+			break;
+		got = 1;
+
+		ofs = dec_tail & (DEC_RING_SIZE - 1);
+		len = DEC_RING_SIZE - ofs;
+		if (len > dec_head - dec_tail)
+			len = dec_head - dec_tail;
+		data = &dec.ring[ofs];
+
+		if ((nl = memchr(data, '\n', len)))
+			len = nl - data;
+		copy = len < end - pos ? len : end - pos;
+		memcpy(pos, data, copy);
+		pos += copy;
+		dec_tail += len;
+
+		if (nl) {
+			dec_tail++;
+			break;
+		}
+	}
+
+/* Let the helper thread reuse the space now and then, not only when empty */
+	if (((dec_tail ^ dec.tail) & ~(int64_t)(DEC_CHUNK - 1)) &&
+	    dec_head - dec_tail >= DEC_CHUNK) {
+		pthread_mutex_lock(&dec.mutex);
+		dec.tail = dec_tail;
+		pthread_cond_broadcast(&dec.cond);
+		pthread_mutex_unlock(&dec.mutex);
+	}
+
+	if (!got)
+		return NULL;
+
+	*pos = 0;
+	if (pos > res && pos[-1] == '\r')
+		pos[-1] = 0;
+
+	return res;
+}
+
+static int dec_seek(int64_t pos)
+{
+	if (pos < dec_tail) {
+		dec_stop();
+		dec_start();
+	}
+
+	while (dec_tail < pos) {
+		if (dec_tail == dec_head && !dec_fill())
+			return -1;
+		if (dec_head > pos)
+			dec_tail = pos;
+		else
+			dec_tail = dec_head;
+	}
+
+	return 0;
+}
+
+/* Compressed bytes read so far, for the progress figure */
+static int64_t dec_in_pos(void)
+{
+	int64_t pos;
+
+	pthread_mutex_lock(&dec.mutex);
+	pos = dec.in_pos;
+	pthread_mutex_unlock(&dec.mutex);
+
+	return pos;
+}
+
+/*
+ * Checks the file's magic bytes, and if it's compressed in a format we can
+ * read, starts decompressing it.
+ */
+static void dec_init(char *name, int64_t file_len)
+{
+	unsigned char magic[3];
+	size_t n;
+
+	n = fread(magic, 1, sizeof(magic), word_file);
+	if (jtr_fseek64(word_file, 0, SEEK_SET))
+		pexit(STR_MACRO(jtr_fseek64));
+
+#if HAVE_LIBZ
+	if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+		dec.type = DEC_GZIP;
+#endif
+#if HAVE_LIBBZ2
+	if (n == 3 && !memcmp(magic, "BZh", 3))
+		dec.type = DEC_BZIP2;
+#endif
+	if (dec.type == DEC_NONE ||
+	    !cfg_get_bool(SECTION_OPTIONS, NULL, "WordlistDecompress", 1)) {
+		dec.type = DEC_NONE;
+		return;
+	}
+
+	dec.name = str_alloc_copy(name);
+	dec.in_size = file_len;
+	if (!dec.ring)
+		dec.ring = mem_alloc(DEC_RING_SIZE);
+	pthread_mutex_init(&dec.mutex, NULL);
+	pthread_cond_init(&dec.cond, NULL);
+	dec_start();
+
+	log_event("- Decompressing %s wordlist on a helper thread",
+	          dec.type == DEC_GZIP ? "gzip" : "bzip2");
+}
+
+static void dec_done(void)
+{
+	if (dec.type == DEC_NONE)
+		return;
+
+	dec_stop();
+	pthread_mutex_destroy(&dec.mutex);
+	pthread_cond_destroy(&dec.cond);
+	MEM_FREE(dec.ring);
+	dec.type = DEC_NONE;
+}
+
+#define dec_active()			(dec.type != DEC_NONE)
+#else
+#define dec_active()			0
+#endif /* WORDLIST_DECOMPRESS */
+
+/*
+ * Line reading and positioning for a wordlist that is neither memory-mapped
+ * nor loaded in memory, be it plain or compressed.
+ */
+static MAYBE_INLINE char *file_getl(char *line)
+{
+#if WORDLIST_DECOMPRESS
+	if (dec.type)
+		return dgetl(line);
+#endif
+	if (sliced)
+		return slice_getl(line);
+	return fgetl(line, LINE_BUFFER_SIZE, word_file);
+}
+
+static int64_t file_tell(void)
+{
+#if WORDLIST_DECOMPRESS
+	if (dec.type)
+		return dec_tail;
+#endif
+	return jtr_ftell64(word_file);
+}
+
+static int file_seek(int64_t pos)
+{
+#if WORDLIST_DECOMPRESS
+	if (dec.type)
+		return dec_seek(pos);
+#endif
+	slice_pos = -1;
+	return jtr_fseek64(word_file, pos, SEEK_SET);
+}
+
 static MAYBE_INLINE int skip_lines(unsigned long n, char *line)
 {
 	if (n) {
@@ -259,8 +1020,7 @@ static MAYBE_INLINE int skip_lines(unsigned long n, char *line)
 
 		if (!nWordFileLines)
 		do {
-			if (mem_map ? !mgetl(line) :
-			    !fgetl(line, LINE_BUFFER_SIZE, word_file))
+			if (mem_map ? !mgetl(line) : !file_getl(line))
 				return 1;
 		} while (--n);
 	}
@@ -296,6 +1056,20 @@ static int restore_state(FILE *file)
 	if (rec_rule < 0 || rec_pos < 0)
 		return 1;
 
+	if (cf_table)
+		cf_load();
+
+/* The blocked mode finds its way back on its own */
+	if (blocked) {
+		if (fscanf(file, "B" LLd "\n", &line) != 1 || line < 0)
+			return 1;
+		rec_block_line = resume_block_line = line;
+		resume_block_pos = rec_pos;
+		resume_rule = rec_rule;
+		resume_line = rec_line;
+		return 0;
+	}
+
 	if (restore_rule_number())
 		return 1;
 
@@ -305,19 +1079,20 @@ static int restore_state(FILE *file)
 	if (!nWordFileLines) {
 		if (mem_map) {
 			char line[LINE_BUFFER_SIZE];
-			skip_lines(rec_line, line);
+			skip_lines(line_index_seek(rec_line), line);
 			rec_pos = 0;
 		} else if (rec_line && !rec_pos) {
 			/* from mem_map build does not have rec_pos */
-			int64_t i = rec_line;
+			int64_t i;
 			char line[LINE_BUFFER_SIZE];
-			jtr_fseek64(word_file, 0, SEEK_SET);
+			file_seek(slice_start);
+			i = line_index_seek(rec_line);
 			while (i--)
-				if (!fgetl(line, sizeof(line), word_file))
+				if (!file_getl(line))
 					pexit(STR_MACRO(jtr_fseek64));
-			rec_pos = jtr_ftell64(word_file);
+			rec_pos = file_tell();
 		} else
-		if (jtr_fseek64(word_file, rec_pos, SEEK_SET))
+		if (file_seek(rec_pos))
 			pexit(STR_MACRO(jtr_fseek64));
 		line_number = rec_line;
 	}
@@ -331,11 +1106,18 @@ static int fix_state_delay;
 
 static void fix_state(void)
 {
+/* A restored blocked session's position stands until it's resumed */
+	if (resume_block_line >= 0)
+		return;
+
 	if (hybrid_rec_rule || hybrid_rec_line || hybrid_rec_pos) {
 		rec_rule = hybrid_rec_rule;
 		rec_line = hybrid_rec_line;
 		rec_pos = hybrid_rec_pos;
 		hybrid_rec_rule = hybrid_rec_line = hybrid_rec_pos = 0;
+		rec_block_line = block_line;
+		if (cf_table)
+			cf_commit(cf_hybrid_count);
 
 		return;
 	}
@@ -349,12 +1131,18 @@ static void fix_state(void)
 
 	rec_rule = rule_number;
 	rec_line = line_number;
+	if (cf_table)
+		cf_commit(cf_pending_count);
 
+	if (blocked) {
+		rec_pos = block_pos;
+		rec_block_line = block_line;
+	} else
 	if (word_file == stdin)
 		rec_pos = line_number;
 	else
 	if (!mem_map && !nWordFileLines &&
-	    (rec_pos = jtr_ftell64(word_file)) < 0) {
+	    (rec_pos = file_tell()) < 0) {
 #ifdef __DJGPP__
 		if (rec_pos != -1)
 			rec_pos = 0;
@@ -368,12 +1156,16 @@ void wordlist_hybrid_fix_state(void)
 {
 	hybrid_rec_rule = rule_number;
 	hybrid_rec_line = line_number;
+	cf_hybrid_count = cf_pending_count;
 
+	if (blocked)
+		hybrid_rec_pos = block_pos;
+	else
 	if (word_file == stdin)
 		hybrid_rec_pos = line_number;
 	else
 	if (!mem_map && !nWordFileLines &&
-	    (hybrid_rec_pos = jtr_ftell64(word_file)) < 0) {
+	    (hybrid_rec_pos = file_tell()) < 0) {
 #ifdef __DJGPP__
 		if (hybrid_rec_pos != -1)
 			hybrid_rec_pos = 0;
@@ -396,6 +1188,25 @@ static double get_progress(void)
 	if (!word_file || word_file == stdin)
 		return -1;
 
+	if (blocked) {
+		double done;
+
+		size = mem_map ? map_end - mem_map : 0;
+		if (!size) {
+			pos = jtr_ftell64(word_file);
+			jtr_fseek64(word_file, 0, SEEK_END);
+			size = jtr_ftell64(word_file);
+			jtr_fseek64(word_file, pos, SEEK_SET);
+		}
+		if (size <= 0 || !block_rule_count)
+			return -1;
+		done = block_rule;
+		if (block_lines)
+			done += (double)line_number / block_lines;
+		return 100.0 * (block_pos + done / block_rule_count *
+		                (double)block_size) / size;
+	}
+
 	if (nWordFileLines) {
 		pos = line_number;
 		size = nWordFileLines;
@@ -403,10 +1214,19 @@ static double get_progress(void)
 		pos = map_pos - mem_map;
 		size = map_end - mem_map;
 	} else {
+#if WORDLIST_DECOMPRESS
+		if (dec.type) {
+			pos = dec_in_pos();
+			size = dec.in_size;
+		} else {
+#endif
 		pos = jtr_ftell64(word_file);
 		jtr_fseek64(word_file, 0, SEEK_END);
 		size = jtr_ftell64(word_file);
 		jtr_fseek64(word_file, pos, SEEK_SET);
+#if WORDLIST_DECOMPRESS
+		}
+#endif
 #if 0
 		fprintf (stderr, "pos="LLd"  size="LLd"  percent=%0.4f\n", (long long)pos, (long long)size, (100.0 * ((rule_number * (double)size) + pos) /(rule_count * (double)size)));
 #endif
@@ -419,6 +1239,12 @@ static double get_progress(void)
 				pexit(STR_MACRO(jtr_ftell64));
 		}
 	}
+	if (sliced && !nWordFileLines) {
+		pos -= slice_start;
+		size = slice_end - slice_start;
+		if (size <= 0)
+			return -1;
+	}
 #if 0
 	fprintf(stderr, "rule %d/%d mask "LLu" pos "LLu"/"LLu"\n",
 	        rule_number, rule_count, mask_mult, pos, size);
@@ -561,6 +1387,484 @@ static MAYBE_INLINE int wbuf_unique(char *line)
 	return 1;
 }
 
+/*
+ * --dupe-suppression for wordlists too large to load in memory: a table of
+ * 64-bit line fingerprints with linear probing.  It starts small and doubles
+ * whenever it's 3/4 full, up to DupeSuppressionMemory MiB, so its size
+ * follows the number of unique lines rather than that of the file.  It is
+ * emptied before each pass over the file so that every pass drops the same
+ * lines (the blocked mode reads the file only once).  Once the table is at
+ * its largest and 3/4 full, lines not yet in it are let through, and after a
+ * restore the lines before the restore point aren't in it, so some duplicates
+ * may then get tried - but no unique line is ever lost, short of a 64-bit
+ * fingerprint collision.
+ */
+#define FP_MIN_SIZE			0x10000
+static uint64_t *fp_table;
+static uint64_t fp_mask, fp_count, fp_limit, fp_max;
+
+static void fp_alloc(uint64_t size)
+{
+	fp_table = mem_calloc(size, sizeof(*fp_table));
+	fp_mask = size - 1;
+	fp_limit = size / 4 * 3;
+}
+
+static void fp_init(void)
+{
+	uint64_t max_size;
+
+	max_size = (uint64_t)cfg_get_int(SECTION_OPTIONS, NULL,
+	                                 "DupeSuppressionMemory") << 20;
+	if ((int64_t)max_size <= 0)
+		max_size = 1024 << 20;
+	max_size /= sizeof(*fp_table);
+
+	for (fp_max = 1; fp_max * 2 <= max_size;)
+		fp_max <<= 1;
+	fp_alloc(fp_max < FP_MIN_SIZE ? fp_max : FP_MIN_SIZE);
+	fp_count = 0;
+
+	log_event("- dupe suppression: fingerprint table of up to "LLu
+	          " entries ("LLu" MiB)", (unsigned long long)fp_max,
+	          (unsigned long long)(fp_max * sizeof(*fp_table)) >> 20);
+}
+
+/* Moves the fingerprints to a table twice the size */
+static void fp_grow(void)
+{
+	uint64_t *old = fp_table, old_size = fp_mask + 1, index, slot;
+
+	fp_alloc(old_size * 2);
+	for (index = 0; index < old_size; index++) {
+		if (!old[index])
+			continue;
+		slot = old[index] & fp_mask;
+		while (fp_table[slot])
+			slot = (slot + 1) & fp_mask;
+		fp_table[slot] = old[index];
+	}
+	MEM_FREE(old);
+}
+
+static void fp_clear(void)
+{
+	if (fp_table && fp_count) {
+		memset(fp_table, 0, (fp_mask + 1) * sizeof(*fp_table));
+		fp_count = 0;
+	}
+}
+
+/* FNV-1a, with a final mix since we use the low bits as an index */
+static MAYBE_INLINE uint64_t str_hash64(const char *str)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	const unsigned char *p = (const unsigned char*)str;
+
+	while (*p) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+	hash ^= hash >> 29;
+	hash *= 0xbf58476d1ce4e5b9ULL;
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
+/* Returns 0 if the line was seen before, 1 if not */
+static MAYBE_INLINE int fp_unique(const char *line)
+{
+	uint64_t hash = str_hash64(line), slot;
+
+	if (!hash)
+		hash = 1;
+
+	slot = hash & fp_mask;
+	while (fp_table[slot]) {
+		if (fp_table[slot] == hash)
+			return 0;
+		slot = (slot + 1) & fp_mask;
+	}
+
+	if (fp_count < fp_limit) {
+		fp_table[slot] = hash;
+		if (++fp_count < fp_limit)
+			return 1;
+		if (fp_mask + 1 < fp_max)
+			fp_grow();
+		else
+			log_event("- dupe suppression: fingerprint table full, "
+			          "further new lines are not checked");
+	}
+
+	return 1;
+}
+
+/*
+ * CandidateFilter: a blocked Bloom filter of the candidates that rules have
+ * produced in this session, of CandidateFilterMemory MiB.  A candidate that
+ * a previous rule already produced is dropped before it gets hashed, which
+ * pays off with slow hashes where rules often collide.  Each candidate sets
+ * CF_BITS bits within a single 512-bit block, so a lookup is one cache miss.
+ * Being probabilistic, it also drops a small share of new candidates, the
+ * more the fuller it gets.  The filter is saved along with the session and
+ * loaded again on restore.  Only candidates up to the restore point may be in
+ * the saved filter, so the bits that later ones set are noted in cf_pending[]
+ * until fix_state() gets past them.
+ */
+#define CF_BLOCK_BITS			512
+#define CF_BITS				6
+#define CF_MAGIC			"JtR candidate filter v1"
+static uint64_t cf_blocks;
+
+static void cf_init(void)
+{
+	uint64_t size = (uint64_t)cfg_get_int(SECTION_OPTIONS, NULL,
+	                                      "CandidateFilterMemory") << 20;
+
+	if ((int64_t)size <= 0)
+		return;
+
+	for (cf_blocks = 1; cf_blocks * 2 * (CF_BLOCK_BITS / 8) <= size;)
+		cf_blocks <<= 1;
+	cf_table = mem_calloc(cf_blocks, CF_BLOCK_BITS / 8);
+
+	log_event("- Candidate filter of "LLu" MiB",
+	          (unsigned long long)(cf_blocks * (CF_BLOCK_BITS / 8)) >> 20);
+}
+
+/*
+ * Sets (or clears) the bits of a candidate's hash that are in bits, or
+ * whichever of them weren't set yet if bits is ~0U.  Returns which ones
+ * weren't set.
+ */
+static MAYBE_INLINE unsigned int cf_update(uint64_t hash, unsigned int bits,
+	int set)
+{
+	uint64_t hash2, *block;
+	unsigned int fresh = 0;
+	int i;
+
+	block = &cf_table[(hash & (cf_blocks - 1)) * (CF_BLOCK_BITS / 64)];
+	hash2 = (hash >> 32 | hash << 32) * 0x9e3779b97f4a7c15ULL;
+	for (i = 0; i < CF_BITS; i++, hash2 >>= 9) {
+		unsigned int bit = hash2 & (CF_BLOCK_BITS - 1);
+		uint64_t mask = 1ULL << (bit % 64);
+
+		if (!(bits & (1U << i)))
+			continue;
+		if (!set) {
+			block[bit / 64] &= ~mask;
+			continue;
+		}
+		if (!(block[bit / 64] & mask)) {
+			block[bit / 64] |= mask;
+			fresh |= 1U << i;
+		}
+	}
+
+	return fresh;
+}
+
+/* Returns 1 if the candidate was (probably) produced before, and notes it */
+static MAYBE_INLINE int cf_dupe(const char *word)
+{
+	uint64_t hash;
+	unsigned int fresh;
+
+	if (!cf_table)
+		return 0;
+
+	hash = str_hash64(word);
+	if (!(fresh = cf_update(hash, ~0U, 1))) {
+		add32to64(&status.filtered, 1);
+		return 1;
+	}
+
+	if (cf_pending_count >= cf_pending_size) {
+		cf_pending_size = cf_pending_size ? cf_pending_size * 2 : 0x1000;
+		cf_pending = realloc(cf_pending,
+		                     cf_pending_size * sizeof(*cf_pending));
+		if (!cf_pending)
+			pexit("realloc");
+	}
+	cf_pending[cf_pending_count].hash = hash;
+	cf_pending[cf_pending_count++].bits = fresh;
+
+	return 0;
+}
+
+/*
+ * Called once the first count pending candidates are behind the restore
+ * point.
+ */
+static void cf_commit(size_t count)
+{
+	if (count > cf_pending_count)
+		count = cf_pending_count;
+	if (count)
+	memmove(cf_pending, &cf_pending[count],
+	        (cf_pending_count - count) * sizeof(*cf_pending));
+	cf_pending_count -= count;
+	cf_hybrid_count = 0;
+}
+
+/* "john.rec" goes with "john.cfilter", and so on */
+static char *cf_name(void)
+{
+	static char name[PATH_BUFFER_SIZE + 1];
+	char *rec = path_expand(rec_name);
+	size_t len = strlen(rec);
+
+	if (len >= sizeof(RECOVERY_SUFFIX) - 1 &&
+	    !strcmp(rec + len - (sizeof(RECOVERY_SUFFIX) - 1), RECOVERY_SUFFIX))
+		len -= sizeof(RECOVERY_SUFFIX) - 1;
+	snprintf(name, sizeof(name), "%.*s.cfilter", (int)len, rec);
+
+	return name;
+}
+
+static void cf_save(void)
+{
+	char tmp_name[PATH_BUFFER_SIZE + 16];
+	FILE *file;
+	size_t size = cf_blocks * (CF_BLOCK_BITS / 8), i;
+	int error;
+
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", cf_name());
+	if (!(file = fopen(tmp_name, "wb"))) {
+		log_event("! Can't write candidate filter %s: %s",
+		          tmp_name, strerror(errno));
+		return;
+	}
+	fprintf(file, CF_MAGIC "\n"Zu" %u %u\n", size,
+	        status.filtered.hi, status.filtered.lo);
+
+/* Leave out what's past the restore point while writing */
+	for (i = 0; i < cf_pending_count; i++)
+		cf_update(cf_pending[i].hash, cf_pending[i].bits, 0);
+	error = fwrite(cf_table, 1, size, file) != size;
+	for (i = 0; i < cf_pending_count; i++)
+		cf_update(cf_pending[i].hash, cf_pending[i].bits, 1);
+
+	if ((fclose(file) | error) || rename(tmp_name, cf_name())) {
+		log_event("! Can't write candidate filter %s: %s",
+		          cf_name(), strerror(errno));
+		unlink(tmp_name);
+	}
+}
+
+static void cf_load(void)
+{
+	char magic[sizeof(CF_MAGIC) + 1];
+	FILE *file;
+	size_t size;
+	unsigned int hi, lo;
+
+	if (!(file = fopen(cf_name(), "rb"))) {
+		log_event("- No saved candidate filter, starting with an "
+		          "empty one");
+		return;
+	}
+	if (!fgetl(magic, sizeof(magic), file) || strcmp(magic, CF_MAGIC) ||
+	    fscanf(file, Zu" %u %u", &size, &hi, &lo) != 3 ||
+	    getc(file) != '\n' ||
+	    size != cf_blocks * (CF_BLOCK_BITS / 8) ||
+	    fread(cf_table, 1, size, file) != size) {
+		log_event("- Saved candidate filter %s doesn't match, "
+		          "starting with an empty one", cf_name());
+		memset(cf_table, 0, cf_blocks * (CF_BLOCK_BITS / 8));
+	} else {
+		status.filtered.hi = hi;
+		status.filtered.lo = lo;
+		log_event("- Restored candidate filter %s", cf_name());
+	}
+	fclose(file);
+}
+
+/*
+ * Reads the next block of lines for the blocked mode.  Comment lines are
+ * kept as ~0 entries so that line numbers (and thus node shares) stay exact.
+ */
+static int64_t read_block(char *line)
+{
+	size_t used = 0, len;
+	int64_t end;
+
+	block_lines = 0;
+	while (used + LINE_BUFFER_SIZE <= block_alloc &&
+	       (mem_map ? mgetl(line) :
+	        fgetl(line, LINE_BUFFER_SIZE, word_file))) {
+		char *word = line;
+
+		if (block_lines % 0x10000 == 0) {
+			block_words = realloc(block_words,
+			    (block_lines + 0x10000) * sizeof(*block_words));
+			if (!block_words)
+				pexit("realloc");
+		}
+
+		clean_bom(line);
+		if (line[0] == '#' && !strncmp(line, "#!comment", 9)) {
+			block_words[block_lines++] = ~0U;
+			continue;
+		}
+		if (options.input_enc != options.target_enc ||
+		    (options.flags & FLG_LOOPBACK_CHK))
+			word = convert(line);
+		if (fp_table && !fp_unique(word)) {
+			block_words[block_lines++] = ~0U;
+			continue;
+		}
+		len = strlen(word) + 1;
+		memcpy(block_buf + used, word, len);
+		block_words[block_lines++] = used;
+		used += len;
+	}
+
+	end = mem_map ? map_pos - mem_map : jtr_ftell64(word_file);
+	block_size = end > block_pos ? end - block_pos : 0;
+
+	return block_lines;
+}
+
+/*
+ * The blocked mode's main loop, see above.  Rules are distributed across
+ * nodes the same way as in the normal mode, the remainder ones by words.
+ * Returns non-zero if aborted or everything got cracked.
+ */
+static int do_blocked_rules(struct db_main *db, char *last, char *regex,
+	int regex_case, char *regex_alpha)
+{
+	struct rpp_context ctx;
+	struct {
+		char *rule;
+		int number, by_words;
+	} *list;
+	char line[LINE_BUFFER_SIZE];
+	char *prerule, *rule, *word;
+	int count, dist_switch, start_line, aborted = 1;
+	int64_t i;
+
+	if (rpp_init(&ctx, options.activewordlistrules))
+		return 1;
+
+	dist_switch = rule_count;
+	if (options.node_count)
+		dist_switch = rule_count - rule_count % options.node_count;
+
+	list = mem_alloc(rule_count * sizeof(*list));
+	count = 0;
+	for (rule_number = 0; (prerule = rpp_next(&ctx)); rule_number++) {
+		int by_words = rule_number >= dist_switch;
+
+		if (options.node_count && !by_words) {
+			int for_node = rule_number % options.node_count + 1;
+			if (for_node < options.node_min ||
+			    for_node > options.node_max)
+				continue;
+		}
+		if (!(rule = rules_reject(prerule, -1, last, db))) {
+			if (options.verbosity > VERB_DEFAULT)
+			log_event("- Rule #%d: '%.100s' rejected",
+			          rule_number + 1, prerule);
+			continue;
+		}
+		if (options.verbosity > VERB_DEFAULT)
+		log_event("- Rule #%d: '%.100s' accepted", rule_number + 1,
+		          prerule);
+		list[count].rule = str_alloc_copy(rule);
+		list[count].number = rule_number;
+		list[count++].by_words = by_words;
+	}
+	block_rule_count = count;
+
+	block_alloc = options.max_wordfile_memory;
+	if (block_alloc < 0x20000)
+		block_alloc = 0x20000;
+	block_buf = mem_alloc(block_alloc);
+	log_event("- Blocked mode: %d rules over blocks of up to "Zu" bytes",
+	          count, block_alloc);
+
+/* Restored session: resume within its block */
+	block_rule = start_line = 0;
+	block_pos = block_line = 0;
+	if (resume_block_line >= 0) {
+		block_pos = resume_block_pos;
+		block_line = resume_block_line;
+		start_line = resume_line;
+		for (block_rule = 0; block_rule < count; block_rule++)
+			if (list[block_rule].number >= resume_rule)
+				break;
+		resume_block_line = -1;
+		if (mem_map)
+			map_pos = mem_map + block_pos;
+		else
+		if (jtr_fseek64(word_file, block_pos, SEEK_SET))
+			pexit(STR_MACRO(jtr_fseek64));
+	}
+
+	while (count && read_block(line)) {
+		for (; block_rule < count; block_rule++) {
+			rule = list[block_rule].rule;
+			rule_number = list[block_rule].number;
+			for (i = start_line; i < block_lines; i++) {
+				line_number = i + 1;
+				if (block_words[i] == ~0U)
+					continue;
+				if (options.node_count &&
+				    list[block_rule].by_words) {
+					int for_node = (block_line + i) %
+						options.node_count + 1;
+					if (for_node < options.node_min ||
+					    for_node > options.node_max)
+						continue;
+				}
+				if (!(word = rules_apply(block_buf +
+				    block_words[i], rule, -1, last)) ||
+				    cf_dupe(word))
+					continue;
+				last = word;
+#if HAVE_REXGEN
+				if (regex) {
+					if (do_regex_hybrid_crack(db, regex,
+					    word, regex_case, regex_alpha))
+						goto done;
+					wordlist_hybrid_fix_state();
+				} else
+#endif
+				if (f_new) {
+					if (do_external_hybrid_crack(db, word))
+						goto done;
+					wordlist_hybrid_fix_state();
+				} else
+				if (options.mask) {
+					if (do_mask_crack(word))
+						goto done;
+				} else
+				if (ext_filter(word))
+				if (crk_process_key(word))
+					goto done;
+			}
+			start_line = 0;
+		}
+		block_rule = 0;
+		block_pos += block_size;
+		block_line += block_lines;
+		line_number = 0;
+	}
+	aborted = 0;
+
+done:
+	free(block_words);
+	block_words = NULL;
+	MEM_FREE(block_buf);
+	MEM_FREE(list);
+
+	return aborted;
+}
+
 void do_wordlist_crack(struct db_main *db, char *name, int rules)
 {
 	union {
@@ -572,7 +1876,7 @@ void do_wordlist_crack(struct db_main *db, char *name, int rules)
 	struct rpp_context ctx;
 	char *prerule="", *rule="", *word="";
 	char *(*apply)(char *word, char *rule, int split, char *last) = NULL;
-	int dist_switch=0;
+	int dist_switch=0, rec_saved;
 	unsigned long my_words=0, their_words=0, my_words_left=0;
 	int64_t file_len = 0;
 	int i, pipe_input = 0, max_pipe_words = 0, rules_keep = 0;
@@ -623,7 +1927,7 @@ void do_wordlist_crack(struct db_main *db, char *name, int rules)
 		name = options.wordlist = options.activepot;
 
 	/* These will ignore --save-memory */
-	if (loopBack || dupeCheck ||
+	if (loopBack ||
 	    (!options.max_wordfile_memory &&
 	     (options.flags & FLG_RULES)))
 		forceLoad = 1;
@@ -659,8 +1963,12 @@ void do_wordlist_crack(struct db_main *db, char *name, int rules)
 			error();
 		}
 
+#if WORDLIST_DECOMPRESS
+		dec_init(path_expand(name), file_len);
+#endif
 #ifdef HAVE_MMAP
-		if (cfg_get_bool(SECTION_OPTIONS, NULL, "WordlistMemoryMap", 1))
+		if (!dec_active() &&
+		    cfg_get_bool(SECTION_OPTIONS, NULL, "WordlistMemoryMap", 1))
 		{
 			log_event("- memory mapping wordlist ("LLd" bytes)",
 			          (long long)file_len);
@@ -691,6 +1999,30 @@ void do_wordlist_crack(struct db_main *db, char *name, int rules)
 		}
 #endif
 
+		sliced = options.node_count > 1 && !dec_active() &&
+			cfg_get_bool(SECTION_OPTIONS, NULL,
+			             "WordlistNodeSlices", 0);
+		slice_start = 0;
+		slice_end = file_len;
+		if (sliced) {
+			slice_start = slice_bound(file_len *
+				(options.node_min - 1) / options.node_count,
+				file_len);
+			slice_end = slice_bound(file_len *
+				options.node_max / options.node_count,
+				file_len);
+			if (mem_map) {
+				map_pos = mem_map + slice_start;
+				map_end = mem_map + slice_end;
+				map_scan_end = map_end - VSCANSZ;
+			} else
+			if (file_seek(slice_start))
+				pexit(STR_MACRO(jtr_fseek64));
+			log_event("- Reading bytes "LLd" to "LLd" of the file "
+			          "for this node",
+			          (long long)slice_start, (long long)slice_end);
+			ourshare = slice_end - slice_start;
+		} else
 		ourshare = options.node_count ?
 			(file_len / options.node_count) *
 			(options.node_max - options.node_min + 1)
@@ -701,14 +2033,19 @@ void do_wordlist_crack(struct db_main *db, char *name, int rules)
 		    (options.flags & FLG_RULES))
 			forceLoad = 1;
 
+		/* Larger files get fingerprint-based dupe suppression */
+		if (dupeCheck && ourshare < options.max_wordfile_memory)
+			forceLoad = 1;
+
 		/* If it's worth it we make a ready-to-use buffer with the
 		   (possibly converted) contents ready to use as an array.
 		   Disabled for external filter - it would trash the buffer. */
-		if (!(options.flags & FLG_EXTERNAL_CHK) && forceLoad) {
+		if (!(options.flags & FLG_EXTERNAL_CHK) && forceLoad &&
+		    !dec_active()) {
 			char *aep;
 
 			// Load only this node's share of words to memory
-			if (mem_map && options.node_count > 1 &&
+			if (mem_map && options.node_count > 1 && !sliced &&
 			    (file_len > options.node_count * (length * 100))) {
 				/* Check net size for our share. */
 				for (nWordFileLines = 0;; ++nWordFileLines) {
@@ -789,6 +2126,12 @@ void do_wordlist_crack(struct db_main *db, char *name, int rules)
 				          "("LLd" bytes, max_size="Zu")",
 				          name, (long long)file_len,
 				          options.max_wordfile_memory);
+				if (sliced) {
+					file_len = slice_end - slice_start;
+					if (jtr_fseek64(word_file, slice_start,
+					                SEEK_SET))
+						pexit(STR_MACRO(jtr_fseek64));
+				} else
 				if (options.node_count > 1 && john_main_process)
 				fprintf(stderr,"Each node loaded the whole "
 				        "wordfile to memory\n");
@@ -1052,6 +2395,8 @@ SKIP_MEM_MAP_LOAD:
 
 REDO_AFTER_LMLOOP:
 
+	fp_clear();
+
 	if (rules) {
 		if (rpp_init(rule_ctx = &ctx, options.activewordlistrules)) {
 			log_event("! No \"%s\" mode rules found",
@@ -1083,9 +2428,42 @@ REDO_AFTER_LMLOOP:
 	line_number = 0;
 	loop_line_no = 0;
 
+	blocked = rules && rule_count > 1 && name && !nWordFileLines &&
+		!do_lmloop && !pipe_input && !sliced && !dec_active() &&
+		cfg_get_bool(SECTION_OPTIONS, NULL, "WordlistBlockedRules", 0);
+
+	batch_size = 0;
+#ifdef _OPENMP
+	if (rules && nWordFileLines && omp_get_max_threads() > 1 &&
+#if HAVE_REXGEN
+	    !regex &&
+#endif
+	    !f_new && !options.mask &&
+	    cfg_get_bool(SECTION_OPTIONS, NULL, "WordlistParallelRules", 1))
+		batch_size = omp_get_max_threads() * RULES_BATCH_PER_THREAD;
+	if (batch_size && !batch_buf) {
+		batch_words = mem_alloc(batch_size * sizeof(*batch_words));
+		batch_lines = mem_alloc(batch_size * sizeof(*batch_lines));
+		batch_buf = mem_alloc(batch_size * (PLAINTEXT_BUFFER_SIZE + 1));
+		log_event("- Applying rules on %d threads",
+		          omp_get_max_threads());
+	}
+#endif
+
 	if (init_once) {
 		init_once = 0;
 
+		if (name && !nWordFileLines && !sliced && !blocked &&
+		    word_file != stdin && !dec_active() &&
+		    cfg_get_bool(SECTION_OPTIONS, NULL, "WordlistLineIndex", 0))
+			line_index_init(path_expand(name));
+
+		if (dupeCheck && name && !nWordFileLines && !loopBack)
+			fp_init();
+
+		if (rules)
+			cf_init();
+
 		status_init(get_progress, 0);
 
 		rec_restore_mode(restore_state);
@@ -1111,7 +2489,7 @@ REDO_AFTER_LMLOOP:
 	their_words = 0;
 	/* myWordFileLines indicates we already have OUR share of words in
 	   memory buffer, so no further skipping. */
-	if (options.node_count && !myWordFileLines) {
+	if (options.node_count && !myWordFileLines && !blocked && !sliced) {
 		int rule_rem = rule_count % options.node_count;
 		const char *now, *later = "";
 		dist_switch = rule_count - rule_rem;
@@ -1153,6 +2531,15 @@ REDO_AFTER_LMLOOP:
 		}
 	}
 
+	if (blocked) {
+#if HAVE_REXGEN
+		do_blocked_rules(db, last, regex, regex_case, regex_alpha);
+#else
+		do_blocked_rules(db, last, NULL, 0, NULL);
+#endif
+		prerule = NULL;
+	}
+
 	if (prerule)
 	do {
 		struct list_entry *joined;
@@ -1249,9 +2636,58 @@ REDO_AFTER_LMLOOP:
 			}
 		} while ((joined = joined->next));
 
+		else if (rule && nWordFileLines && batch_size)
+		while (line_number < nWordFileLines) {
+			int64_t next;
+			int count = 0, i;
+
+			while (count < batch_size &&
+			       line_number < nWordFileLines) {
+				if (options.node_count && !myWordFileLines &&
+				    !sliced)
+				if (!dist_rules) {
+					int for_node = line_number %
+						options.node_count + 1;
+					int skip = for_node < options.node_min ||
+						for_node > options.node_max;
+					if (skip) {
+						line_number++;
+						continue;
+					}
+				}
+				clean_bom(words[line_number]);
+				batch_words[count] = words[line_number];
+				batch_lines[count++] = ++line_number;
+			}
+			next = line_number;
+
+/* The batch is about to be overwritten, and last may point into it */
+			strnzcpy(batch_last, last, sizeof(batch_last));
+			last = batch_last;
+
+			rules_apply_batch(batch_words, count, rule, batch_buf);
+
+			for (i = 0; i < count; i++) {
+				if (!(word = batch_words[i]) ||
+				    !strcmp(word, last) || cf_dupe(word))
+					continue;
+				line_number = batch_lines[i];
+				last = word;
+				if (ext_filter(word))
+				if (crk_process_key(word)) {
+					rules = 0;
+					pipe_input = 0;
+					break;
+				}
+			}
+			if (!rules)
+				break;
+			line_number = next;
+		}
+
 		else if (rule && nWordFileLines)
 		while (line_number < nWordFileLines) {
-			if (options.node_count && !myWordFileLines)
+			if (options.node_count && !myWordFileLines && !sliced)
 			if (!dist_rules) {
 				int for_node = line_number %
 					options.node_count + 1;
@@ -1271,7 +2707,8 @@ REDO_AFTER_LMLOOP:
 
 			line_number++;
 
-			if ((word = apply(line, rule, -1, last))) {
+			if ((word = apply(line, rule, -1, last)) &&
+			    !cf_dupe(word)) {
 				last = word;
 #if HAVE_REXGEN
 				if (regex) {
@@ -1316,8 +2753,8 @@ REDO_AFTER_LMLOOP:
 		}
 
 		else if (rule)
-		while (mem_map ? mgetl(line) :
-		       fgetl(line, LINE_BUFFER_SIZE, word_file)) {
+		while (slice_left() &&
+		       (mem_map ? mgetl(line) : file_getl(line))) {
 
 			clean_bom(line);
 
@@ -1345,8 +2782,11 @@ process_word:
 					if (!strcmp(line, last))
 						goto next_word;
 				}
+				if (fp_table && !fp_unique(line))
+					goto next_word;
 
-				if ((word = apply(line, rule, -1, last))) {
+				if ((word = apply(line, rule, -1, last)) &&
+				    !(rules && cf_dupe(word))) {
 					if (rules)
 						last = word;
 					else
@@ -1427,10 +2867,11 @@ next_rule:
 			line_number = 0;
 			if (!nWordFileLines && word_file != stdin) {
 				if (mem_map)
-					map_pos = mem_map;
+					map_pos = mem_map + slice_start;
 				else
-				if (jtr_fseek64(word_file, 0, SEEK_SET))
+				if (file_seek(slice_start))
 					pexit(STR_MACRO(jtr_fseek64));
+				fp_clear();
 			}
 			if (their_words &&
 			    skip_lines(options.node_min - 1, line))
@@ -1450,7 +2891,21 @@ next_rule:
 		goto GRAB_NEXT_PIPE_LOAD;
 
 	crk_done();
-	rec_done(event_abort || (status.pass && db->salts));
+	rec_saved = event_abort || (status.pass && db->salts);
+	rec_done(rec_saved);
+
+	MEM_FREE(batch_words);
+	MEM_FREE(batch_lines);
+	MEM_FREE(batch_buf);
+	MEM_FREE(line_index);
+	line_index_count = 0;
+	MEM_FREE(fp_table);
+	if (cf_table && !rec_saved)
+		unlink(cf_name());
+	MEM_FREE(cf_table);
+	free(cf_pending);
+	cf_pending = NULL;
+	cf_pending_count = cf_pending_size = cf_hybrid_count = 0;
 
 	if (ferror(word_file)) pexit("fgets");
 
@@ -1468,6 +2923,9 @@ next_rule:
 		if (mem_map)
 			munmap(mem_map, file_len);
 		map_pos = map_end = NULL;
+#endif
+#if WORDLIST_DECOMPRESS
+		dec_done();
 #endif
 		if (fclose(word_file))
 			pexit("fclose");